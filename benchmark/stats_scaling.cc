@@ -0,0 +1,90 @@
+// Microbenchmark: how `StatsPlugin::record` scales with the number of concurrently recording threads.
+//
+// Compares the sharded counters against the layout they replaced (one shared array of atomics, `fetch_add` on every
+// counter). With sharding, ns/op should stay flat as threads are added; with shared atomics it grows with contention.
+//
+//   g++ -O2 -std=c++23 -pthread benchmark/stats_scaling.cc -o stats_scaling && ./stats_scaling [ops per thread]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "../plugins/stats.hh"
+
+// The default size histogram
+static constexpr LogLinearLayout STATS_HIST_LAYOUT{.min_exp = 12, .max_exp = 20, .sub_bits = 0};
+static constexpr size_t STATS_HIST_EXPLICIT_BUCKETS = STATS_HIST_LAYOUT.explicit_buckets();
+static constexpr size_t STATS_HIST_TOTAL_BUCKETS = STATS_HIST_LAYOUT.buckets();
+
+// What `StatsPlugin::record` did before sharding
+class SharedAtomics {
+  std::atomic<uint64_t> m_ops_total[IOFS_OP_COUNT]{};
+  std::atomic<uint64_t> m_duration_ns[IOFS_OP_COUNT]{};
+  std::atomic<uint64_t> m_hist_bucket[2][STATS_HIST_TOTAL_BUCKETS]{};
+  std::atomic<uint64_t> m_hist_count[2]{};
+  std::atomic<uint64_t> m_hist_sum[2]{};
+
+public:
+  void record(iofs_op_t op, uint64_t duration_ns, uint64_t units) {
+    m_ops_total[op].fetch_add(1, std::memory_order_relaxed);
+    m_duration_ns[op].fetch_add(duration_ns, std::memory_order_relaxed);
+    if (op == IOFS_OP_READ || op == IOFS_OP_WRITE) {
+      bool is_write = op == IOFS_OP_WRITE;
+      size_t bucket = 0;
+      while (bucket < STATS_HIST_EXPLICIT_BUCKETS && units > STATS_HIST_LAYOUT.upper_bound(bucket)) {
+        ++bucket;
+      }
+      for (size_t b = bucket; b < STATS_HIST_TOTAL_BUCKETS; ++b) {
+        m_hist_bucket[is_write][b].fetch_add(1, std::memory_order_relaxed);
+      }
+      m_hist_count[is_write].fetch_add(1, std::memory_order_relaxed);
+      m_hist_sum[is_write].fetch_add(units, std::memory_order_relaxed);
+    }
+  }
+};
+
+// A metadata-heavy mix with some 4K reads and writes, like `benchmark/high_iops.sh` against a build tree
+static constexpr iofs_op_t MIX[] = {
+  IOFS_OP_GETATTR, IOFS_OP_READ, IOFS_OP_GETATTR, IOFS_OP_WRITE,
+  IOFS_OP_ACCESS, IOFS_OP_READ, IOFS_OP_OPEN, IOFS_OP_RELEASE,
+};
+
+template <typename Plugin>
+static double ns_per_op(unsigned threads, uint64_t ops_per_thread) {
+  Plugin plugin;
+  std::atomic<unsigned> ready{0};
+  std::vector<std::thread> workers;
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned t = 0; t < threads; ++t) {
+    workers.emplace_back([&] {
+      // Start together, so all threads actually overlap
+      ready.fetch_add(1);
+      while (ready.load() < threads) {
+      }
+      for (uint64_t i = 0; i < ops_per_thread; ++i) {
+        plugin.record(MIX[i % std::size(MIX)], 1000 + (i & 255), 4096);
+      }
+    });
+  }
+  for (auto &w : workers) {
+    w.join();
+  }
+  auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  // Wall time per op of a single thread: flat means perfect scaling
+  return elapsed / static_cast<double>(ops_per_thread);
+}
+
+int main(int argc, char **argv) {
+  uint64_t ops_per_thread = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 2'000'000;
+  unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+
+  std::printf("%8s %14s %14s\n", "threads", "sharded ns/op", "shared ns/op");
+  for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+    std::printf("%8u %14.2f %14.2f\n", threads, ns_per_op<StatsPlugin>(threads, ops_per_thread),
+                ns_per_op<SharedAtomics>(threads, ops_per_thread));
+  }
+}
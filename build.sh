@@ -5,6 +5,20 @@ pushd $SCRIPT_DIR
 
 # build iofs-ng
 #
+# io_uring is optional, see `UringEngine`
+URING_FLAGS=""
+if pkg-config --exists liburing; then
+  URING_FLAGS="-DIOFS_WITH_IO_URING `pkg-config liburing --cflags --libs`"
+fi
+#
+# Plugins can also be compiled into the binary, e.g. `IOFS_STATIC_PLUGINS="stats lastn" ./build.sh`, see
+# `StaticPluginSet`. Don't additionally load their `.so`, or they export everything twice.
+STATIC_FLAGS=""
+for p in ${IOFS_STATIC_PLUGINS:-}; do
+  test -f "plugins/$p.hh" || { echo "Unknown static plugin: $p"; exit 1; }
+  STATIC_FLAGS="$STATIC_FLAGS -DIOFS_STATIC_PLUGIN_${p^^}"
+done
+#
 # Note to future self: I disabled all warnings from `include` by replacing `-Iinclude` with `-isystem include` and
 # thus pretending its a system include directory, since `httplib` did some C-style casting fuckery
 g++ -g3 \
@@ -12,12 +26,12 @@ g++ -g3 \
   -std=c++23 \
   -isystem include \
   src/*.cc \
-  `pkg-config fuse3 --cflags --libs` -lcurl \
+  `pkg-config fuse3 --cflags --libs` -lcurl $URING_FLAGS $STATIC_FLAGS \
   -o iofs-ng
 
 # build the plugins
 pushd plugins
-PLUGINS=("sample" "lastn" "stats")
+PLUGINS=("sample" "lastn" "stats" "sketch" "access" "attribution")
 for p in "${PLUGINS[@]}"; do
   g++ -g3 -fPIC -shared -std=c++23 "$p.cc" -o "$p.so"
 done
@@ -3,20 +3,46 @@ import subprocess
 import sys
 from pathlib import Path
 
+import pytest
+
 from utils import iofs_mount
 
 E2E_DIR = Path(__file__).parent.resolve()
 
 
-def test_c_level_posix_compliance():
+# Long kernel caching must stay consistent as long as we invalidate after our own ops
+CACHING = {
+    "default": (),
+    "cached": ("--attr-timeout", "30", "--entry-timeout", "30", "--negative-timeout", "30", "--invalidate"),
+}
+
+
+@pytest.mark.parametrize("caching", CACHING.keys())
+@pytest.mark.parametrize("backend", ["highlevel", "lowlevel"])
+def test_c_level_posix_compliance(backend, caching):
     tester_bin = E2E_DIR / "tester"
     assert tester_bin.exists()
-    with iofs_mount(show_output=False) as (fake_dir, real_dir):
+    extra_args = ("--backend", backend, *CACHING[caching])
+    with iofs_mount(show_output=False, extra_args=extra_args) as (fake_dir, real_dir):
         print(f"running C {str(tester_bin)}")
         result = subprocess.run([str(tester_bin), str(fake_dir), str(real_dir)], check=False)
         assert result.returncode == 0
 
 
+@pytest.mark.skipif(subprocess.run(["pkg-config", "--exists", "liburing"]).returncode != 0,
+                    reason="iofs-ng is only built with io_uring if liburing is installed")
+def test_uring_engine_in_background():
+    """
+    Tests that the io_uring engine still replies once iofs-ng has daemonized, which only the forking thread survives.
+    """
+    tester_bin = E2E_DIR / "tester"
+    extra_args = ("--backend", "lowlevel", "--io-engine", "uring")
+    with iofs_mount(show_output=False, extra_args=extra_args, foreground=False) as (fake_dir, real_dir):
+        # A request queued on a ring without a completion thread would hang forever
+        result = subprocess.run([str(tester_bin), str(fake_dir), str(real_dir)], check=False, timeout=120)
+        assert result.returncode == 0
+
+
 def test_build_linux_kernel():
     """
     Stress-tests the FUSE filesystem by cloning and compiling the Linux kernel.
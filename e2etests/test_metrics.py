@@ -1,7 +1,9 @@
 import os
 import re
+import time
+import pytest
 import requests
-from utils import iofs_mount
+from utils import REPO_ROOT, iofs_mount
 
 
 def test_metrics_endpoint_is_alive():
@@ -90,8 +92,8 @@ def test_prometheus_metrics_with_noise():
         # Prometheus histograms are cumulative. For a write of size X:
         # - Any bucket with le < X should NOT increment (delta = 0)
         # - Any bucket with le >= X MUST increment (delta = 1)
-        # Hardcoded from now, stolen from the plugin...
-        buckets = [4096, 8192, 16384, 65536, 131072, 262144]
+        # Hardcoded from now, stolen from the plugin (default `buckets`: powers of two from 4 KiB to 1 MiB)
+        buckets = [4096 << i for i in range(9)]
 
         for b in buckets:
             pre_b = pre_metrics.get(f'iofs_io_bytes_bucket{{op="write",le="{b}"}}', 0)
@@ -118,3 +120,267 @@ def test_prometheus_metrics_with_noise():
         pre_reads = pre_metrics.get('iofs_ops_total{op="read"}', 0)
         post_reads = post_metrics.get('iofs_ops_total{op="read"}', 0)
         assert post_reads - pre_reads >= 1, "Expected at least 1 read operation"
+
+        # E. Strict check: Latency histograms.
+        # The write lands in exactly one latency bucket, both per op and for its size class.
+        pre_lat = pre_metrics.get('iofs_op_latency_ns_count{op="write"}', 0)
+        post_lat = post_metrics.get('iofs_op_latency_ns_count{op="write"}', 0)
+        assert post_lat - pre_lat == 1, "Expected exactly 1 write in the latency histogram"
+
+        pre_joint = pre_metrics.get(f'iofs_io_latency_by_size_ns_count{{op="write",size_le="{payload_size}"}}', 0)
+        post_joint = post_metrics.get(f'iofs_io_latency_by_size_ns_count{{op="write",size_le="{payload_size}"}}', 0)
+        assert post_joint - pre_joint == 1, "Expected exactly 1 write in its size class latency histogram"
+
+
+@pytest.mark.parametrize("profile", ["standard", "throughput", "metadata", "strict"])
+def test_negotiated_connection_is_exported(profile):
+    """
+    Tests that the capability profile and what the kernel actually agreed to show up in the metrics.
+    """
+    with iofs_mount(show_output=False, extra_args=("--profile", profile)):
+        metrics = get_metrics()
+
+        assert any(k.startswith(f'iofs_fuse_connection_info{{profile="{profile}"') for k in metrics)
+        assert metrics["iofs_fuse_max_write_bytes"] > 0
+
+        # Nothing can be wanted that the kernel does not offer
+        for key, value in metrics.items():
+            if key.startswith("iofs_fuse_capability{") and 'state="wanted"' in key and value == 1:
+                assert metrics[key.replace('state="wanted"', 'state="capable"')] == 1, key
+
+
+@pytest.mark.parametrize("backend", ["highlevel", "lowlevel"])
+def test_worker_stats_are_exported(backend):
+    """
+    Tests that ops are attributed to worker slots, of which there are never more than `--workers`.
+    """
+    extra_args = ("--backend", backend, "--workers", "4", "--clone-fd", "--worker-stats")
+    with iofs_mount(show_output=False, extra_args=extra_args) as (fake_dir, real_dir):
+        for i in range(32):
+            (fake_dir / f"file_{i}").write_bytes(b"A" * 4096)
+        metrics = get_metrics()
+
+        assert metrics['iofs_workers_max{clone_fd="1"}'] == 4
+        ops = {k: v for k, v in metrics.items() if k.startswith("iofs_worker_ops_total{")}
+        assert 1 <= len(ops) <= 4
+        assert sum(ops.values()) >= 32
+
+
+@pytest.mark.parametrize("ring_full", ["drop", "block", "inline"])
+def test_async_dispatch_reaches_plugins(ring_full):
+    """
+    Tests that measurements queued in the worker rings are eventually delivered to the plugins.
+    """
+    extra_args = ("--dispatch", "async", "--ring-size", "64", "--ring-full", ring_full)
+    with iofs_mount(show_output=False, extra_args=extra_args) as (fake_dir, real_dir):
+        for i in range(32):
+            (fake_dir / f"file_{i}").write_bytes(b"A" * 4096)
+
+        # The consumer drains the rings in the background
+        for _ in range(50):
+            metrics = get_metrics()
+            delivered = metrics['iofs_dispatch_events_total'] + metrics['iofs_dispatch_inlined_total']
+            if metrics.get('iofs_ops_total{op="write"}', 0) >= 32:
+                break
+            time.sleep(0.1)
+
+        assert metrics["iofs_dispatch_ring_size"] == 64
+        assert metrics["iofs_dispatch_rings"] >= 1
+        if ring_full == "drop":
+            assert metrics.get('iofs_ops_total{op="write"}', 0) + metrics["iofs_dispatch_dropped_total"] >= 32
+        else:
+            assert metrics["iofs_dispatch_dropped_total"] == 0
+            assert metrics['iofs_ops_total{op="write"}'] >= 32
+        assert delivered > 0
+
+
+def test_plugins_can_be_swapped_while_mounted():
+    """
+    Tests unloading and reloading a plugin through the control endpoint while the file system is in use.
+    """
+    control = "http://127.0.0.1:9091/plugins"
+    stats = str(REPO_ROOT / "plugins/stats.so")
+    with iofs_mount(show_output=False, extra_args=("--control", "9091")) as (fake_dir, real_dir):
+        assert stats in requests.get(control, timeout=2).text
+
+        assert requests.delete(control, params={"path": stats}, timeout=5).status_code == 204
+        (fake_dir / "while_unloaded").write_bytes(b"A" * 4096)
+        metrics = get_metrics()
+        assert not any(k.startswith('exporter_plugin_info{name="StatsPlugin"') for k in metrics)
+        assert not any(k.startswith("iofs_ops_total") for k in metrics)
+
+        # Unknown plugins are rejected
+        assert requests.delete(control, params={"path": stats}, timeout=5).status_code == 404
+        assert requests.post(control, params={"path": "/nonexistent.so"}, timeout=5).status_code == 400
+
+        assert requests.post(control, params={"path": stats}, timeout=5).status_code == 201
+        (fake_dir / "after_reload").write_bytes(b"A" * 4096)
+        metrics = get_metrics()
+        assert metrics['iofs_ops_total{op="write"}'] >= 1
+
+
+def test_plugin_configuration_is_applied():
+    """
+    Tests that a plugin loaded with a configuration string only counts what it was told to.
+    """
+    control = "http://127.0.0.1:9092/plugins"
+    stats = str(REPO_ROOT / "plugins/stats.so")
+    with iofs_mount(show_output=False, extra_args=("--control", "9092")) as (fake_dir, real_dir):
+        assert requests.delete(control, params={"path": stats}, timeout=5).status_code == 204
+
+        # Typos are rejected instead of silently falling back to the defaults
+        assert requests.post(control, params={"path": stats + ":ops=wirte"}, timeout=5).status_code == 400
+        assert requests.post(control, params={"path": stats + ":nope=1"}, timeout=5).status_code == 400
+
+        spec = stats + ":ops=write;buckets=log2:4K-16K"
+        assert requests.post(control, params={"path": spec}, timeout=5).status_code == 201
+        assert "ops=write;buckets=log2:4K-16K" in requests.get(control, timeout=2).text
+
+        (fake_dir / "configured").write_bytes(b"A" * 4096)
+        os.stat(fake_dir / "configured")
+        metrics = get_metrics()
+        assert metrics['iofs_ops_total{op="write"}'] >= 1
+        assert 'iofs_ops_total{op="getattr"}' not in metrics
+        assert 'iofs_io_bytes_bucket{op="write",le="16384"}' in metrics
+        assert 'iofs_io_bytes_bucket{op="write",le="32768"}' not in metrics
+
+
+def test_lastn_keeps_only_the_newest_entries():
+    """
+    Tests that the lastN ring exports its configured window, newest entries only.
+    """
+    control = "http://127.0.0.1:9093/plugins"
+    lastn = str(REPO_ROOT / "plugins/lastn.so")
+    with iofs_mount(show_output=False, extra_args=("--control", "9093")) as (fake_dir, real_dir):
+        assert requests.delete(control, params={"path": lastn}, timeout=5).status_code == 204
+        assert requests.post(control, params={"path": lastn + ":n=4"}, timeout=5).status_code == 201
+
+        for i in range(10):
+            (fake_dir / f"file_{i}").write_bytes(b"A" * 4096)
+        metrics = get_metrics()
+
+        assert metrics["lastN_capacity"] == 4
+        entries = [int(re.search(r'i="(\d+)"', k).group(1)) for k in metrics if k.startswith("lastN{")]
+        assert 1 <= len(entries) <= 4
+        assert max(entries) >= 9
+
+
+def test_lastn_flight_recorder_dumps_on_slow_ops(tmp_path):
+    """
+    Tests that the flight recorder dumps the ring on a latency trigger (rate limited) and on command.
+    """
+    control = "http://127.0.0.1:9094/plugins"
+    lastn = str(REPO_ROOT / "plugins/lastn.so")
+    with iofs_mount(show_output=False, extra_args=("--control", "9094")) as (fake_dir, real_dir):
+        assert requests.delete(control, params={"path": lastn}, timeout=5).status_code == 204
+        # Every op is slow enough, but only one dump per hour
+        spec = f"{lastn}:n=1024;dump_dir={tmp_path};trigger_ns=1;dump_interval=3600"
+        assert requests.post(control, params={"path": spec}, timeout=5).status_code == 201
+
+        for i in range(10):
+            (fake_dir / f"file_{i}").write_bytes(b"A" * 4096)
+        time.sleep(0.5)
+        metrics = get_metrics()
+        assert metrics["lastN_dumps_total"] == 1
+        assert metrics["lastN_dumps_suppressed_total"] >= 1
+
+        command = requests.post(control + "/command", params={"path": lastn, "command": "dump"}, timeout=5)
+        assert command.status_code == 200
+        time.sleep(0.5)
+        dumps = list(tmp_path.glob("lastn-*.bin"))
+        assert len(dumps) == 2
+        assert all(d.read_bytes()[:8] == b"IOFSLAST" for d in dumps)
+
+        unknown = requests.post(control + "/command", params={"path": lastn, "command": "nope"}, timeout=5)
+        assert unknown.status_code == 400
+
+
+def test_sketch_exports_quantiles_and_mergeable_sketches():
+    """
+    Tests that the sketch plugin exports latency quantiles and a serialized sketch per op and size class.
+    """
+    control = "http://127.0.0.1:9095/plugins"
+    sketch = str(REPO_ROOT / "plugins/sketch.so")
+    with iofs_mount(show_output=False, extra_args=("--control", "9095")) as (fake_dir, real_dir):
+        assert requests.post(control, params={"path": sketch + ":ops=write;sizes=log2:4K-16K"}, timeout=5).status_code == 201
+
+        for i in range(10):
+            (fake_dir / f"file_{i}").write_bytes(b"A" * 4096)
+        metrics = get_metrics()
+
+        count = metrics['iofs_op_latency_quantile_ns_count{op="write"}']
+        assert count >= 10
+        quantiles = [metrics[f'iofs_op_latency_quantile_ns{{op="write",quantile="{q}"}}'] for q in ("0.5", "0.9", "0.99", "0.999")]
+        assert 0 < quantiles[0] <= quantiles[1] <= quantiles[2] <= quantiles[3]
+        assert not any(k.startswith('iofs_op_latency_quantile_ns{op="getattr"') for k in metrics)
+        assert 'iofs_io_latency_by_size_quantile_ns_count{op="write",size_le="4096"}' in metrics
+
+        sketches = [k for k in metrics if k.startswith('iofs_op_latency_sketch{op="write"')]
+        assert len(sketches) == 1
+        assert metrics[sketches[0]] == count
+        assert re.search(r'sketch="[A-Za-z0-9+/=]+"', sketches[0])
+
+
+def test_access_patterns_are_classified_per_file():
+    """
+    Tests that a file written front to back is classified as sequential once it is closed.
+    """
+    control = "http://127.0.0.1:9096/plugins"
+    access = str(REPO_ROOT / "plugins/access.so")
+    with iofs_mount(show_output=False, extra_args=("--control", "9096")) as (fake_dir, real_dir):
+        assert requests.post(control, params={"path": access}, timeout=5).status_code == 201
+
+        with open(fake_dir / "sequential", "wb", buffering=0) as f:
+            for _ in range(8):
+                f.write(b"A" * 4096)
+        metrics = get_metrics()
+
+        assert metrics['iofs_access_calls_total{op="write",pattern="sequential"}'] >= 8
+        assert metrics['iofs_access_files_total{op="write",pattern="sequential"}'] >= 1
+        assert metrics['iofs_access_file_bytes_total{op="write",pattern="sequential"}'] >= 8 * 4096
+
+
+def test_io_is_attributed_to_its_user_and_process():
+    """
+    Tests that writes are counted for the uid and pid that issued them.
+    """
+    control = "http://127.0.0.1:9097/plugins"
+    attribution = str(REPO_ROOT / "plugins/attribution.so")
+    with iofs_mount(show_output=False, extra_args=("--control", "9097")) as (fake_dir, real_dir):
+        assert requests.post(control, params={"path": attribution + ":ops=write"}, timeout=5).status_code == 201
+
+        with open(fake_dir / "attributed", "wb", buffering=0) as f:
+            for _ in range(4):
+                f.write(b"A" * 4096)
+        metrics = get_metrics()
+
+        assert metrics[f'iofs_user_calls_total{{uid="{os.getuid()}"}}'] >= 4
+        assert metrics[f'iofs_user_bytes_total{{uid="{os.getuid()}",op="write"}}'] >= 4 * 4096
+        process = f'iofs_process_bytes_total{{pid="{os.getpid()}",uid="{os.getuid()}",'
+        assert any(k.startswith(process) and k.endswith('op="write"}') and v >= 4 * 4096 for k, v in metrics.items())
+
+
+@pytest.mark.parametrize("backend", ["highlevel", "lowlevel"])
+def test_release_is_attributed_to_the_opener(backend):
+    """
+    Tests that no op is booked to pid 0, which is what the kernel sends for `release`.
+    The `strict` profile keeps writeback flushes, which have no caller either, out of the picture.
+    """
+    control = "http://127.0.0.1:9098/plugins"
+    attribution = str(REPO_ROOT / "plugins/attribution.so")
+    extra_args = ("--control", "9098", "--backend", backend, "--profile", "strict")
+    with iofs_mount(show_output=False, extra_args=extra_args) as (fake_dir, real_dir):
+        assert requests.post(control, params={"path": attribution + ":ops=all"}, timeout=5).status_code == 201
+
+        for i in range(8):
+            (fake_dir / f"file_{i}").write_bytes(b"A" * 4096)
+            assert (fake_dir / f"file_{i}").read_bytes() == b"A" * 4096
+        # `release` is asynchronous to `close`
+        time.sleep(1)
+        metrics = get_metrics()
+
+        process = f'iofs_process_calls_total{{pid="{os.getpid()}",uid="{os.getuid()}",'
+        assert sum(v for k, v in metrics.items() if k.startswith(process)) >= 8 * 4
+        assert not any(k.startswith('iofs_process_calls_total{pid="0",') and v > 0 for k, v in metrics.items())
+        if os.getuid() != 0:
+            assert metrics.get('iofs_user_calls_total{uid="0"}', 0) == 0
@@ -8,17 +8,20 @@ REPO_ROOT = Path(__file__).parent.parent.resolve()
 
 
 @contextmanager
-def iofs_mount(sleep_seconds=1, show_output=False):
+def iofs_mount(sleep_seconds=1, show_output=False, extra_args=(), foreground=True):
     """
     Context manager that sets up temp dirs, spawns iofs-ng, yields the paths, and forcefully cleans up on exit.
+    `extra_args` are passed to iofs-ng before the positional arguments.
+    Without `foreground`, iofs-ng daemonizes like it would in production and is only stopped by the unmount.
     """
     with tempfile.TemporaryDirectory() as real_dir, tempfile.TemporaryDirectory() as fake_dir:
         fake_path = Path(fake_dir)
         real_path = Path(real_dir)
 
-        cmd = [str(REPO_ROOT / "iofs-ng"), "-fd", "-p", str(REPO_ROOT / "plugins/sample.so"),
-               "-p", str(REPO_ROOT / "plugins/lastn.so"), "-p", str(REPO_ROOT / "plugins/stats.so"),
-               str(fake_path), str(real_path)]
+        cmd = [str(REPO_ROOT / "iofs-ng"), *(("-fd",) if foreground else ()),
+               "-p", str(REPO_ROOT / "plugins/sample.so"), "-p", str(REPO_ROOT / "plugins/lastn.so"),
+               "-p", str(REPO_ROOT / "plugins/stats.so"),
+               *extra_args, str(fake_path), str(real_path)]
         out_dest = None if show_output else subprocess.DEVNULL
         print(f"\n[FUSE] Spawning: {' '.join(cmd)}")
         process = subprocess.Popen(cmd, cwd=REPO_ROOT, stdout=out_dest, stderr=out_dest)
@@ -27,7 +30,8 @@ def iofs_mount(sleep_seconds=1, show_output=False):
             print(f"[FUSE] Waiting {sleep_seconds} seconds for mount...")
             time.sleep(sleep_seconds)
 
-            if process.poll() is not None:
+            # A daemonizing iofs-ng exits right away, but successfully
+            if process.poll() is not None and (foreground or process.returncode != 0):
                 raise RuntimeError(f"iofs-ng process exited prematurely with code {process.returncode}")
 
             yield fake_path, real_path
@@ -43,3 +47,6 @@ def iofs_mount(sleep_seconds=1, show_output=False):
                 process.wait()
 
             subprocess.run(["fusermount", "-uz", str(fake_path)], check=False, capture_output=True)
+            if not foreground:
+                # Give the daemon time to exit and free its ports
+                time.sleep(1)
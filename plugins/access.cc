@@ -0,0 +1,25 @@
+#include "access.hh"
+
+static struct IofsPluginV2 plugin_api = {
+  .abi_version = IOFS_PLUGIN_ABI_VERSION,
+  .event_size  = sizeof(struct iofs_event),
+
+  .get_name    = []() -> const char * { return AccessPatternPlugin::NAME; },
+  .get_version = []() -> const char * { return AccessPatternPlugin::VERSION; },
+
+  .init    = iofs_plugin_init<AccessPatternPlugin>,
+  .destroy = [](void *ctx) { delete static_cast<AccessPatternPlugin *>(ctx); },
+
+  .record       = [](void *ctx, auto... args) { static_cast<AccessPatternPlugin *>(ctx)->record(args...); },
+  .record_batch = iofs_plugin_record_batch<AccessPatternPlugin>,
+  .poll_prometheus_metrics = [](void *ctx, auto... args) { return static_cast<AccessPatternPlugin *>(ctx)->poll_metrics(args...); },
+  .subscriptions = [](void *ctx) { return static_cast<AccessPatternPlugin *>(ctx)->subscriptions(); },
+  .command = nullptr,
+  .record_event = [](void *ctx, const struct iofs_event *event) { static_cast<AccessPatternPlugin *>(ctx)->record_event(*event); },
+};
+
+extern "C" {
+  struct IofsPluginV2 *get_iofs_plugin_v2(void) {
+    return &plugin_api;
+  }
+}
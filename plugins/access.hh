@@ -0,0 +1,336 @@
+#pragma once
+
+#include "plugin.hh"
+#include "plugin_config.hh"
+#include "plugin_helpers.hh"
+#include "histogram.hh"
+#include "shard.hh"
+#include <atomic>
+#include <bit>
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+// Classifies the reads and writes on each open file as sequential, strided or random, so jobs streaming through their
+// files can be told from those seeking around in them.
+//
+// Every read/write continues the stream of its file (reads and writes separately) and is:
+// - sequential if it starts where the previous one ended,
+// - strided if it starts as far from the previous start as that one did from its predecessor, e.g. every other
+//   record of a file, or a file read backwards,
+// - random otherwise. The first one is sequential if it starts at offset 0, else random.
+// Calls are counted by pattern right away. Once a file is released, it is counted once more, by the pattern most of
+// its calls followed, together with all of its bytes; strided files with their stride.
+//
+// Open files are tracked in a fixed table, one slot each, picked by the file id. A file whose slot is taken by another
+// open one evicts it, which is then counted as if released, so make the table a few times larger than the number of
+// files open at once. Each slot has a spinlock; only calls on the same file (or a colliding one) wait for each other.
+//
+// With `--dispatch async`, a file's last calls may be delivered after its release, by another worker. Those are
+// counted as late instead of being classified, since their stream is gone. A slot only remembers the last file
+// released from it, so late calls are missed if another file was opened and released in the same slot in between.
+//
+// Configured at load time, e.g. `-p 'access.so:files=16K'`:
+// - `files`: table slots, rounded up to a power of two. 1024 by default, at most 1M (192 bytes each).
+//
+// With `--zero-copy`, `read_buf`/`write_buf` are classified by the sizes iofs-ng reports, see `ZeroCopyReport`; with
+// `none`, sequential reads look random.
+static constexpr size_t ACCESS_FILES_DEFAULT = 1024;
+static constexpr size_t ACCESS_FILES_MAX = size_t{1} << 20;
+
+static constexpr iofs_op_mask_t ACCESS_OPS = IOFS_OP_BIT(IOFS_OP_READ) | IOFS_OP_BIT(IOFS_OP_WRITE)
+  | IOFS_OP_BIT(IOFS_OP_READ_BUF) | IOFS_OP_BIT(IOFS_OP_WRITE_BUF) | IOFS_OP_BIT(IOFS_OP_RELEASE);
+
+class AccessPatternPlugin {
+  enum Pattern : size_t { SEQUENTIAL, STRIDED, RANDOM, PATTERNS };
+  static constexpr const char *PATTERN_NAMES[PATTERNS] = {"sequential", "strided", "random"};
+  static constexpr const char *RW_NAMES[2] = {"read", "write"};
+
+  // Strides of 512 B to 1 GiB, one bucket per power of two
+  static constexpr LogLinearLayout STRIDE_LAYOUT{.min_exp = 9, .max_exp = 30, .sub_bits = 0};
+
+  struct Stream {
+    uint64_t start;  // of the last call
+    uint64_t end;
+    int64_t delta;   // between the starts of the last two calls
+    int64_t stride;  // of the last strided call
+    uint64_t calls[PATTERNS];
+    uint64_t bytes;
+  };
+
+  struct alignas(64) Slot {
+    std::atomic<bool> locked{false};
+    std::atomic<uint64_t> file_id{0}; // 0 if free; only written under the lock
+    uint64_t released{0};              // The last file released from it, under the lock
+    Stream streams[2]{};
+  };
+
+  class SlotLock {
+    Slot &m_slot;
+
+  public:
+    explicit SlotLock(Slot &slot) : m_slot{slot} {
+      while (m_slot.locked.exchange(true, std::memory_order_acquire)) {
+        while (m_slot.locked.load(std::memory_order_relaxed)) {
+        }
+      }
+    }
+    ~SlotLock() { m_slot.locked.store(false, std::memory_order_release); }
+    SlotLock(const SlotLock &) = delete;
+    SlotLock &operator=(const SlotLock &) = delete;
+  };
+
+  // What a released or evicted file adds to the counters
+  struct Finished {
+    bool valid[2]{};
+    Pattern pattern[2]{};
+    uint64_t bytes[2]{};
+    int64_t stride[2]{};
+  };
+
+  // Counters in one flat array per thread:
+  // - calls and bytes per read/write and pattern
+  // - released files and their bytes per read/write and dominant pattern
+  // - evictions, late calls, then the stride histogram: sum and buckets
+  static constexpr size_t CALLS = 0;
+  static constexpr size_t BYTES = CALLS + 2 * PATTERNS;
+  static constexpr size_t FILES = BYTES + 2 * PATTERNS;
+  static constexpr size_t FILE_BYTES = FILES + 2 * PATTERNS;
+  static constexpr size_t EVICTIONS = FILE_BYTES + 2 * PATTERNS;
+  static constexpr size_t LATE = EVICTIONS + 1;
+  static constexpr size_t STRIDE_SUM = LATE + 1;
+  static constexpr size_t STRIDES = STRIDE_SUM + 1;
+  static constexpr size_t COUNTERS = STRIDES + STRIDE_LAYOUT.buckets();
+
+  size_t m_mask;
+  std::unique_ptr<Slot[]> m_slots;
+  ShardedCounters m_shards{COUNTERS};
+
+  static size_t parse_files(const PluginConfig &config) {
+    config.expect_keys({"files"});
+    size_t files = ACCESS_FILES_DEFAULT;
+    if (const std::string *v = config.get("files")) {
+      files = parse_config_size(*v);
+      if (files == 0 || files > ACCESS_FILES_MAX) {
+        throw std::invalid_argument("files must be within 1 and " + std::to_string(ACCESS_FILES_MAX));
+      }
+    }
+    return std::bit_ceil(files);
+  }
+
+  static Pattern classify(Stream &stream, uint64_t offset, uint64_t size) {
+    bool first = stream.calls[SEQUENTIAL] + stream.calls[STRIDED] + stream.calls[RANDOM] == 0;
+    int64_t delta = static_cast<int64_t>(offset - stream.start);
+    Pattern pattern;
+    if (first) {
+      pattern = offset == 0 ? SEQUENTIAL : RANDOM;
+      delta = 0;
+    } else if (offset == stream.end) {
+      pattern = SEQUENTIAL;
+    } else if (delta != 0 && delta == stream.delta) {
+      pattern = STRIDED;
+      stream.stride = delta;
+    } else {
+      pattern = RANDOM;
+    }
+    stream.start = offset;
+    stream.end = offset + size;
+    stream.delta = delta;
+    stream.calls[pattern] += 1;
+    stream.bytes += size;
+    return pattern;
+  }
+
+  // Takes the file out of its slot. Expects the slot's lock to be held.
+  static Finished finish(Slot &slot) {
+    Finished finished;
+    for (size_t w = 0; w < 2; ++w) {
+      const Stream &s = slot.streams[w];
+      // Ties go to the more regular pattern
+      Pattern dominant = SEQUENTIAL;
+      for (size_t p = 1; p < PATTERNS; ++p) {
+        if (s.calls[p] > s.calls[dominant]) {
+          dominant = static_cast<Pattern>(p);
+        }
+      }
+      finished.valid[w] = s.calls[dominant] > 0;
+      finished.pattern[w] = dominant;
+      finished.bytes[w] = s.bytes;
+      finished.stride[w] = s.stride;
+      slot.streams[w] = {};
+    }
+    slot.file_id.store(0, std::memory_order_relaxed);
+    return finished;
+  }
+
+  void count(ShardCounter *c, bool shared, const Finished &finished) {
+    for (size_t w = 0; w < 2; ++w) {
+      if (!finished.valid[w]) {
+        continue;
+      }
+      size_t p = w * PATTERNS + finished.pattern[w];
+      c[FILES + p].add(1, shared);
+      c[FILE_BYTES + p].add(finished.bytes[w], shared);
+      if (finished.pattern[w] == STRIDED) {
+        uint64_t stride = static_cast<uint64_t>(finished.stride[w] < 0 ? -finished.stride[w] : finished.stride[w]);
+        c[STRIDE_SUM].add(stride, shared);
+        c[STRIDES + STRIDE_LAYOUT.index(stride)].add(1, shared);
+      }
+    }
+  }
+
+  // File ids are handed out sequentially, so files opened around the same time never collide
+  Slot &slot(uint64_t file_id) { return m_slots[file_id & m_mask]; }
+
+  // One counter family by read/write and pattern
+  static void emit_by_pattern(char *buf, size_t buf_size, size_t &offset, const char *name, const uint64_t *counters) {
+    for (size_t w = 0; w < 2; ++w) {
+      for (size_t p = 0; p < PATTERNS; ++p) {
+        emit_metric(buf, buf_size, offset,
+          "%s{op=\"%s\",pattern=\"%s\"} %llu\n",
+          name, RW_NAMES[w], PATTERN_NAMES[p], static_cast<unsigned long long>(counters[w * PATTERNS + p]));
+      }
+    }
+  }
+
+public:
+  static constexpr const char *NAME = "AccessPatternPlugin";
+  static constexpr const char *VERSION = "0.1.0";
+  static constexpr iofs_op_mask_t OPS = ACCESS_OPS;
+
+  explicit AccessPatternPlugin(const PluginConfig &config = {})
+    : m_mask{parse_files(config) - 1}, m_slots{new Slot[m_mask + 1]} {}
+
+  iofs_op_mask_t subscriptions() const {
+    return ACCESS_OPS;
+  }
+
+  // Without the offset and file there is nothing to classify; the host calls `record_event` instead
+  void record(iofs_op_t, uint64_t, uint64_t) {}
+
+  void record_event(const iofs_event &event) {
+    if (event.file_id == 0) {
+      return;
+    }
+    Slot &s = slot(event.file_id);
+    auto [c, shared] = m_shards.local();
+
+    if (event.op == IOFS_OP_RELEASE) {
+      Finished finished;
+      {
+        SlotLock lock{s};
+        if (s.file_id.load(std::memory_order_relaxed) != event.file_id) {
+          // Never read/written, or evicted already
+          return;
+        }
+        finished = finish(s);
+        s.released = event.file_id;
+      }
+      count(c, shared, finished);
+      return;
+    }
+
+    size_t w;
+    if (event.op == IOFS_OP_READ || event.op == IOFS_OP_READ_BUF) {
+      w = 0;
+    } else if (event.op == IOFS_OP_WRITE || event.op == IOFS_OP_WRITE_BUF) {
+      w = 1;
+    } else {
+      return;
+    }
+
+    Finished evicted;
+    bool eviction = false;
+    Pattern pattern;
+    {
+      SlotLock lock{s};
+      if (event.file_id == s.released) {
+        c[LATE].add(1, shared);
+        return;
+      }
+      uint64_t current = s.file_id.load(std::memory_order_relaxed);
+      if (current != event.file_id) {
+        if (current != 0) {
+          evicted = finish(s);
+          eviction = true;
+        }
+        s.file_id.store(event.file_id, std::memory_order_relaxed);
+      }
+      pattern = classify(s.streams[w], event.offset, event.units);
+    }
+    c[CALLS + w * PATTERNS + pattern].add(1, shared);
+    c[BYTES + w * PATTERNS + pattern].add(event.units, shared);
+    if (eviction) {
+      c[EVICTIONS].add(1, shared);
+      count(c, shared, evicted);
+    }
+  }
+
+  size_t poll_metrics(char *buf, size_t buf_size) {
+    size_t offset = 0;
+    uint64_t t[COUNTERS]{};
+    m_shards.sum(t);
+
+    emit_metric(buf, buf_size, offset,
+      "# HELP iofs_access_calls_total Read/write calls by access pattern.\n"
+      "# TYPE iofs_access_calls_total counter\n");
+    emit_by_pattern(buf, buf_size, offset, "iofs_access_calls_total", t + CALLS);
+
+    emit_metric(buf, buf_size, offset,
+      "# HELP iofs_access_bytes_total Bytes read/written by access pattern of the call.\n"
+      "# TYPE iofs_access_bytes_total counter\n");
+    emit_by_pattern(buf, buf_size, offset, "iofs_access_bytes_total", t + BYTES);
+
+    emit_metric(buf, buf_size, offset,
+      "# HELP iofs_access_files_total Released files by the access pattern most of their reads/writes followed.\n"
+      "# TYPE iofs_access_files_total counter\n");
+    emit_by_pattern(buf, buf_size, offset, "iofs_access_files_total", t + FILES);
+
+    emit_metric(buf, buf_size, offset,
+      "# HELP iofs_access_file_bytes_total Bytes read/written of released files, by their access pattern.\n"
+      "# TYPE iofs_access_file_bytes_total counter\n");
+    emit_by_pattern(buf, buf_size, offset, "iofs_access_file_bytes_total", t + FILE_BYTES);
+
+    emit_metric(buf, buf_size, offset,
+      "# HELP iofs_access_stride_bytes Stride of released strided files.\n"
+      "# TYPE iofs_access_stride_bytes histogram\n");
+    uint64_t cumulative = 0;
+    for (size_t b = 0; b < STRIDE_LAYOUT.explicit_buckets(); ++b) {
+      cumulative += t[STRIDES + b];
+      emit_metric(buf, buf_size, offset,
+        "iofs_access_stride_bytes_bucket{le=\"%llu\"} %llu\n",
+        static_cast<unsigned long long>(STRIDE_LAYOUT.upper_bound(b)), static_cast<unsigned long long>(cumulative));
+    }
+    cumulative += t[STRIDES + STRIDE_LAYOUT.explicit_buckets()];
+    emit_metric(buf, buf_size, offset,
+      "iofs_access_stride_bytes_bucket{le=\"+Inf\"} %llu\n"
+      "iofs_access_stride_bytes_count %llu\n"
+      "iofs_access_stride_bytes_sum %llu\n",
+      static_cast<unsigned long long>(cumulative), static_cast<unsigned long long>(cumulative),
+      static_cast<unsigned long long>(t[STRIDE_SUM]));
+
+    uint64_t tracked = 0;
+    for (size_t i = 0; i <= m_mask; ++i) {
+      tracked += m_slots[i].file_id.load(std::memory_order_relaxed) != 0;
+    }
+    emit_metric(buf, buf_size, offset,
+      "# HELP iofs_access_tracked_files Open files currently tracked.\n"
+      "# TYPE iofs_access_tracked_files gauge\n"
+      "iofs_access_tracked_files %llu\n"
+      "# HELP iofs_access_evictions_total Files evicted from the table by a colliding one, see the files option.\n"
+      "# TYPE iofs_access_evictions_total counter\n"
+      "iofs_access_evictions_total %llu\n"
+      "# HELP iofs_access_late_calls_total Reads/writes delivered after their file's release (--dispatch async), not "
+      "classified.\n"
+      "# TYPE iofs_access_late_calls_total counter\n"
+      "iofs_access_late_calls_total %llu\n",
+      static_cast<unsigned long long>(tracked), static_cast<unsigned long long>(t[EVICTIONS]),
+      static_cast<unsigned long long>(t[LATE]));
+
+    return offset;
+  }
+};
@@ -0,0 +1,393 @@
+#pragma once
+
+#include "plugin.hh"
+#include "plugin_config.hh"
+#include "plugin_helpers.hh"
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Calls, bytes and time per user and per process, so on a shared node the job hammering the filesystem can be found.
+//
+// Users and processes are kept in two fixed tables, updated without locks: a caller's entry is found by probing a few
+// slots from the hash of its uid/pid and claimed with a CAS, and its counters are atomic adds on the entry's own cache
+// line. If all probed slots are taken, the op is counted as `other` instead.
+//
+// Each scrape evicts entries without an op for `idle` seconds, so the tables only hold recent callers, and looks up
+// the job and command name of every new process, which are then kept with its entry:
+// - the job is the Slurm job of its cgroup (`job_<id>` in `/proc/<pid>/cgroup`), else the first variable of
+//   `job_env` set in its environment (`/proc/<pid>/environ`, only readable if iofs-ng runs as root or the same user),
+//   else empty;
+// - the command is `/proc/<pid>/comm`.
+// A process that already exited when it is first scraped has neither. An op racing with the eviction of its (idle)
+// entry may be lost or counted for the next caller claiming that slot, and a pid reused within `idle` keeps the job
+// of its predecessor.
+//
+// Configured at load time, e.g. `-p 'attribution.so:users=1K;processes=16K;idle=600'`:
+// - `users`, `processes`: table slots, rounded up to a power of two. 256 and 4096 by default, at most 1M each.
+// - `idle`: seconds without an op after which an entry is evicted, 300 by default.
+// - `job_env`: the environment variables naming the job, comma-separated. `SLURM_JOB_ID,PBS_JOBID,LSB_JOBID` by
+//   default; empty to never read environments.
+// - `ops`: the ops to count, comma-separated or `all` (default).
+static constexpr size_t ATTRIBUTION_USERS_DEFAULT = 256;
+static constexpr size_t ATTRIBUTION_PROCESSES_DEFAULT = 4096;
+static constexpr size_t ATTRIBUTION_TABLE_MAX = size_t{1} << 20;
+static constexpr uint64_t ATTRIBUTION_IDLE_DEFAULT = 300;
+
+struct AttributionConfig {
+  size_t users = ATTRIBUTION_USERS_DEFAULT;
+  size_t processes = ATTRIBUTION_PROCESSES_DEFAULT;
+  uint64_t idle_s = ATTRIBUTION_IDLE_DEFAULT;
+  std::vector<std::string> job_env{"SLURM_JOB_ID", "PBS_JOBID", "LSB_JOBID"};
+  iofs_op_mask_t ops = IOFS_OPS_ALL;
+
+  explicit AttributionConfig(const PluginConfig &config = {}) {
+    config.expect_keys({"users", "processes", "idle", "job_env", "ops"});
+    auto table = [&](const char *key, size_t &slots) {
+      if (const std::string *v = config.get(key)) {
+        slots = parse_config_size(*v);
+        if (slots == 0 || slots > ATTRIBUTION_TABLE_MAX) {
+          throw std::invalid_argument(
+            std::string{key} + " must be within 1 and " + std::to_string(ATTRIBUTION_TABLE_MAX));
+        }
+      }
+      slots = std::bit_ceil(slots);
+    };
+    table("users", users);
+    table("processes", processes);
+    if (const std::string *v = config.get("idle")) {
+      idle_s = parse_config_size(*v);
+    }
+    if (const std::string *v = config.get("job_env")) {
+      job_env.clear();
+      std::string_view names = *v;
+      while (!names.empty()) {
+        size_t comma = names.find(',');
+        if (names.substr(0, comma).empty()) {
+          throw std::invalid_argument("empty variable name in job_env '" + *v + "'");
+        }
+        job_env.emplace_back(names.substr(0, comma));
+        names = comma == std::string_view::npos ? std::string_view{} : names.substr(comma + 1);
+      }
+    }
+    if (const std::string *v = config.get("ops")) {
+      ops = parse_config_ops(*v);
+    }
+  }
+};
+
+class AttributionPlugin {
+  // One user or process
+  struct alignas(64) Entry {
+    std::atomic<uint64_t> key{0}; // uid/pid + 1; 0 if free, `EVICTING` while being evicted
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> duration_ns{0};
+    std::atomic<uint64_t> bytes[2]{}; // read, written
+    std::atomic<uint64_t> last_seen{0}; // `m_now` at its last op
+    std::atomic<uint32_t> uid{0};       // of the process when it was claimed
+  };
+
+  static constexpr uint64_t EVICTING = ~uint64_t{0};
+  static constexpr size_t PROBES = 8;
+
+  struct Table {
+    size_t mask;
+    unsigned shift; // for the Fibonacci hash
+    std::unique_ptr<Entry[]> entries;
+    Entry other;
+    uint64_t evictions = 0; // only touched by scrapes
+
+    explicit Table(size_t slots)
+      : mask{slots - 1}, shift{64 - static_cast<unsigned>(std::countr_zero(slots))}, entries{new Entry[slots]} {}
+
+    // The entry of `id`, claimed if there is none yet
+    Entry &find(uint32_t id, uint32_t uid) {
+      uint64_t key = uint64_t{id} + 1;
+      // Fibonacci hashing spreads the sequential pids over the table; a shift by 64 is undefined, hence the mask
+      size_t home = mask == 0 ? 0 : static_cast<size_t>((key * 0x9e3779b97f4a7c15) >> shift);
+      for (size_t i = 0; i < PROBES && i <= mask; ++i) {
+        Entry &e = entries[(home + i) & mask];
+        uint64_t current = e.key.load(std::memory_order_acquire);
+        if (current == key) {
+          return e;
+        }
+        if (current == 0) {
+          if (e.key.compare_exchange_strong(current, key, std::memory_order_acq_rel)) {
+            e.uid.store(uid, std::memory_order_relaxed);
+            return e;
+          }
+          // Someone else claimed it, maybe for the same id
+          if (current == key) {
+            return e;
+          }
+        }
+      }
+      return other;
+    }
+
+    // Frees the entries idle since before `cutoff`
+    void evict(uint64_t cutoff) {
+      for (size_t i = 0; i <= mask; ++i) {
+        Entry &e = entries[i];
+        uint64_t key = e.key.load(std::memory_order_acquire);
+        if (key == 0 || key == EVICTING || e.last_seen.load(std::memory_order_relaxed) >= cutoff) {
+          continue;
+        }
+        if (!e.key.compare_exchange_strong(key, EVICTING, std::memory_order_acq_rel)) {
+          continue;
+        }
+        e.calls.store(0, std::memory_order_relaxed);
+        e.duration_ns.store(0, std::memory_order_relaxed);
+        e.bytes[0].store(0, std::memory_order_relaxed);
+        e.bytes[1].store(0, std::memory_order_relaxed);
+        e.key.store(0, std::memory_order_release);
+        ++evictions;
+      }
+    }
+
+    size_t used() const {
+      size_t n = 0;
+      for (size_t i = 0; i <= mask; ++i) {
+        uint64_t key = entries[i].key.load(std::memory_order_relaxed);
+        n += key != 0 && key != EVICTING;
+      }
+      return n;
+    }
+  };
+
+  // What a scrape found out about the process in a slot, for the key it was looked up for
+  struct ProcessInfo {
+    uint64_t key = 0;
+    std::string job;
+    std::string comm;
+  };
+
+  AttributionConfig m_config;
+  Table m_users;
+  Table m_processes;
+  // Seconds since the plugin was loaded, advanced by scrapes
+  std::atomic<uint64_t> m_now{1};
+  std::chrono::steady_clock::time_point m_started{std::chrono::steady_clock::now()};
+
+  std::mutex m_scrape_mutex;
+  std::vector<ProcessInfo> m_process_info; // per process slot, guarded by `m_scrape_mutex`
+
+  static int rw(iofs_op_t op) {
+    switch (op) {
+      case IOFS_OP_READ: case IOFS_OP_READ_BUF: case IOFS_OP_PASSTHROUGH_READ: return 0;
+      case IOFS_OP_WRITE: case IOFS_OP_WRITE_BUF: case IOFS_OP_PASSTHROUGH_WRITE: return 1;
+      default: return -1;
+    }
+  }
+
+  static void add(Entry &e, const iofs_event &event, uint64_t now) {
+    e.calls.fetch_add(1, std::memory_order_relaxed);
+    e.duration_ns.fetch_add(event.duration_ns, std::memory_order_relaxed);
+    if (int w = rw(event.op); w >= 0) {
+      e.bytes[w].fetch_add(event.units, std::memory_order_relaxed);
+    }
+    // Mostly unchanged, so mostly no store
+    if (e.last_seen.load(std::memory_order_relaxed) != now) {
+      e.last_seen.store(now, std::memory_order_relaxed);
+    }
+  }
+
+  // Up to `max` bytes of a /proc file
+  static std::string read_proc(uint32_t pid, const char *file, size_t max) {
+    char path[64];
+    std::snprintf(path, sizeof(path), "/proc/%u/%s", pid, file);
+    std::string content(max, '\0');
+    FILE *f = std::fopen(path, "rb");
+    if (!f) {
+      return {};
+    }
+    content.resize(std::fread(content.data(), 1, max, f));
+    std::fclose(f);
+    return content;
+  }
+
+  std::string resolve_job(uint32_t pid) const {
+    // Slurm puts every job into its own cgroup, e.g. `0::/system.slice/slurmstepd.scope/job_1234/step_0/user/task_0`
+    std::string cgroup = read_proc(pid, "cgroup", 4096);
+    if (size_t pos = cgroup.find("/job_"); pos != std::string::npos) {
+      size_t start = pos + 5;
+      size_t end = start;
+      while (end < cgroup.size() && cgroup[end] >= '0' && cgroup[end] <= '9') {
+        ++end;
+      }
+      if (end > start) {
+        return cgroup.substr(start, end - start);
+      }
+    }
+    if (m_config.job_env.empty()) {
+      return {};
+    }
+    std::string environment = read_proc(pid, "environ", 256 * 1024);
+    for (const std::string &name : m_config.job_env) {
+      std::string_view rest = environment;
+      while (!rest.empty()) {
+        std::string_view var = rest.substr(0, rest.find('\0'));
+        rest = var.size() < rest.size() ? rest.substr(var.size() + 1) : std::string_view{};
+        if (var.size() > name.size() && var.starts_with(name) && var[name.size()] == '=') {
+          return std::string{var.substr(name.size() + 1)};
+        }
+      }
+    }
+    return {};
+  }
+
+  // Label values may contain anything, see the exposition format
+  static std::string escape(std::string_view value) {
+    std::string out;
+    out.reserve(value.size());
+    for (char c : value) {
+      if (c == '\\' || c == '"') {
+        out += '\\';
+        out += c;
+      } else if (c == '\n') {
+        out += "\\n";
+      } else {
+        out += c;
+      }
+    }
+    return out;
+  }
+
+  // A scraped entry
+  struct Row {
+    std::string labels;
+    uint64_t calls;
+    uint64_t duration_ns;
+    uint64_t bytes[2];
+  };
+
+  static Row row(std::string labels, const Entry &e) {
+    return {std::move(labels), e.calls.load(std::memory_order_relaxed), e.duration_ns.load(std::memory_order_relaxed),
+      {e.bytes[0].load(std::memory_order_relaxed), e.bytes[1].load(std::memory_order_relaxed)}};
+  }
+
+  // The calls, duration and bytes families for all rows of one table, each family in one piece
+  static void emit_rows(char *buf, size_t buf_size, size_t &offset, const char *prefix, const char *what,
+      const std::vector<Row> &rows) {
+    emit_metric(buf, buf_size, offset,
+      "# HELP iofs_%s_calls_total FUSE ops per %s.\n"
+      "# TYPE iofs_%s_calls_total counter\n", prefix, what, prefix);
+    for (const Row &r : rows) {
+      emit_metric(buf, buf_size, offset, "iofs_%s_calls_total{%s} %llu\n", prefix, r.labels.c_str(),
+        static_cast<unsigned long long>(r.calls));
+    }
+    emit_metric(buf, buf_size, offset,
+      "# HELP iofs_%s_duration_ns_total Nanoseconds spent in FUSE ops per %s.\n"
+      "# TYPE iofs_%s_duration_ns_total counter\n", prefix, what, prefix);
+    for (const Row &r : rows) {
+      emit_metric(buf, buf_size, offset, "iofs_%s_duration_ns_total{%s} %llu\n", prefix, r.labels.c_str(),
+        static_cast<unsigned long long>(r.duration_ns));
+    }
+    emit_metric(buf, buf_size, offset,
+      "# HELP iofs_%s_bytes_total Bytes read/written per %s.\n"
+      "# TYPE iofs_%s_bytes_total counter\n", prefix, what, prefix);
+    for (const Row &r : rows) {
+      emit_metric(buf, buf_size, offset, "iofs_%s_bytes_total{%s,op=\"read\"} %llu\n", prefix, r.labels.c_str(),
+        static_cast<unsigned long long>(r.bytes[0]));
+      emit_metric(buf, buf_size, offset, "iofs_%s_bytes_total{%s,op=\"write\"} %llu\n", prefix, r.labels.c_str(),
+        static_cast<unsigned long long>(r.bytes[1]));
+    }
+  }
+
+public:
+  static constexpr const char *NAME = "AttributionPlugin";
+  static constexpr const char *VERSION = "0.1.0";
+  static constexpr iofs_op_mask_t OPS = IOFS_OPS_ALL;
+
+  explicit AttributionPlugin(const PluginConfig &config = {})
+    : m_config{config}, m_users{m_config.users}, m_processes{m_config.processes},
+      m_process_info(m_config.processes) {}
+
+  iofs_op_mask_t subscriptions() const {
+    return m_config.ops;
+  }
+
+  // Without the caller there is nothing to attribute; the host calls `record_event` instead
+  void record(iofs_op_t, uint64_t, uint64_t) {}
+
+  void record_event(const iofs_event &event) {
+    if (!(m_config.ops & IOFS_OP_BIT(event.op))) {
+      return;
+    }
+    uint64_t now = m_now.load(std::memory_order_relaxed);
+    add(m_users.find(event.uid, event.uid), event, now);
+    add(m_processes.find(event.pid, event.uid), event, now);
+  }
+
+  size_t poll_metrics(char *buf, size_t buf_size) {
+    std::lock_guard lock{m_scrape_mutex};
+    size_t offset = 0;
+
+    uint64_t now = 1 + static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - m_started).count());
+    m_now.store(now, std::memory_order_relaxed);
+    if (now > m_config.idle_s) {
+      m_users.evict(now - m_config.idle_s);
+      m_processes.evict(now - m_config.idle_s);
+    }
+
+    std::vector<Row> rows;
+    for (size_t i = 0; i <= m_users.mask; ++i) {
+      const Entry &e = m_users.entries[i];
+      uint64_t key = e.key.load(std::memory_order_acquire);
+      if (key != 0 && key != EVICTING) {
+        rows.push_back(row("uid=\"" + std::to_string(key - 1) + "\"", e));
+      }
+    }
+    rows.push_back(row("uid=\"other\"", m_users.other));
+    emit_rows(buf, buf_size, offset, "user", "uid", rows);
+
+    rows.clear();
+    for (size_t i = 0; i <= m_processes.mask; ++i) {
+      const Entry &e = m_processes.entries[i];
+      uint64_t key = e.key.load(std::memory_order_acquire);
+      if (key == 0 || key == EVICTING) {
+        continue;
+      }
+      uint32_t pid = static_cast<uint32_t>(key - 1);
+      ProcessInfo &info = m_process_info[i];
+      if (info.key != key) {
+        std::string comm = read_proc(pid, "comm", 64);
+        if (comm.ends_with('\n')) {
+          comm.pop_back();
+        }
+        info = {key, escape(resolve_job(pid)), escape(comm)};
+      }
+      std::string labels = "pid=\"" + std::to_string(pid) + "\",uid=\""
+        + std::to_string(e.uid.load(std::memory_order_relaxed)) + "\",job=\"" + info.job + "\",comm=\"" + info.comm
+        + "\"";
+      rows.push_back(row(std::move(labels), e));
+    }
+    rows.push_back(row("pid=\"other\",uid=\"\",job=\"\",comm=\"\"", m_processes.other));
+    emit_rows(buf, buf_size, offset, "process", "process, with its uid, job and command", rows);
+
+    emit_metric(buf, buf_size, offset,
+      "# HELP iofs_attribution_entries Users/processes currently tracked.\n"
+      "# TYPE iofs_attribution_entries gauge\n"
+      "iofs_attribution_entries{table=\"users\"} %llu\n"
+      "iofs_attribution_entries{table=\"processes\"} %llu\n"
+      "# HELP iofs_attribution_evictions_total Users/processes evicted after being idle.\n"
+      "# TYPE iofs_attribution_evictions_total counter\n"
+      "iofs_attribution_evictions_total{table=\"users\"} %llu\n"
+      "iofs_attribution_evictions_total{table=\"processes\"} %llu\n",
+      static_cast<unsigned long long>(m_users.used()), static_cast<unsigned long long>(m_processes.used()),
+      static_cast<unsigned long long>(m_users.evictions), static_cast<unsigned long long>(m_processes.evictions));
+
+    return offset;
+  }
+};
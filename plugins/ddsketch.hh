@@ -0,0 +1,152 @@
+#pragma once
+
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Relative-error quantile sketches after DDSketch (Masson, Rim, Lee: "DDSketch: A Fast and Fully-Mergeable Quantile
+// Sketch with Relative-Error Guarantees", VLDB 2019).
+//
+// A value `v` is counted in bucket `key(v) = floor(MULTIPLIER * log2(v))`, so every bucket spans values within a
+// factor of `(1 + ALPHA) / (1 - ALPHA)`, and any quantile read back is within `ALPHA` of the true one. Sketches with
+// the same mapping merge by adding up their buckets.
+//
+// `log2` is approximated by the exponent plus a cubic in the mantissa (DDSketch's "cubically interpolated mapping"),
+// so a lookup is a few multiplications. The cubic is monotonic with a derivative of at least 10/7 relative to the
+// true `log2`, which `MULTIPLIER` corrects for, at the cost of ~1% more buckets than the exact logarithm.
+//
+// Buckets are kept densely for a fixed range of keys, `SKETCH_BUCKETS` of them starting at `SKETCH_MIN_VALUE`, so a
+// sketch has a fixed size no matter how many values it saw. Smaller values are counted in the first bucket and larger
+// ones in the last, i.e. quantiles outside of that range are clamped to it.
+namespace ddsketch {
+
+constexpr double ALPHA = 0.01;
+constexpr size_t SKETCH_BUCKETS = 1024;
+// With ~35 buckets per power of two, the range goes up to ~2^37 (~2 minutes, for ns)
+constexpr uint64_t SKETCH_MIN_VALUE = 256;
+
+// Coefficients of the cubic, P(0) = 0 and P(1) = 1
+constexpr double A = 6.0 / 35.0;
+constexpr double B = -3.0 / 5.0;
+constexpr double C = 10.0 / 7.0;
+
+inline const double MULTIPLIER = 7.0 / (10.0 * std::log(2.0)) / std::log2((1 + ALPHA) / (1 - ALPHA));
+
+inline double approx_log2(double value) {
+  uint64_t bits = std::bit_cast<uint64_t>(value);
+  double exponent = static_cast<double>(static_cast<int>((bits >> 52) & 0x7ff) - 1023);
+  double s = std::bit_cast<double>((bits & ((uint64_t{1} << 52) - 1)) | std::bit_cast<uint64_t>(1.0)) - 1.0;
+  return ((A * s + B) * s + C) * s + exponent;
+}
+
+// Inverse of `approx_log2`
+inline double approx_exp2(double log) {
+  double exponent = std::floor(log);
+  double target = log - exponent;
+  // P is monotonic on [0, 1] with P' >= 0.74, so Newton converges in a few steps
+  double s = target;
+  for (int i = 0; i < 6; ++i) {
+    s -= (((A * s + B) * s + C) * s - target) / ((3 * A * s + 2 * B) * s + C);
+  }
+  return std::ldexp(1.0 + s, static_cast<int>(exponent));
+}
+
+inline int key(uint64_t value) {
+  return static_cast<int>(std::floor(approx_log2(static_cast<double>(value)) * MULTIPLIER));
+}
+
+inline const int KEY_OFFSET = key(SKETCH_MIN_VALUE);
+
+// Bucket of a value, clamped to the sketch's range
+inline size_t bucket(uint64_t value) {
+  if (value <= SKETCH_MIN_VALUE) {
+    return 0;
+  }
+  int index = key(value) - KEY_OFFSET;
+  return index < static_cast<int>(SKETCH_BUCKETS) ? static_cast<size_t>(index) : SKETCH_BUCKETS - 1;
+}
+
+// The value a bucket stands for: the one with at most `ALPHA` relative error to all values in it
+inline double bucket_value(size_t bucket) {
+  double lower = approx_exp2(static_cast<double>(static_cast<int>(bucket) + KEY_OFFSET) / MULTIPLIER);
+  double upper = approx_exp2(static_cast<double>(static_cast<int>(bucket) + KEY_OFFSET + 1) / MULTIPLIER);
+  return 2 * lower * upper / (lower + upper);
+}
+
+// The `q` quantile of `count` values in `buckets[SKETCH_BUCKETS]`, using the lower rank like DDSketch
+inline double quantile(const uint64_t *buckets, uint64_t count, double q) {
+  if (count == 0) {
+    return 0;
+  }
+  double rank = q * static_cast<double>(count - 1);
+  uint64_t seen = 0;
+  for (size_t b = 0; b < SKETCH_BUCKETS; ++b) {
+    seen += buckets[b];
+    if (static_cast<double>(seen) > rank) {
+      return bucket_value(b);
+    }
+  }
+  return bucket_value(SKETCH_BUCKETS - 1);
+}
+
+// Compact serialization for merging sketches offline, base64 (RFC 4648, with padding) of:
+// - format version, one byte (1)
+// - `MULTIPLIER` as a little-endian IEEE 754 double; only sketches with the same one can be merged
+// - the number of non-empty buckets, then for each: its key (see `key`) minus the previous one (the first one as is),
+//   zigzag encoded, and its count. All of these are LEB128 varints.
+// A value for key `k` is then `bucket_value` with the same mapping, i.e. between `approx_exp2(k / MULTIPLIER)` and
+// `approx_exp2((k + 1) / MULTIPLIER)`.
+inline std::string encode(const uint64_t *buckets) {
+  std::string raw;
+  auto varint = [&raw](uint64_t v) {
+    while (v >= 0x80) {
+      raw += static_cast<char>((v & 0x7f) | 0x80);
+      v >>= 7;
+    }
+    raw += static_cast<char>(v);
+  };
+
+  raw += static_cast<char>(1);
+  uint64_t multiplier = std::bit_cast<uint64_t>(MULTIPLIER);
+  for (int i = 0; i < 8; ++i) {
+    raw += static_cast<char>((multiplier >> (8 * i)) & 0xff);
+  }
+  uint64_t non_empty = 0;
+  for (size_t b = 0; b < SKETCH_BUCKETS; ++b) {
+    non_empty += buckets[b] != 0;
+  }
+  varint(non_empty);
+  int64_t previous = 0;
+  for (size_t b = 0; b < SKETCH_BUCKETS; ++b) {
+    if (buckets[b] == 0) {
+      continue;
+    }
+    int64_t k = static_cast<int64_t>(b) + KEY_OFFSET;
+    int64_t delta = k - previous;
+    varint((static_cast<uint64_t>(delta) << 1) ^ static_cast<uint64_t>(delta >> 63));
+    varint(buckets[b]);
+    previous = k;
+  }
+
+  static constexpr char ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  out.reserve((raw.size() + 2) / 3 * 4);
+  for (size_t i = 0; i < raw.size(); i += 3) {
+    uint32_t chunk = static_cast<uint32_t>(static_cast<unsigned char>(raw[i])) << 16;
+    if (i + 1 < raw.size()) {
+      chunk |= static_cast<uint32_t>(static_cast<unsigned char>(raw[i + 1])) << 8;
+    }
+    if (i + 2 < raw.size()) {
+      chunk |= static_cast<unsigned char>(raw[i + 2]);
+    }
+    out += ALPHABET[(chunk >> 18) & 0x3f];
+    out += ALPHABET[(chunk >> 12) & 0x3f];
+    out += i + 1 < raw.size() ? ALPHABET[(chunk >> 6) & 0x3f] : '=';
+    out += i + 2 < raw.size() ? ALPHABET[chunk & 0x3f] : '=';
+  }
+  return out;
+}
+
+} // namespace ddsketch
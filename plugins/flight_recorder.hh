@@ -0,0 +1,197 @@
+#pragma once
+
+#include "seqlock_ring.hh"
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Dumps a `SeqlockRing` to a file when something interesting happened, so the ops leading up to e.g. a latency
+// outlier survive until someone looks at them.
+//
+// A trigger only records which ticket to dump up to and wakes the dumper thread, which copies the window out of the
+// ring right away (entries overwritten before it gets to them are marked as missing) and then writes it to
+// `<dir>/lastn-<pid>-<ticket>.bin` in the background. While a dump is in progress, further triggers are dropped, and
+// latency triggers are additionally rate limited to one per `min_interval`, so a storm of slow ops does not turn into
+// an I/O storm. Both are counted.
+//
+// The copy races against new entries, so the ring should hold at least a few milliseconds worth of ops beyond the
+// dumped window. The dumper thread cannot be started on construction: plugins are loaded before iofs-ng daemonizes,
+// and threads do not survive that. It is started on the first scrape instead (see `start`), or the first trigger.
+
+// Layout of a dump file: this header, then `count` entries of `entry_size` bytes, oldest first
+struct FlightRecorderHeader {
+  char magic[8];           // "IOFSLAST"
+  uint32_t version;        // 1
+  uint32_t entry_size;     // sizeof(SeqlockRing::Entry), all bits set for missing entries
+  uint64_t first_ticket;   // ticket (the `i` label of lastN) of the first entry
+  uint64_t count;
+  uint64_t trigger_ticket; // the last entry
+  uint64_t trigger_reason; // `FlightRecorder::Reason`
+  uint64_t unix_time_ns;   // when the window was copied
+};
+
+class FlightRecorder {
+public:
+  enum Reason : uint64_t { latency = 0, command = 1 };
+
+  struct Options {
+    std::string dir;
+    uint64_t trigger_ns = 0;     // 0: no latency trigger
+    std::chrono::nanoseconds min_interval = std::chrono::seconds{60};
+    size_t entries = 0;          // 0: the whole ring
+  };
+
+  FlightRecorder(const SeqlockRing &ring, Options options) : m_ring{ring}, m_options{std::move(options)} {
+    if (m_options.entries == 0 || m_options.entries > m_ring.capacity()) {
+      m_options.entries = m_ring.capacity();
+    }
+  }
+
+  ~FlightRecorder() {
+    m_pending.store(STOP, std::memory_order_release);
+    m_pending.notify_one();
+    if (m_thread.joinable()) {
+      m_thread.join();
+    }
+  }
+
+  FlightRecorder(const FlightRecorder &) = delete;
+  FlightRecorder &operator=(const FlightRecorder &) = delete;
+
+  // Starts the dumper thread if it is not running yet
+  void start() {
+    std::call_once(m_started, [this] { m_thread = std::thread{[this] { run(); }}; });
+  }
+
+  // For every recorded entry; only slow ones cost more than a compare
+  void observe(uint64_t ticket, uint64_t duration_ns) {
+    if (m_options.trigger_ns != 0 && duration_ns >= m_options.trigger_ns) [[unlikely]] {
+      trigger_latency(ticket);
+    }
+  }
+
+  // Dumps everything up to the newest entry. False if a dump is already in progress or there is nothing to dump.
+  bool trigger_command() {
+    uint64_t head = m_ring.head();
+    return head != 0 && trigger(head - 1, command);
+  }
+
+  uint64_t dumps() const { return m_dumps.load(std::memory_order_relaxed); }
+  uint64_t suppressed() const { return m_suppressed.load(std::memory_order_relaxed); }
+  uint64_t failures() const { return m_failures.load(std::memory_order_relaxed); }
+
+private:
+  // `m_pending` is 0 while idle, `STOP` on shutdown, else the ticket + 1 with the reason in the top bit
+  static constexpr uint64_t STOP = ~uint64_t{0};
+  static constexpr uint64_t REASON_BIT = uint64_t{1} << 63;
+
+  static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  void trigger_latency(uint64_t ticket) {
+    int64_t now = now_ns();
+    int64_t allowed = m_next_allowed_ns.load(std::memory_order_relaxed);
+    if (now < allowed
+        || !m_next_allowed_ns.compare_exchange_strong(allowed, now + m_options.min_interval.count(),
+                                                      std::memory_order_relaxed)) {
+      m_suppressed.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    trigger(ticket, latency);
+  }
+
+  bool trigger(uint64_t ticket, Reason reason) {
+    start();
+    uint64_t idle = 0;
+    uint64_t pending = (ticket + 1) | (reason == command ? REASON_BIT : 0);
+    if (!m_pending.compare_exchange_strong(idle, pending, std::memory_order_acq_rel)) {
+      m_suppressed.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    m_pending.notify_one();
+    return true;
+  }
+
+  void run() {
+    std::vector<SeqlockRing::Entry> window;
+    for (;;) {
+      m_pending.wait(0, std::memory_order_acquire);
+      uint64_t pending = m_pending.load(std::memory_order_acquire);
+      if (pending == STOP) {
+        return;
+      }
+      uint64_t ticket = (pending & ~REASON_BIT) - 1;
+      Reason reason = (pending & REASON_BIT) ? command : latency;
+
+      // Copy first, the ring keeps moving
+      uint64_t count = ticket + 1 < m_options.entries ? ticket + 1 : m_options.entries;
+      uint64_t first = ticket + 1 - count;
+      window.resize(count);
+      for (uint64_t i = 0; i < count; ++i) {
+        if (!m_ring.read(first + i, window[i])) {
+          window[i] = {~uint64_t{0}, ~uint64_t{0}};
+        }
+      }
+      FlightRecorderHeader header{
+        .magic = {'I', 'O', 'F', 'S', 'L', 'A', 'S', 'T'},
+        .version = 1,
+        .entry_size = sizeof(SeqlockRing::Entry),
+        .first_ticket = first,
+        .count = count,
+        .trigger_ticket = ticket,
+        .trigger_reason = reason,
+        .unix_time_ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::system_clock::now().time_since_epoch()).count()),
+      };
+      if (write_dump(ticket, header, window)) {
+        m_dumps.fetch_add(1, std::memory_order_relaxed);
+      } else {
+        m_failures.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      // Ready for the next one, unless we are shutting down meanwhile
+      uint64_t expected = pending;
+      m_pending.compare_exchange_strong(expected, 0, std::memory_order_acq_rel);
+    }
+  }
+
+  // Written under a temporary name and renamed, so readers never see half a dump
+  bool write_dump(uint64_t ticket, const FlightRecorderHeader &header, const std::vector<SeqlockRing::Entry> &window) {
+    std::string path = m_options.dir + "/lastn-" + std::to_string(getpid()) + "-" + std::to_string(ticket) + ".bin";
+    std::string tmp = path + ".tmp";
+    FILE *f = std::fopen(tmp.c_str(), "wb");
+    if (!f) {
+      return false;
+    }
+    bool ok = std::fwrite(&header, sizeof(header), 1, f) == 1
+      && std::fwrite(window.data(), sizeof(SeqlockRing::Entry), window.size(), f) == window.size();
+    ok = std::fclose(f) == 0 && ok;
+    if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+      std::remove(tmp.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  const SeqlockRing &m_ring;
+  Options m_options;
+
+  std::atomic<uint64_t> m_pending{0};
+  std::atomic<int64_t> m_next_allowed_ns{0};
+  std::atomic<uint64_t> m_dumps{0};
+  std::atomic<uint64_t> m_suppressed{0};
+  std::atomic<uint64_t> m_failures{0};
+
+  std::once_flag m_started;
+  std::thread m_thread;
+};
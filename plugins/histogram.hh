@@ -0,0 +1,105 @@
+#pragma once
+
+#include "plugin_config.hh"
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// Log-linear (HDR-style) histogram buckets with constant-time lookup.
+//
+// The range (2^min_exp, 2^max_exp] is split into powers of two, and each of those linearly into 2^sub_bits buckets,
+// so the relative bucket width is at most 2^-sub_bits. Below comes one bucket for everything <= 2^min_exp, above the
+// +Inf bucket. The bucket of a value is found from its highest set bit, no matter how many buckets there are.
+//
+// Counts are stored per bucket, not cumulatively; `upper_bound` and cumulating are only needed when exporting.
+struct LogLinearLayout {
+  unsigned min_exp;
+  unsigned max_exp;
+  unsigned sub_bits;
+
+  constexpr bool valid() const { return min_exp >= sub_bits && min_exp < max_exp && max_exp < 64; }
+
+  // Buckets with a finite upper bound
+  constexpr size_t explicit_buckets() const { return (static_cast<size_t>(max_exp - min_exp) << sub_bits) + 1; }
+  // Including +Inf, which is the last one
+  constexpr size_t buckets() const { return explicit_buckets() + 1; }
+
+  constexpr size_t index(uint64_t value) const {
+    if (value <= (uint64_t{1} << min_exp)) {
+      return 0;
+    }
+    if (value > (uint64_t{1} << max_exp)) {
+      return explicit_buckets();
+    }
+    // Upper bounds are inclusive, so look at `value - 1`, which is >= 2^min_exp
+    uint64_t v = value - 1;
+    unsigned exp = static_cast<unsigned>(std::bit_width(v)) - 1;
+    size_t sub = static_cast<size_t>(v >> (exp - sub_bits)) & ((size_t{1} << sub_bits) - 1);
+    return 1 + (static_cast<size_t>(exp - min_exp) << sub_bits) + sub;
+  }
+
+  // The `le` of an explicit bucket
+  constexpr uint64_t upper_bound(size_t bucket) const {
+    if (bucket == 0) {
+      return uint64_t{1} << min_exp;
+    }
+    unsigned exp = min_exp + static_cast<unsigned>((bucket - 1) >> sub_bits);
+    uint64_t sub = (bucket - 1) & ((size_t{1} << sub_bits) - 1);
+    return (uint64_t{1} << exp) + ((sub + 1) << (exp - sub_bits));
+  }
+};
+
+// Bounds the memory of configured layouts
+constexpr size_t LOG_LINEAR_MAX_BUCKETS = 1024;
+
+// A layout from the plugin configuration: `log2[/N][:LO-HI]`, with N buckets per power of two from LO to HI, all three
+// powers of two themselves (e.g. `log2/4:4K-1M`). What is left out is taken from `defaults`.
+inline LogLinearLayout parse_log_linear_layout(std::string_view text, LogLinearLayout defaults) {
+  auto invalid = [text]() {
+    return std::invalid_argument("expected buckets like log2, log2/4 or log2/4:4K-1M, got '" + std::string{text} + "'");
+  };
+  auto exponent = [&](std::string_view power) -> unsigned {
+    uint64_t value = parse_config_size(power);
+    if (!std::has_single_bit(value)) {
+      throw invalid();
+    }
+    return static_cast<unsigned>(std::countr_zero(value));
+  };
+
+  if (!text.starts_with("log2")) {
+    throw invalid();
+  }
+  LogLinearLayout layout = defaults;
+  std::string_view rest = text.substr(4);
+  size_t colon = rest.find(':');
+  std::string_view sub = rest.substr(0, colon);
+  if (!sub.empty()) {
+    if (sub[0] != '/') {
+      throw invalid();
+    }
+    layout.sub_bits = exponent(sub.substr(1));
+  }
+  if (colon != std::string_view::npos) {
+    std::string_view range = rest.substr(colon + 1);
+    size_t dash = range.find('-');
+    if (dash == std::string_view::npos) {
+      throw invalid();
+    }
+    layout.min_exp = exponent(range.substr(0, dash));
+    layout.max_exp = exponent(range.substr(dash + 1));
+  }
+  if (!layout.valid() || layout.buckets() > LOG_LINEAR_MAX_BUCKETS) {
+    throw std::invalid_argument("bucket layout '" + std::string{text} + "' is empty, too fine or has too many buckets");
+  }
+  return layout;
+}
+
+static_assert(LogLinearLayout{12, 20, 0}.index(4096) == 0);
+static_assert(LogLinearLayout{12, 20, 0}.index(4097) == 1);
+static_assert(LogLinearLayout{12, 20, 0}.upper_bound(1) == 8192);
+static_assert(LogLinearLayout{12, 20, 0}.index(1 << 20) == 8);
+static_assert(LogLinearLayout{12, 20, 0}.index((1 << 20) + 1) == 9);
+static_assert(LogLinearLayout{10, 12, 2}.upper_bound(LogLinearLayout{10, 12, 2}.index(1281)) == 1536);
@@ -0,0 +1,224 @@
+#pragma once
+
+#include "plugin.hh"
+#include "plugin_config.hh"
+#include "plugin_helpers.hh"
+#include "flight_recorder.hh"
+#include "seqlock_ring.hh"
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// Sample plugin: Records last N metrics
+// - Discards everything except `read`/`write` (and optionally `read_buf`/`write_buf`).
+// - Uses a `N`-sized lock-free ring buffer, see `SeqlockRing`. Scrapes never see torn entries, and never slow down
+//   the workers recording.
+// - Each entry records: which op it was, how many bytes, how long it took; 16 bytes, plus the sequence word.
+
+// Configured at load time, e.g. `-p 'lastn.so:n=1M;export=1000;zero_copy=1'`:
+// - `n`: the ring size, rounded up to a power of two. 128 by default, at most 16M (384 MiB).
+// - `export`: how many of the newest entries each scrape exports, by default all of them up to 4096. A large `n`
+//   is not meant to be scraped completely.
+// - `zero_copy`: whether to count `read_buf`/`write_buf` as well (`0`/`1`, default `0`). Obviously, its a noop if
+//   iofs-ng does not run with `--zero-copy`.
+//
+// Flight recorder, see `FlightRecorder`; off unless `dump_dir` is given:
+// - `dump_dir`: where dumps of the ring go.
+// - `trigger_ns`: dump whenever an op takes at least this long. Without it, only the `dump` command does.
+// - `dump_interval`: at most one latency triggered dump per this many seconds, 60 by default.
+// - `dump_entries`: the newest entries to dump, by default the whole ring.
+static constexpr size_t LAST_N_DEFAULT = 128;
+static constexpr size_t LAST_N_MAX = size_t{1} << 24;
+static constexpr size_t LAST_N_EXPORT_DEFAULT = 4096;
+
+// Everything else is not even timed, unless another plugin wants it
+static constexpr iofs_op_mask_t LAST_N_OPS = IOFS_OP_BIT(IOFS_OP_READ) | IOFS_OP_BIT(IOFS_OP_WRITE);
+static constexpr iofs_op_mask_t LAST_N_ZERO_COPY_OPS = IOFS_OP_BIT(IOFS_OP_READ_BUF) | IOFS_OP_BIT(IOFS_OP_WRITE_BUF);
+
+// One recorded op as stored in the ring: the op in the top byte, the size in the remaining 56 bits (saturated).
+struct LastNEntry {
+  static constexpr uint64_t SIZE_MASK = (uint64_t{1} << 56) - 1;
+
+  uint64_t duration_ns;
+  uint64_t op_size;
+
+  static LastNEntry pack(iofs_op_t op, uint64_t duration_ns, uint64_t size_bytes) {
+    return {duration_ns, (static_cast<uint64_t>(op) << 56) | (size_bytes < SIZE_MASK ? size_bytes : SIZE_MASK)};
+  }
+  iofs_op_t op() const { return static_cast<iofs_op_t>(op_size >> 56); }
+  uint64_t size_bytes() const { return op_size & SIZE_MASK; }
+  bool is_write() const { return op() == IOFS_OP_WRITE || op() == IOFS_OP_WRITE_BUF; }
+};
+static_assert(sizeof(LastNEntry) == sizeof(SeqlockRing::Entry));
+
+class LastNPlugin {
+  int m_id;
+  std::string m_name;
+
+  iofs_op_mask_t m_ops{LAST_N_OPS};
+  size_t m_export;
+  std::unique_ptr<SeqlockRing> m_ring;
+  std::unique_ptr<FlightRecorder> m_recorder;
+
+  // Appends a line to `buf` if it fits completely, so truncation never leaves half an entry
+  template <typename... Args>
+  static bool emit(char *buf, size_t buf_size, size_t &offset, const char *fmt, Args... args) {
+    if (offset >= buf_size) {
+      return false;
+    }
+    int written = std::snprintf(buf + offset, buf_size - offset, fmt, args...);
+    if (written < 0 || static_cast<size_t>(written) >= buf_size - offset) {
+      return false;
+    }
+    offset += static_cast<size_t>(written);
+    return true;
+  }
+
+public:
+  static constexpr const char *NAME = "LastNPlugin";
+  static constexpr const char *VERSION = "0.3.0";
+  static constexpr iofs_op_mask_t OPS = LAST_N_OPS | LAST_N_ZERO_COPY_OPS;
+
+  explicit LastNPlugin(const PluginConfig &config = {}) {
+    config.expect_keys({"n", "export", "zero_copy", "dump_dir", "trigger_ns", "dump_interval", "dump_entries"});
+    size_t n = LAST_N_DEFAULT;
+    if (const std::string *v = config.get("n")) {
+      n = parse_config_size(*v);
+      if (n == 0 || n > LAST_N_MAX) {
+        throw std::invalid_argument("n must be between 1 and " + std::to_string(LAST_N_MAX));
+      }
+    }
+    m_export = n < LAST_N_EXPORT_DEFAULT ? n : LAST_N_EXPORT_DEFAULT;
+    if (const std::string *v = config.get("export")) {
+      m_export = parse_config_size(*v);
+    }
+    if (const std::string *v = config.get("zero_copy")) {
+      if (*v != "0" && *v != "1") {
+        throw std::invalid_argument("zero_copy must be 0 or 1");
+      }
+      if (*v == "1") {
+        m_ops |= LAST_N_ZERO_COPY_OPS;
+      }
+    }
+    m_ring = std::make_unique<SeqlockRing>(n);
+
+    if (const std::string *dir = config.get("dump_dir")) {
+      FlightRecorder::Options options{.dir = *dir};
+      if (const std::string *v = config.get("trigger_ns")) {
+        options.trigger_ns = parse_config_size(*v);
+      }
+      if (const std::string *v = config.get("dump_interval")) {
+        options.min_interval = std::chrono::seconds{parse_config_size(*v)};
+      }
+      if (const std::string *v = config.get("dump_entries")) {
+        options.entries = parse_config_size(*v);
+      }
+      m_recorder = std::make_unique<FlightRecorder>(*m_ring, std::move(options));
+    } else if (config.get("trigger_ns") || config.get("dump_interval") || config.get("dump_entries")) {
+      throw std::invalid_argument("the flight recorder needs a dump_dir");
+    }
+
+    static std::atomic<int> counter{0};
+    m_id = ++counter;
+    m_name = "Instance_" + std::to_string(m_id);
+    std::cout << "[LastNPlugin " << m_name << "] Constructed (N=" << m_ring->capacity()
+              << (m_ring->huge_pages() ? ", huge pages" : "") << ")" << std::endl;
+  }
+
+  iofs_op_mask_t subscriptions() const {
+    return m_ops;
+  }
+
+  ~LastNPlugin() {
+    std::cout << "[LastNPlugin " << m_name << "] Destructed" << std::endl;
+  }
+
+  void record(iofs_op_t op, uint64_t duration_ns, uint64_t units) {
+    if (static_cast<size_t>(op) >= IOFS_OP_COUNT || !(m_ops & IOFS_OP_BIT(op))) {
+      return; // not read write, we DO NOT care
+    }
+    LastNEntry e{LastNEntry::pack(op, duration_ns, units)};
+    uint64_t ticket{m_ring->push({e.duration_ns, e.op_size})};
+    if (m_recorder) {
+      m_recorder->observe(ticket, duration_ns);
+    }
+  }
+
+  // `dump`: dumps the ring now, regardless of the rate limit
+  int command(const char *command, char *reply, size_t reply_size) {
+    if (std::string_view{command} != "dump") {
+      std::snprintf(reply, reply_size, "unknown command '%s'", command);
+      return 1;
+    }
+    if (!m_recorder) {
+      std::snprintf(reply, reply_size, "flight recorder is off, load with dump_dir=...");
+      return 1;
+    }
+    if (!m_recorder->trigger_command()) {
+      std::snprintf(reply, reply_size, "nothing recorded yet, or a dump is still being written");
+      return 1;
+    }
+    std::snprintf(reply, reply_size, "dump started");
+    return 0;
+  }
+
+  size_t poll_metrics(char *buf, size_t buf_size) {
+    // The newest `m_export` entries still in the ring, oldest first
+    uint64_t head{m_ring->head()};
+    uint64_t window{m_export < m_ring->capacity() ? m_export : m_ring->capacity()};
+    uint64_t first{head > window ? head - window : 0};
+
+    size_t offset{0};
+    bool fits = emit(buf, buf_size, offset,
+      "# HELP lastN_capacity Entries kept in the ring.\n"
+      "# TYPE lastN_capacity gauge\n"
+      "lastN_capacity %llu\n",
+      static_cast<unsigned long long>(m_ring->capacity()));
+    if (m_recorder) {
+      m_recorder->start();
+      fits = fits && emit(buf, buf_size, offset,
+        "# HELP lastN_dumps_total Flight recorder dumps written.\n"
+        "# TYPE lastN_dumps_total counter\n"
+        "lastN_dumps_total %llu\n"
+        "# HELP lastN_dumps_suppressed_total Flight recorder triggers dropped by the rate limit or a running dump.\n"
+        "# TYPE lastN_dumps_suppressed_total counter\n"
+        "lastN_dumps_suppressed_total %llu\n"
+        "# HELP lastN_dump_failures_total Flight recorder dumps that could not be written.\n"
+        "# TYPE lastN_dump_failures_total counter\n"
+        "lastN_dump_failures_total %llu\n",
+        static_cast<unsigned long long>(m_recorder->dumps()),
+        static_cast<unsigned long long>(m_recorder->suppressed()),
+        static_cast<unsigned long long>(m_recorder->failures()));
+    }
+    fits = fits && emit(buf, buf_size, offset,
+      "# HELP lastN Per-entry I/O record. i=global sequence number. size label is bytes transferred.\n"
+      "# TYPE lastN gauge\n");
+    if (!fits) {
+      return 0;
+    }
+
+    // Entries overwritten or still being written while we read them are skipped
+    for (uint64_t i = first; i < head; ++i) {
+      SeqlockRing::Entry raw;
+      if (!m_ring->read(i, raw)) {
+        continue;
+      }
+      LastNEntry e{raw.a, raw.b};
+      if (!emit(buf, buf_size, offset,
+          "lastN{i=\"%llu\",size=\"%llu\",op=\"%s\"} %llu\n",
+          static_cast<unsigned long long>(i),
+          static_cast<unsigned long long>(e.size_bytes()),
+          e.is_write() ? "w" : "r",
+          static_cast<unsigned long long>(e.duration_ns))) {
+        break; // truncated
+      }
+    }
+
+    return offset;
+  }
+};
@@ -41,9 +41,28 @@ typedef enum {
   IOFS_OP_READ_BUF,
   IOFS_OP_FLOCK,
   IOFS_OP_FALLOCATE,
+  IOFS_OP_FGETATTR,
+  IOFS_OP_FCHMOD,
+  IOFS_OP_FCHOWN,
+  IOFS_OP_FTRUNCATE,
+  IOFS_OP_FUTIMENS,
+  IOFS_OP_PASSTHROUGH_READ,
+  IOFS_OP_PASSTHROUGH_WRITE,
   IOFS_OP_COUNT
 } iofs_op_t;
 
+/* Op subscriptions are bitmasks over `iofs_op_t` */
+typedef uint64_t iofs_op_mask_t;
+#define IOFS_OP_BIT(op) (UINT64_C(1) << (op))
+#define IOFS_OPS_ALL (IOFS_OP_BIT(IOFS_OP_COUNT) - 1)
+/* The ops up to `IOFS_OP_FALLOCATE`, which v1 plugins size their tables for; they never get the later ones */
+#define IOFS_OPS_V1 (IOFS_OP_BIT(IOFS_OP_FALLOCATE + 1) - 1)
+
+/*
+ * ABI v1: the plugin keeps its context in a `thread_local`, which the host sets through `bind` around every call.
+ * Still loaded, but new plugins should use v2. Only gets the ops of `IOFS_OPS_V1`, i.e. no fd variants (`fgetattr`,
+ * ...) and no passthrough summaries.
+ */
 struct IofsPlugin {
   const char *(*get_name)(void);
   const char *(*get_version)(void);
@@ -63,13 +82,90 @@ static inline int validate_iofs_plugin(const struct IofsPlugin *p) {
   return 1;
 }
 
+#define IOFS_PLUGIN_ABI_VERSION 6
+/* Oldest ABI whose `IofsPluginV2` is a prefix of the current one, and thus still loaded */
+#define IOFS_PLUGIN_ABI_MIN_VERSION 3
+
+/*
+ * One measured op. Fields are only ever appended, so a plugin built against an older header can still be loaded;
+ * it just does not get `record_batch` calls (see `event_size`).
+ */
+struct iofs_event {
+  iofs_op_t op;
+  uint64_t duration_ns;
+  uint64_t units;
+  /* Since v5, for reads/writes (offset and file) and `release` (file only), else 0. The file is an id of the open
+     file, unique for the lifetime of the process, so two opens of the same path are two ids. */
+  uint64_t offset;
+  uint64_t file_id;
+  /* Since v6, whom the op was for, see `fuse_get_context`. 0 for ops iofs-ng does on its own. */
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t pid;
+};
+
+/*
+ * ABI v2: every call gets the context returned by `init`, so no binding is needed.
+ *
+ * Since v3, `init` gets the plugin's configuration: everything after the first `:` of `-p path.so:config`, by
+ * convention `key=value` pairs separated by `;` (see `plugin_config.hh`). It is NULL without one. On an invalid
+ * configuration, the plugin reports why and returns NULL, which fails the load; otherwise the context must be non-NULL.
+ * Plugins built for v2 have to be rebuilt.
+ *
+ * Since v4, `command` (optional) takes commands from the control server (`POST /plugins/command`), e.g. to dump
+ * state on demand. It writes a NUL-terminated reply and returns 0, or nonzero if the command failed or is unknown.
+ * Fields are only ever appended from here on; the host does not touch those newer than the plugin's `abi_version`.
+ *
+ * Since v5, `iofs_event` carries the offset and file of each op. `record` does not, so plugins that need them set
+ * `record_event` (optional), which the host then calls instead of `record`. Since v6, it carries the caller as well.
+ *
+ * `record_batch` is optional. It is used by asynchronous dispatch (`--dispatch async`), which delivers many events
+ * at once; without it, the host calls `record` for each of them.
+ *
+ * `subscriptions` is optional as well and returns the ops the plugin wants to see (NULL means all of them). Only
+ * subscribed ops are passed to `record`/`record_batch`, and ops nobody subscribed to are not even timed. The host
+ * asks once after `init` and again after every `poll_prometheus_metrics`, so a plugin may change its mind at runtime.
+ */
+struct IofsPluginV2 {
+  uint32_t abi_version; /* IOFS_PLUGIN_ABI_VERSION */
+  uint32_t event_size;  /* sizeof(struct iofs_event) */
+
+  const char *(*get_name)(void);
+  const char *(*get_version)(void);
+
+  void *(*init)(const char *config);
+  void (*destroy)(void *ctx);
+
+  void (*record)(void *ctx, iofs_op_t op, uint64_t duration_ns, uint64_t units);
+  void (*record_batch)(void *ctx, const struct iofs_event *events, size_t n);
+  size_t (*poll_prometheus_metrics)(void *ctx, char *buf, size_t buf_size);
+  iofs_op_mask_t (*subscriptions)(void *ctx);
+  int (*command)(void *ctx, const char *command, char *reply, size_t reply_size);
+  void (*record_event)(void *ctx, const struct iofs_event *event);
+};
+
+struct IofsPluginV2 *get_iofs_plugin_v2(void);
+
+static inline int validate_iofs_plugin_v2(const struct IofsPluginV2 *p) {
+  if (!p || p->abi_version < IOFS_PLUGIN_ABI_MIN_VERSION || p->abi_version > IOFS_PLUGIN_ABI_VERSION) return 0;
+  if (p->event_size > sizeof(struct iofs_event)) return 0;
+  if (!p->get_name || !p->get_version || !p->init || !p->destroy || !p->record) return 0;
+  return 1;
+}
+
+#ifdef __cplusplus
+static_assert(IOFS_OP_COUNT < 64, "iofs_op_mask_t has one bit per op");
+#endif
+
 static inline const char *iofs_op_to_string(iofs_op_t op) {
   static const char *const names[] = {
     "getattr", "readlink", "mkdir", "unlink", "rmdir", "symlink", "rename",
     "link", "chmod", "chown", "truncate", "open", "read", "write", "statfs",
     "flush", "release", "fsync", "setxattr", "getxattr", "listxattr",
     "removexattr", "opendir", "readdir", "releasedir", "access", "create",
-    "utimens", "write_buf", "read_buf", "flock", "fallocate"
+    "utimens", "write_buf", "read_buf", "flock", "fallocate", "fgetattr",
+    "fchmod", "fchown", "ftruncate", "futimens", "passthrough_read",
+    "passthrough_write"
   };
 
   if (op >= 0 && op < IOFS_OP_COUNT) {
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "plugin.hh"
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <initializer_list>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// The configuration a plugin gets in `init`, e.g. `ops=read,write;buckets=log2` out of
+// `-p stats.so:ops=read,write;buckets=log2`.
+//
+// It is parsed once, when the plugin is loaded, so the plugin can turn it into whatever its `record` reads fastest
+// (flat tables, not this). Every error is a `std::invalid_argument`, including keys the plugin does not know, so
+// typos do not silently fall back to the defaults. Exceptions must not cross the C ABI; `iofs_plugin_init` turns
+// them into a failed `init`.
+class PluginConfig {
+  std::vector<std::pair<std::string, std::string>> m_entries;
+
+public:
+  PluginConfig() = default;
+
+  explicit PluginConfig(std::string_view text) {
+    while (!text.empty()) {
+      size_t end = text.find(';');
+      std::string_view entry = text.substr(0, end);
+      text = end == std::string_view::npos ? std::string_view{} : text.substr(end + 1);
+      if (entry.empty()) {
+        continue;
+      }
+      size_t eq = entry.find('=');
+      if (eq == std::string_view::npos || eq == 0) {
+        throw std::invalid_argument("expected key=value, got '" + std::string{entry} + "'");
+      }
+      m_entries.emplace_back(std::string{entry.substr(0, eq)}, std::string{entry.substr(eq + 1)});
+    }
+  }
+
+  // The last value given for `key`, nullptr if there is none
+  const std::string *get(std::string_view key) const {
+    for (auto it = m_entries.rbegin(); it != m_entries.rend(); ++it) {
+      if (it->first == key) {
+        return &it->second;
+      }
+    }
+    return nullptr;
+  }
+
+  // Throws on every key not in `known`
+  void expect_keys(std::initializer_list<std::string_view> known) const {
+    for (const auto &[key, value] : m_entries) {
+      bool found = false;
+      for (std::string_view k : known) {
+        found |= k == key;
+      }
+      if (!found) {
+        throw std::invalid_argument("unknown option '" + key + "'");
+      }
+    }
+  }
+};
+
+// A non-negative integer with an optional binary suffix, i.e. `4K` is 4096
+inline uint64_t parse_config_size(std::string_view text) {
+  uint64_t shift = 0;
+  if (!text.empty()) {
+    switch (text.back()) {
+      case 'K': shift = 10; break;
+      case 'M': shift = 20; break;
+      case 'G': shift = 30; break;
+      default: break;
+    }
+  }
+  std::string_view digits = shift ? text.substr(0, text.size() - 1) : text;
+  uint64_t value = 0;
+  auto [end, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), value);
+  if (digits.empty() || ec != std::errc{} || end != digits.data() + digits.size() || value > (UINT64_MAX >> shift)) {
+    throw std::invalid_argument("expected a size like 4096 or 4K, got '" + std::string{text} + "'");
+  }
+  return value << shift;
+}
+
+// Comma-separated op names as in `iofs_op_to_string`, or `all`
+inline iofs_op_mask_t parse_config_ops(std::string_view text) {
+  if (text == "all") {
+    return IOFS_OPS_ALL;
+  }
+  iofs_op_mask_t mask = 0;
+  while (!text.empty()) {
+    size_t end = text.find(',');
+    std::string_view name = text.substr(0, end);
+    text = end == std::string_view::npos ? std::string_view{} : text.substr(end + 1);
+    int op = 0;
+    while (op < IOFS_OP_COUNT && name != iofs_op_to_string(static_cast<iofs_op_t>(op))) {
+      ++op;
+    }
+    if (op == IOFS_OP_COUNT) {
+      throw std::invalid_argument("unknown op '" + std::string{name} + "'");
+    }
+    mask |= IOFS_OP_BIT(op);
+  }
+  return mask;
+}
+
+// `init` for the ABI glue of a plugin class constructible from a `PluginConfig`
+template <typename Plugin>
+void *iofs_plugin_init(const char *config) {
+  try {
+    return new Plugin(PluginConfig{config ? config : ""});
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "[%s] Invalid configuration: %s\n", Plugin::NAME, e.what());
+    return nullptr;
+  }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "plugin.hh"
+#include <cstddef>
+#include <cstdio>
+#include <utility>
+
+// Pieces every plugin class needs, shared by their `.so` glue and `StaticPluginSet` (see `plugin_config.hh` for
+// `init`).
+
+// Type-safe snprintf wrapper for `poll_metrics` that advances `offset`. Returns whether there is room left; what does
+// not fit is cut off.
+template <typename... Args>
+bool emit_metric(char *buf, size_t buf_size, size_t &offset, const char *fmt, Args&&... args) {
+  if (offset >= buf_size) {
+    return false;
+  }
+  int written = std::snprintf(buf + offset, buf_size - offset, fmt, std::forward<Args>(args)...);
+  if (written < 0) {
+    return false;
+  }
+  offset += static_cast<size_t>(written);
+  return offset < buf_size;
+}
+
+// Passes one event to `record_event` if the plugin class needs the whole event, else to `record`
+template <typename Plugin>
+void plugin_record(Plugin &plugin, const iofs_event &event) {
+  if constexpr (requires { plugin.record_event(event); }) {
+    plugin.record_event(event);
+  } else {
+    plugin.record(event.op, event.duration_ns, event.units);
+  }
+}
+
+// Plugin classes only provide `record_batch` if they gain something from seeing the events at once; the others get
+// each event in turn
+template <typename Plugin>
+void plugin_record_batch(Plugin &plugin, const iofs_event *events, size_t n) {
+  if constexpr (requires { plugin.record_batch(events, n); }) {
+    plugin.record_batch(events, n);
+  } else {
+    for (size_t i = 0; i < n; ++i) {
+      plugin_record(plugin, events[i]);
+    }
+  }
+}
+
+// `record_batch` for the ABI glue of a plugin class, see `plugin_record_batch`
+template <typename Plugin>
+void iofs_plugin_record_batch(void *ctx, const struct iofs_event *events, size_t n) {
+  plugin_record_batch(*static_cast<Plugin *>(ctx), events, n);
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <sys/mman.h>
+
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+
+// A lock-free ring of the last `capacity()` 16-byte entries, which any number of threads push to and any thread can
+// read without ever blocking them.
+//
+// Every push takes a ticket (its global sequence number) and publishes the slot seqlock-style: the slot's sequence
+// word is odd while the entry is written and `2 * ticket + 2` once it is complete. A reader asking for ticket `i`
+// checks that word before and after copying the entry, so it never returns a torn entry, nor one that was
+// overwritten by a newer ticket in the meantime; it just skips those. The only unprotected case is two writers on
+// the same slot at once, which needs the whole ring to be lapped during a single push.
+//
+// Slots are `mmap`ed and touched up front, so pushes never fault. Rings of 2 MiB and more try huge pages: reserved
+// ones (`MAP_HUGETLB`) first, then transparent huge pages.
+class SeqlockRing {
+public:
+  struct Entry {
+    uint64_t a;
+    uint64_t b;
+  };
+
+  // `capacity` is rounded up to a power of two. Throws `std::bad_alloc` if the memory cannot be mapped.
+  explicit SeqlockRing(size_t capacity) : m_mask{std::bit_ceil(capacity) - 1} {
+    size_t bytes = (m_mask + 1) * sizeof(Slot);
+    void *mem = MAP_FAILED;
+    if (bytes >= HUGE_PAGE) {
+      m_bytes = (bytes + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+      mem = mmap(nullptr, m_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | HUGETLB_2MB, -1, 0);
+      m_huge_pages = mem != MAP_FAILED;
+    }
+    if (mem == MAP_FAILED) {
+      m_bytes = bytes;
+      mem = mmap(nullptr, m_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (mem == MAP_FAILED) {
+        throw std::bad_alloc();
+      }
+      if (bytes >= HUGE_PAGE) {
+        m_huge_pages = madvise(mem, m_bytes, MADV_HUGEPAGE) == 0;
+      }
+    }
+    m_slots = static_cast<Slot *>(mem);
+    std::uninitialized_value_construct_n(m_slots, m_mask + 1);
+  }
+
+  ~SeqlockRing() {
+    munmap(m_slots, m_bytes);
+  }
+
+  SeqlockRing(const SeqlockRing &) = delete;
+  SeqlockRing &operator=(const SeqlockRing &) = delete;
+
+  size_t capacity() const { return m_mask + 1; }
+  // Whether huge pages were granted (for transparent ones: requested)
+  bool huge_pages() const { return m_huge_pages; }
+  // Tickets handed out so far, i.e. one past the newest entry
+  uint64_t head() const { return m_head.load(std::memory_order_acquire); }
+
+  // Returns the entry's ticket
+  uint64_t push(Entry entry) {
+    uint64_t ticket = m_head.fetch_add(1, std::memory_order_relaxed);
+    Slot &slot = m_slots[ticket & m_mask];
+    slot.seq.store(2 * ticket + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.a.store(entry.a, std::memory_order_relaxed);
+    slot.b.store(entry.b, std::memory_order_relaxed);
+    slot.seq.store(2 * ticket + 2, std::memory_order_release);
+    return ticket;
+  }
+
+  // Copies the entry of `ticket` into `out`. False if it is not complete yet or already overwritten.
+  bool read(uint64_t ticket, Entry &out) const {
+    const Slot &slot = m_slots[ticket & m_mask];
+    uint64_t expected = 2 * ticket + 2;
+    if (slot.seq.load(std::memory_order_acquire) != expected) {
+      return false;
+    }
+    out.a = slot.a.load(std::memory_order_relaxed);
+    out.b = slot.b.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot.seq.load(std::memory_order_relaxed) == expected;
+  }
+
+private:
+  static constexpr size_t HUGE_PAGE = size_t{2} << 20;
+#ifdef MAP_HUGE_SHIFT
+  static constexpr int HUGETLB_2MB = MAP_HUGETLB | (21 << MAP_HUGE_SHIFT);
+#else
+  static constexpr int HUGETLB_2MB = MAP_HUGETLB;
+#endif
+
+  // The entry plus its sequence word; 0 means never written
+  struct Slot {
+    std::atomic<uint64_t> seq{0};
+    std::atomic<uint64_t> a{0};
+    std::atomic<uint64_t> b{0};
+  };
+
+  size_t m_mask;
+  size_t m_bytes{0};
+  bool m_huge_pages{false};
+  Slot *m_slots{nullptr};
+  alignas(64) std::atomic<uint64_t> m_head{0};
+};
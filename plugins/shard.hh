@@ -0,0 +1,204 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+// Per-thread shards of counters, for plugins whose `record` would otherwise have all FUSE workers `fetch_add` on the
+// same cache lines.
+//
+// Each thread gets its own cache-line-aligned copy of `T`, allocated on its first `local()`, and updates it with
+// `ShardCounter::add`: a load and a store, no locked instruction. Readers sum all shards, see `for_each`. Threads
+// are numbered densely and the numbers are reused after a thread exits, so the shards stay bounded by the number of
+// threads alive at once; a reused shard just keeps counting. Beyond `SHARD_MAX_THREADS` threads, the remaining ones
+// share one shard and fall back to atomic increments.
+
+constexpr size_t SHARD_MAX_THREADS = 8192;
+
+// A counter written by a single thread, readable by any
+class ShardCounter {
+  std::atomic<uint64_t> m_value{0};
+
+public:
+  void add(uint64_t v, bool shared) {
+    if (shared) [[unlikely]] {
+      m_value.fetch_add(v, std::memory_order_relaxed);
+    } else {
+      m_value.store(m_value.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+    }
+  }
+  uint64_t load() const { return m_value.load(std::memory_order_relaxed); }
+};
+
+namespace shard_detail {
+
+// Dense, recycled thread numbers; `SHARD_MAX_THREADS` for all threads beyond
+class ThreadIndex {
+  std::mutex m_mutex;
+  std::vector<size_t> m_free;
+  size_t m_next{0};
+
+public:
+  static ThreadIndex &instance() {
+    static ThreadIndex inst;
+    return inst;
+  }
+
+  size_t acquire() {
+    std::lock_guard lock{m_mutex};
+    if (!m_free.empty()) {
+      size_t index = m_free.back();
+      m_free.pop_back();
+      return index;
+    }
+    return m_next < SHARD_MAX_THREADS ? m_next++ : SHARD_MAX_THREADS;
+  }
+
+  void release(size_t index) {
+    if (index < SHARD_MAX_THREADS) {
+      std::lock_guard lock{m_mutex};
+      m_free.push_back(index);
+    }
+  }
+};
+
+struct ThreadLease {
+  size_t index = ThreadIndex::instance().acquire();
+  ~ThreadLease() { ThreadIndex::instance().release(index); }
+};
+
+inline size_t this_thread_index() {
+  thread_local ThreadLease lease;
+  return lease.index;
+}
+
+} // namespace shard_detail
+
+template <typename T>
+class Sharded {
+  struct alignas(64) Shard {
+    T data{};
+  };
+
+  // Shards are allocated in chunks on first use, so memory grows with the threads actually seen
+  static constexpr size_t CHUNK = 64;
+  static constexpr size_t CHUNKS = SHARD_MAX_THREADS / CHUNK + 1; // +1 for the shared overflow shard
+
+  std::unique_ptr<std::atomic<Shard *>[]> m_chunks{new std::atomic<Shard *>[CHUNKS]{}};
+  std::mutex m_alloc_mutex;
+
+public:
+  Sharded() = default;
+  Sharded(const Sharded &) = delete;
+  Sharded &operator=(const Sharded &) = delete;
+  ~Sharded() {
+    for (size_t c = 0; c < CHUNKS; ++c) {
+      delete[] m_chunks[c].load(std::memory_order_relaxed);
+    }
+  }
+
+  // The calling thread's shard. `shared` tells whether other threads use it as well, pass it to `ShardCounter::add`.
+  struct Local {
+    T &data;
+    bool shared;
+  };
+
+  Local local() {
+    size_t index = shard_detail::this_thread_index();
+    std::atomic<Shard *> &chunk = m_chunks[index / CHUNK];
+    Shard *shards = chunk.load(std::memory_order_acquire);
+    if (!shards) [[unlikely]] {
+      std::lock_guard lock{m_alloc_mutex};
+      shards = chunk.load(std::memory_order_relaxed);
+      if (!shards) {
+        shards = new Shard[CHUNK];
+        chunk.store(shards, std::memory_order_release);
+      }
+    }
+    return {shards[index % CHUNK].data, index == SHARD_MAX_THREADS};
+  }
+
+  // Calls `fn(const T &)` for every shard allocated so far
+  template <typename Fn>
+  void for_each(Fn &&fn) const {
+    for (size_t c = 0; c < CHUNKS; ++c) {
+      const Shard *shards = m_chunks[c].load(std::memory_order_acquire);
+      if (shards) {
+        for (size_t i = 0; i < CHUNK; ++i) {
+          fn(shards[i].data);
+        }
+      }
+    }
+  }
+};
+
+// `Sharded` for a flat array of counters whose length is only known at runtime, e.g. from the plugin configuration.
+// Each shard is `size()` counters, padded to whole cache lines.
+class ShardedCounters {
+  static constexpr size_t CHUNK = 64;
+  static constexpr size_t CHUNKS = SHARD_MAX_THREADS / CHUNK + 1;
+  static constexpr size_t LINE = 64 / sizeof(ShardCounter);
+
+  size_t m_size;
+  size_t m_stride; // counters per shard, including padding
+  std::unique_ptr<std::atomic<ShardCounter *>[]> m_chunks{new std::atomic<ShardCounter *>[CHUNKS]{}};
+  std::mutex m_alloc_mutex;
+
+  static void free_chunk(ShardCounter *chunk) {
+    ::operator delete[](chunk, std::align_val_t{64});
+  }
+
+public:
+  explicit ShardedCounters(size_t size) : m_size{size}, m_stride{(size + LINE - 1) / LINE * LINE} {}
+  ShardedCounters(const ShardedCounters &) = delete;
+  ShardedCounters &operator=(const ShardedCounters &) = delete;
+  ~ShardedCounters() {
+    for (size_t c = 0; c < CHUNKS; ++c) {
+      free_chunk(m_chunks[c].load(std::memory_order_relaxed));
+    }
+  }
+
+  size_t size() const { return m_size; }
+
+  struct Local {
+    ShardCounter *counters;
+    bool shared;
+  };
+
+  Local local() {
+    size_t index = shard_detail::this_thread_index();
+    std::atomic<ShardCounter *> &chunk = m_chunks[index / CHUNK];
+    ShardCounter *counters = chunk.load(std::memory_order_acquire);
+    if (!counters) [[unlikely]] {
+      std::lock_guard lock{m_alloc_mutex};
+      counters = chunk.load(std::memory_order_relaxed);
+      if (!counters) {
+        size_t n = CHUNK * m_stride;
+        counters = static_cast<ShardCounter *>(::operator new[](n * sizeof(ShardCounter), std::align_val_t{64}));
+        std::uninitialized_value_construct_n(counters, n);
+        chunk.store(counters, std::memory_order_release);
+      }
+    }
+    return {counters + index % CHUNK * m_stride, index == SHARD_MAX_THREADS};
+  }
+
+  // Adds up all shards allocated so far into `out[size()]`
+  void sum(uint64_t *out) const {
+    for (size_t c = 0; c < CHUNKS; ++c) {
+      const ShardCounter *counters = m_chunks[c].load(std::memory_order_acquire);
+      if (!counters) {
+        continue;
+      }
+      for (size_t s = 0; s < CHUNK; ++s) {
+        const ShardCounter *shard = counters + s * m_stride;
+        for (size_t i = 0; i < m_size; ++i) {
+          out[i] += shard[i].load();
+        }
+      }
+    }
+  }
+};
@@ -0,0 +1,25 @@
+#include "sketch.hh"
+
+static struct IofsPluginV2 plugin_api = {
+  .abi_version = IOFS_PLUGIN_ABI_VERSION,
+  .event_size  = sizeof(struct iofs_event),
+
+  .get_name    = []() -> const char * { return SketchPlugin::NAME; },
+  .get_version = []() -> const char * { return SketchPlugin::VERSION; },
+
+  .init    = iofs_plugin_init<SketchPlugin>,
+  .destroy = [](void *ctx) { delete static_cast<SketchPlugin *>(ctx); },
+
+  .record       = [](void *ctx, auto... args) { static_cast<SketchPlugin *>(ctx)->record(args...); },
+  .record_batch = iofs_plugin_record_batch<SketchPlugin>,
+  .poll_prometheus_metrics = [](void *ctx, auto... args) { return static_cast<SketchPlugin *>(ctx)->poll_metrics(args...); },
+  .subscriptions = [](void *ctx) { return static_cast<SketchPlugin *>(ctx)->subscriptions(); },
+  .command = nullptr,
+  .record_event = nullptr,
+};
+
+extern "C" {
+  struct IofsPluginV2 *get_iofs_plugin_v2(void) {
+    return &plugin_api;
+  }
+}
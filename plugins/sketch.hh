@@ -0,0 +1,307 @@
+#pragma once
+
+#include "plugin.hh"
+#include "plugin_config.hh"
+#include "plugin_helpers.hh"
+#include "histogram.hh"
+#include "ddsketch.hh"
+#include "shard.hh"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Latency quantiles per op and per read/write size class, from DDSketch-style sketches (see `ddsketch.hh`) instead of
+// histograms with fixed buckets, so tails are within 1% relative error wherever they end up.
+//
+// Exports p50/p90/p99/p999 as Prometheus summaries, plus every sketch serialized (`ddsketch::encode`), so sketches
+// of many nodes or scrapes can be merged offline into exact-to-1% quantiles of the whole, which summaries cannot.
+//
+// Configured at load time, e.g. `-p 'sketch.so:ops=read,write;sizes=log2:64K-1M'`:
+// - `ops`: the ops to sketch, comma-separated or `all` (default). Read/write size classes are sketched regardless.
+// - `sizes`: the read/write size classes, see `parse_log_linear_layout`, at most `SKETCH_MAX_SIZE_CLASSES` of them.
+//   Default `log2:4K-1M`, the same as the `iofs_io_bytes` histogram of the stats plugin.
+//
+// Each thread counts into its own window of `SKETCH_WINDOW` buckets per sketch, placed around the first value it saw
+// there, with 32-bit counts (0.5 KiB). Values outside of it, and counts that would overflow, go to one sketch per
+// series shared by all threads (8 KiB, see `ddsketch.hh`) with atomic increments, which only the tails should take.
+// Everything is allocated on its first value, so a sketch takes at most 8 KiB plus 0.5 KiB per thread recording into
+// it, only for the ops and size classes actually seen, no matter the op rate.
+
+constexpr size_t SKETCH_MAX_SIZE_CLASSES = 32;
+// With ~35 buckets per power of two, a window spans a factor of ~12
+constexpr size_t SKETCH_WINDOW = 128;
+
+struct SketchConfig {
+  iofs_op_mask_t ops = IOFS_OPS_ALL;
+  LogLinearLayout size_layout{.min_exp = 12, .max_exp = 20, .sub_bits = 0};
+
+  explicit SketchConfig(const PluginConfig &config = {}) {
+    config.expect_keys({"ops", "sizes"});
+    if (const std::string *v = config.get("ops")) {
+      ops = parse_config_ops(*v);
+    }
+    if (const std::string *v = config.get("sizes")) {
+      size_layout = parse_log_linear_layout(*v, size_layout);
+      if (size_layout.buckets() > SKETCH_MAX_SIZE_CLASSES) {
+        throw std::invalid_argument("more than " + std::to_string(SKETCH_MAX_SIZE_CLASSES) + " size classes");
+      }
+    }
+  }
+};
+
+class SketchPlugin {
+  // The part of one sketch a thread counts itself: the duration sum and the (not cumulative) buckets from `base` on.
+  // Only written by that thread.
+  struct Window {
+    ShardCounter sum;
+    size_t base = 0;
+    std::atomic<uint32_t> buckets[SKETCH_WINDOW]{};
+  };
+
+  // The rest of one sketch, from all threads
+  struct Shared {
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> buckets[ddsketch::SKETCH_BUCKETS]{};
+  };
+
+  // Sketches are numbered: one per op, then per read/write `SKETCH_MAX_SIZE_CLASSES` size classes
+  static constexpr size_t SERIES = IOFS_OP_COUNT + 2 * SKETCH_MAX_SIZE_CLASSES;
+
+  struct Shard {
+    std::atomic<Window *> series[SERIES]{};
+
+    Shard() = default;
+    Shard(const Shard &) = delete;
+    Shard &operator=(const Shard &) = delete;
+    ~Shard() {
+      for (auto &s : series) {
+        delete s.load(std::memory_order_relaxed);
+      }
+    }
+  };
+
+  SketchConfig m_config;
+  Sharded<Shard> m_shards;
+  std::atomic<Shared *> m_shared[SERIES]{};
+
+  static size_t size_series(bool is_write, size_t size_class) {
+    return IOFS_OP_COUNT + static_cast<size_t>(is_write) * SKETCH_MAX_SIZE_CLASSES + size_class;
+  }
+
+  Shared &shared(size_t series) {
+    std::atomic<Shared *> &slot = m_shared[series];
+    Shared *shared = slot.load(std::memory_order_acquire);
+    if (!shared) [[unlikely]] {
+      Shared *fresh = new Shared{};
+      if (!slot.compare_exchange_strong(shared, fresh, std::memory_order_acq_rel)) {
+        delete fresh;
+        return *shared;
+      }
+      return *fresh;
+    }
+    return *shared;
+  }
+
+  // Counts one value. The shared overflow shard has no windows, its threads go to the shared sketch right away.
+  void add(Shard &shard, bool is_shared, size_t series, size_t bucket, uint64_t duration_ns) {
+    if (!is_shared) [[likely]] {
+      std::atomic<Window *> &slot = shard.series[series];
+      Window *window = slot.load(std::memory_order_acquire);
+      if (!window) [[unlikely]] {
+        window = new Window{};
+        // A quarter below the first value, since latencies spread further up than down
+        window->base = std::min(bucket > SKETCH_WINDOW / 4 ? bucket - SKETCH_WINDOW / 4 : 0,
+          ddsketch::SKETCH_BUCKETS - SKETCH_WINDOW);
+        slot.store(window, std::memory_order_release);
+      }
+      window->sum.add(duration_ns, false);
+      // Wraps around for buckets below `base`
+      size_t i = bucket - window->base;
+      if (i < SKETCH_WINDOW) {
+        uint32_t count = window->buckets[i].load(std::memory_order_relaxed);
+        if (count != UINT32_MAX) [[likely]] {
+          window->buckets[i].store(count + 1, std::memory_order_relaxed);
+          return;
+        }
+      }
+      shared(series).buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    Shared &s = shared(series);
+    s.sum.fetch_add(duration_ns, std::memory_order_relaxed);
+    s.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Merges all windows and the shared part of one series into `merged`: the sum, then the buckets
+  void merge(size_t series, std::vector<uint64_t> &merged) const {
+    merged.assign(1 + ddsketch::SKETCH_BUCKETS, 0);
+    m_shards.for_each([&](const Shard &shard) {
+      const Window *window = shard.series[series].load(std::memory_order_acquire);
+      if (!window) {
+        return;
+      }
+      merged[0] += window->sum.load();
+      for (size_t i = 0; i < SKETCH_WINDOW; ++i) {
+        merged[1 + window->base + i] += window->buckets[i].load(std::memory_order_relaxed);
+      }
+    });
+    if (const Shared *shared = m_shared[series].load(std::memory_order_acquire)) {
+      merged[0] += shared->sum.load(std::memory_order_relaxed);
+      for (size_t b = 0; b < ddsketch::SKETCH_BUCKETS; ++b) {
+        merged[1 + b] += shared->buckets[b].load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Quantiles, sum and count of one merged sketch. `labels` is appended after the op label.
+  static void emit_summary(char *buf, size_t buf_size, size_t &offset, const char *name, const char *op,
+      const char *labels, const uint64_t *buckets, uint64_t count, uint64_t sum) {
+    static constexpr std::pair<const char *, double> QUANTILES[] = {
+      {"0.5", 0.5}, {"0.9", 0.9}, {"0.99", 0.99}, {"0.999", 0.999},
+    };
+    for (const auto &[label, q] : QUANTILES) {
+      emit_metric(buf, buf_size, offset,
+        "%s{op=\"%s\"%s,quantile=\"%s\"} %.0f\n",
+        name, op, labels, label, ddsketch::quantile(buckets, count, q));
+    }
+    emit_metric(buf, buf_size, offset,
+      "%s_sum{op=\"%s\"%s} %llu\n", name, op, labels, static_cast<unsigned long long>(sum));
+    emit_metric(buf, buf_size, offset,
+      "%s_count{op=\"%s\"%s} %llu\n", name, op, labels, static_cast<unsigned long long>(count));
+  }
+
+  static uint64_t total(const uint64_t *buckets) {
+    uint64_t count = 0;
+    for (size_t b = 0; b < ddsketch::SKETCH_BUCKETS; ++b) {
+      count += buckets[b];
+    }
+    return count;
+  }
+
+public:
+  static constexpr const char *NAME = "SketchPlugin";
+  static constexpr const char *VERSION = "0.1.0";
+  static constexpr iofs_op_mask_t OPS = IOFS_OPS_ALL;
+
+  explicit SketchPlugin(const PluginConfig &config = {}) : m_config{config} {}
+  SketchPlugin(const SketchPlugin &) = delete;
+  SketchPlugin &operator=(const SketchPlugin &) = delete;
+  ~SketchPlugin() {
+    for (auto &s : m_shared) {
+      delete s.load(std::memory_order_relaxed);
+    }
+  }
+
+  iofs_op_mask_t subscriptions() const {
+    return m_config.ops | IOFS_OP_BIT(IOFS_OP_READ) | IOFS_OP_BIT(IOFS_OP_WRITE) | IOFS_OP_BIT(IOFS_OP_READ_BUF)
+      | IOFS_OP_BIT(IOFS_OP_WRITE_BUF);
+  }
+
+  void record(iofs_op_t op, uint64_t duration_ns, uint64_t units) {
+    if (static_cast<size_t>(op) >= IOFS_OP_COUNT) {
+      return;
+    }
+    auto [shard, is_shared] = m_shards.local();
+    size_t bucket = ddsketch::bucket(duration_ns);
+
+    if (m_config.ops & IOFS_OP_BIT(op)) {
+      add(shard, is_shared, static_cast<size_t>(op), bucket, duration_ns);
+    }
+
+    bool is_read = op == IOFS_OP_READ || op == IOFS_OP_READ_BUF;
+    bool is_write = op == IOFS_OP_WRITE || op == IOFS_OP_WRITE_BUF;
+    if (is_read || is_write) {
+      add(shard, is_shared, size_series(is_write, m_config.size_layout.index(units)), bucket, duration_ns);
+    }
+  }
+
+  size_t poll_metrics(char *buf, size_t buf_size) {
+    size_t offset = 0;
+
+    // Merge everything once up front, both families below need it. Empty sketches are left out entirely.
+    struct Merged {
+      std::string op;
+      std::string size_label; // empty for per-op sketches
+      std::vector<uint64_t> counters;
+      uint64_t count;
+    };
+    std::vector<Merged> ops;
+    std::vector<Merged> sizes;
+    std::vector<uint64_t> merged;
+    for (int i = 0; i < IOFS_OP_COUNT; ++i) {
+      if (!(m_config.ops & IOFS_OP_BIT(i))) {
+        continue;
+      }
+      merge(static_cast<size_t>(i), merged);
+      if (uint64_t count = total(merged.data() + 1)) {
+        ops.push_back({iofs_op_to_string(static_cast<iofs_op_t>(i)), "", merged, count});
+      }
+    }
+    static constexpr const char *RW_NAMES[2] = {"read", "write"};
+    const LogLinearLayout &size_layout = m_config.size_layout;
+    for (int w = 0; w < 2; ++w) {
+      for (size_t b = 0; b < size_layout.buckets(); ++b) {
+        merge(size_series(w != 0, b), merged);
+        uint64_t count = total(merged.data() + 1);
+        if (count == 0) {
+          continue;
+        }
+        char size_label[48];
+        if (b < size_layout.explicit_buckets()) {
+          std::snprintf(size_label, sizeof(size_label), ",size_le=\"%llu\"",
+            static_cast<unsigned long long>(size_layout.upper_bound(b)));
+        } else {
+          std::snprintf(size_label, sizeof(size_label), ",size_le=\"+Inf\"");
+        }
+        sizes.push_back({RW_NAMES[w], size_label, merged, count});
+      }
+    }
+
+    emit_metric(buf, buf_size, offset,
+      "# HELP iofs_op_latency_quantile_ns Latency quantiles of each FUSE op in nanoseconds, within 1%% relative "
+      "error.\n"
+      "# TYPE iofs_op_latency_quantile_ns summary\n");
+    for (const Merged &m : ops) {
+      emit_summary(buf, buf_size, offset, "iofs_op_latency_quantile_ns", m.op.c_str(), "",
+        m.counters.data() + 1, m.count, m.counters[0]);
+    }
+
+    emit_metric(buf, buf_size, offset,
+      "# HELP iofs_io_latency_by_size_quantile_ns Latency quantiles of read/write calls in nanoseconds, by the size "
+      "class of their size, within 1%% relative error.\n"
+      "# TYPE iofs_io_latency_by_size_quantile_ns summary\n");
+    for (const Merged &m : sizes) {
+      emit_summary(buf, buf_size, offset, "iofs_io_latency_by_size_quantile_ns", m.op.c_str(), m.size_label.c_str(),
+        m.counters.data() + 1, m.count, m.counters[0]);
+    }
+
+    emit_metric(buf, buf_size, offset,
+      "# HELP iofs_op_latency_sketch Serialized latency sketch of each FUSE op for offline merging, valued by its "
+      "count.\n"
+      "# TYPE iofs_op_latency_sketch gauge\n");
+    for (const Merged &m : ops) {
+      emit_metric(buf, buf_size, offset,
+        "iofs_op_latency_sketch{op=\"%s\",sketch=\"%s\"} %llu\n",
+        m.op.c_str(), ddsketch::encode(m.counters.data() + 1).c_str(), static_cast<unsigned long long>(m.count));
+    }
+
+    emit_metric(buf, buf_size, offset,
+      "# HELP iofs_io_latency_by_size_sketch Serialized latency sketch of read/write calls by size class for offline "
+      "merging, valued by its count.\n"
+      "# TYPE iofs_io_latency_by_size_sketch gauge\n");
+    for (const Merged &m : sizes) {
+      emit_metric(buf, buf_size, offset,
+        "iofs_io_latency_by_size_sketch{op=\"%s\"%s,sketch=\"%s\"} %llu\n",
+        m.op.c_str(), m.size_label.c_str(), ddsketch::encode(m.counters.data() + 1).c_str(),
+        static_cast<unsigned long long>(m.count));
+    }
+
+    return offset;
+  }
+};
@@ -0,0 +1,256 @@
+#pragma once
+
+#include "plugin.hh"
+#include "plugin_config.hh"
+#include "plugin_helpers.hh"
+#include "histogram.hh"
+#include "shard.hh"
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Counts, durations and latency histograms per op, plus size histograms for read/write.
+//
+// Configured at load time, e.g. `-p 'stats.so:ops=minimal;buckets=log2/4'`:
+// - `ops`: the ops to count, comma-separated (`read,write,getattr`), `all` (default) or `minimal`. Read/write sizes
+//   and the passthrough volume are tracked regardless.
+// - `buckets`: the read/write size histogram, see `parse_log_linear_layout`. Default `log2:4K-1M`, i.e. powers of two
+//   from 4 KiB to 1 MiB. Lookup cost does not depend on the number of buckets.
+// - `latency_buckets`: the latency histograms in ns. Default `log2/2:1K-16G`, i.e. ~1us to ~17s with two buckets per
+//   power of two, so at most 50% relative error. The read/write latency per size bucket uses the same range, but only
+//   one bucket per power of two, as there are that many more of them.
+
+// What `ops=minimal` counts
+static constexpr iofs_op_mask_t STATS_MINIMAL_OPS = IOFS_OP_BIT(IOFS_OP_READ) | IOFS_OP_BIT(IOFS_OP_WRITE)
+  | IOFS_OP_BIT(IOFS_OP_READ_BUF) | IOFS_OP_BIT(IOFS_OP_WRITE_BUF) | IOFS_OP_BIT(IOFS_OP_OPEN)
+  | IOFS_OP_BIT(IOFS_OP_CREATE) | IOFS_OP_BIT(IOFS_OP_RELEASE) | IOFS_OP_BIT(IOFS_OP_GETATTR)
+  | IOFS_OP_BIT(IOFS_OP_READDIR) | IOFS_OP_BIT(IOFS_OP_FGETATTR) | IOFS_OP_BIT(IOFS_OP_PASSTHROUGH_READ)
+  | IOFS_OP_BIT(IOFS_OP_PASSTHROUGH_WRITE);
+
+// Ops we always need for the size histogram and the passthrough volume
+static constexpr iofs_op_mask_t STATS_TRACKED_OPS = IOFS_OP_BIT(IOFS_OP_READ) | IOFS_OP_BIT(IOFS_OP_WRITE)
+  | IOFS_OP_BIT(IOFS_OP_READ_BUF) | IOFS_OP_BIT(IOFS_OP_WRITE_BUF) | IOFS_OP_BIT(IOFS_OP_PASSTHROUGH_READ)
+  | IOFS_OP_BIT(IOFS_OP_PASSTHROUGH_WRITE);
+
+struct StatsConfig {
+  iofs_op_mask_t ops = IOFS_OPS_ALL;
+  LogLinearLayout size_layout{.min_exp = 12, .max_exp = 20, .sub_bits = 0};
+  LogLinearLayout latency_layout{.min_exp = 10, .max_exp = 34, .sub_bits = 1};
+
+  explicit StatsConfig(const PluginConfig &config = {}) {
+    config.expect_keys({"ops", "buckets", "latency_buckets"});
+    if (const std::string *v = config.get("ops")) {
+      ops = *v == "minimal" ? STATS_MINIMAL_OPS : parse_config_ops(*v);
+    }
+    if (const std::string *v = config.get("buckets")) {
+      size_layout = parse_log_linear_layout(*v, size_layout);
+    }
+    if (const std::string *v = config.get("latency_buckets")) {
+      latency_layout = parse_log_linear_layout(*v, latency_layout);
+    }
+  }
+};
+
+class StatsPlugin {
+  // The counters live in one flat array per thread, laid out at construction:
+  // - per counted op: count, duration sum, then its latency buckets (`m_op_stride` in total)
+  // - per read/write: size sum, size buckets, then per size bucket: latency sum and latency buckets (`m_rw_stride`)
+  // - passthrough bytes read/written
+  // Histogram buckets are not cumulative; `poll_metrics` takes care of that.
+  StatsConfig m_config;
+  LogLinearLayout m_joint_layout;
+  int m_op_slot[IOFS_OP_COUNT]; // -1 if not counted
+  size_t m_op_stride;
+  size_t m_rw_offset;
+  size_t m_rw_stride;
+  size_t m_passthrough_offset;
+
+  // All workers record concurrently; with shared counters, they would all bounce the same cache lines
+  ShardedCounters m_shards;
+
+  size_t layout_counters() {
+    size_t slots = 0;
+    for (int i = 0; i < IOFS_OP_COUNT; ++i) {
+      m_op_slot[i] = (m_config.ops & IOFS_OP_BIT(i)) ? static_cast<int>(slots++) : -1;
+    }
+    m_op_stride = 2 + m_config.latency_layout.buckets();
+    m_rw_offset = slots * m_op_stride;
+    m_rw_stride = 1 + m_config.size_layout.buckets() * (2 + m_joint_layout.buckets());
+    m_passthrough_offset = m_rw_offset + 2 * m_rw_stride;
+    return m_passthrough_offset + 2;
+  }
+
+  // Within a read/write block
+  size_t joint_offset(size_t size_bucket) const {
+    return 1 + m_config.size_layout.buckets() + size_bucket * (1 + m_joint_layout.buckets());
+  }
+
+  // Returns {tracked, is_write}. tracked=false means op is not histogrammed.
+  static std::pair<bool, bool> hist_rw(iofs_op_t op) {
+    if (op == IOFS_OP_READ || op == IOFS_OP_READ_BUF) {
+      return {true, false};
+    }
+    if (op == IOFS_OP_WRITE || op == IOFS_OP_WRITE_BUF) {
+      return {true, true};
+    }
+    return {false, false};
+  }
+
+  // Buckets (cumulated here), count and sum of one histogram series. `labels` is appended after the op label.
+  static void emit_histogram(char *buf, size_t buf_size, size_t &offset, const char *name, const char *op,
+      const char *labels, const LogLinearLayout &layout, const uint64_t *buckets, uint64_t sum) {
+    uint64_t cumulative = 0;
+    for (size_t b = 0; b < layout.explicit_buckets(); ++b) {
+      cumulative += buckets[b];
+      emit_metric(buf, buf_size, offset,
+        "%s_bucket{op=\"%s\"%s,le=\"%llu\"} %llu\n",
+        name, op, labels,
+        static_cast<unsigned long long>(layout.upper_bound(b)),
+        static_cast<unsigned long long>(cumulative));
+    }
+    cumulative += buckets[layout.explicit_buckets()];
+    emit_metric(buf, buf_size, offset,
+      "%s_bucket{op=\"%s\"%s,le=\"+Inf\"} %llu\n", name, op, labels, static_cast<unsigned long long>(cumulative));
+    emit_metric(buf, buf_size, offset,
+      "%s_count{op=\"%s\"%s} %llu\n", name, op, labels, static_cast<unsigned long long>(cumulative));
+    emit_metric(buf, buf_size, offset,
+      "%s_sum{op=\"%s\"%s} %llu\n", name, op, labels, static_cast<unsigned long long>(sum));
+  }
+
+public:
+  static constexpr const char *NAME = "StatsPlugin";
+  static constexpr const char *VERSION = "0.3.0";
+  static constexpr iofs_op_mask_t OPS = IOFS_OPS_ALL;
+
+  explicit StatsPlugin(const PluginConfig &config = {})
+    : m_config{config},
+      m_joint_layout{m_config.latency_layout.min_exp, m_config.latency_layout.max_exp, 0},
+      m_shards{layout_counters()} {}
+
+  iofs_op_mask_t subscriptions() const {
+    return m_config.ops | STATS_TRACKED_OPS;
+  }
+
+  void record(iofs_op_t op, uint64_t duration_ns, uint64_t units) {
+    if (static_cast<size_t>(op) >= IOFS_OP_COUNT) {
+      return;
+    }
+    auto [c, shared] = m_shards.local();
+
+    // Is it one we count
+    if (int slot = m_op_slot[op]; slot >= 0) {
+      ShardCounter *o = c + static_cast<size_t>(slot) * m_op_stride;
+      o[0].add(1, shared);
+      o[1].add(duration_ns, shared);
+      o[2 + m_config.latency_layout.index(duration_ns)].add(1, shared);
+    }
+
+    if (op == IOFS_OP_PASSTHROUGH_READ || op == IOFS_OP_PASSTHROUGH_WRITE) {
+      c[m_passthrough_offset + (op == IOFS_OP_PASSTHROUGH_WRITE)].add(units, shared);
+    }
+
+    // If read/write we always track
+    auto [tracked, is_write] = hist_rw(op);
+    if (tracked) {
+      ShardCounter *rw = c + m_rw_offset + is_write * m_rw_stride;
+      size_t bucket = m_config.size_layout.index(units);
+      rw[0].add(units, shared);
+      rw[1 + bucket].add(1, shared);
+      ShardCounter *joint = rw + joint_offset(bucket);
+      joint[0].add(duration_ns, shared);
+      joint[1 + m_joint_layout.index(duration_ns)].add(1, shared);
+    }
+  }
+
+  size_t poll_metrics(char *buf, size_t buf_size) {
+    size_t offset = 0;
+    std::vector<uint64_t> t(m_shards.size());
+    m_shards.sum(t.data());
+    auto op_counters = [&](int op) { return t.data() + static_cast<size_t>(m_op_slot[op]) * m_op_stride; };
+
+    emit_metric(buf, buf_size, offset,
+      "# HELP iofs_ops_total Cumulative number of times each FUSE op was called.\n"
+      "# TYPE iofs_ops_total counter\n");
+    for (int i = 0; i < IOFS_OP_COUNT; ++i) {
+      if (m_op_slot[i] < 0) {
+        continue;
+      }
+      emit_metric(buf, buf_size, offset,
+        "iofs_ops_total{op=\"%s\"} %llu\n",
+        iofs_op_to_string(static_cast<iofs_op_t>(i)),
+        static_cast<unsigned long long>(op_counters(i)[0]));
+    }
+
+    emit_metric(buf, buf_size, offset,
+      "# HELP iofs_duration_ns_total Cumulative nanoseconds spent in each FUSE op.\n"
+      "# TYPE iofs_duration_ns_total counter\n");
+    for (int i = 0; i < IOFS_OP_COUNT; ++i) {
+      if (m_op_slot[i] < 0) {
+        continue;
+      }
+      emit_metric(buf, buf_size, offset,
+        "iofs_duration_ns_total{op=\"%s\"} %llu\n",
+        iofs_op_to_string(static_cast<iofs_op_t>(i)),
+        static_cast<unsigned long long>(op_counters(i)[1]));
+    }
+
+    static constexpr const char *RW_NAMES[2] = {"read", "write"};
+    const LogLinearLayout &size_layout = m_config.size_layout;
+    emit_metric(buf, buf_size, offset,
+      "# HELP iofs_io_bytes Histogram of bytes transferred per read/write call.\n"
+      "# TYPE iofs_io_bytes histogram\n");
+    for (int w = 0; w < 2; ++w) {
+      const uint64_t *rw = t.data() + m_rw_offset + static_cast<size_t>(w) * m_rw_stride;
+      emit_histogram(buf, buf_size, offset, "iofs_io_bytes", RW_NAMES[w], "", size_layout, rw + 1, rw[0]);
+    }
+
+    emit_metric(buf, buf_size, offset,
+      "# HELP iofs_op_latency_ns Latency of each FUSE op in nanoseconds.\n"
+      "# TYPE iofs_op_latency_ns histogram\n");
+    for (int i = 0; i < IOFS_OP_COUNT; ++i) {
+      // Ops never called would only add noise
+      if (m_op_slot[i] < 0 || op_counters(i)[0] == 0) {
+        continue;
+      }
+      emit_histogram(buf, buf_size, offset, "iofs_op_latency_ns", iofs_op_to_string(static_cast<iofs_op_t>(i)), "",
+        m_config.latency_layout, op_counters(i) + 2, op_counters(i)[1]);
+    }
+
+    emit_metric(buf, buf_size, offset,
+      "# HELP iofs_io_latency_by_size_ns Latency of read/write calls in nanoseconds, by the iofs_io_bytes bucket of "
+      "their size.\n"
+      "# TYPE iofs_io_latency_by_size_ns histogram\n");
+    for (int w = 0; w < 2; ++w) {
+      const uint64_t *rw = t.data() + m_rw_offset + static_cast<size_t>(w) * m_rw_stride;
+      for (size_t b = 0; b < size_layout.buckets(); ++b) {
+        if (rw[1 + b] == 0) {
+          continue;
+        }
+        char size_label[48];
+        if (b < size_layout.explicit_buckets()) {
+          std::snprintf(size_label, sizeof(size_label), ",size_le=\"%llu\"",
+            static_cast<unsigned long long>(size_layout.upper_bound(b)));
+        } else {
+          std::snprintf(size_label, sizeof(size_label), ",size_le=\"+Inf\"");
+        }
+        const uint64_t *joint = rw + joint_offset(b);
+        emit_histogram(buf, buf_size, offset, "iofs_io_latency_by_size_ns", RW_NAMES[w], size_label,
+          m_joint_layout, joint + 1, joint[0]);
+      }
+    }
+
+    emit_metric(buf, buf_size, offset,
+      "# HELP iofs_passthrough_bytes_total Estimated bytes moved by the kernel on passed-through files.\n"
+      "# TYPE iofs_passthrough_bytes_total counter\n");
+    for (int w = 0; w < 2; ++w) {
+      emit_metric(buf, buf_size, offset,
+        "iofs_passthrough_bytes_total{op=\"%s\"} %llu\n",
+        RW_NAMES[w],
+        static_cast<unsigned long long>(t[m_passthrough_offset + static_cast<size_t>(w)]));
+    }
+
+    return offset;
+  }
+};
@@ -0,0 +1,60 @@
+#include "capabilities.hh"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+// 1 MiB requests, i.e. the kernel's `FUSE_MAX_MAX_PAGES` (256) pages. libfuse derives `max_pages` from `max_write`.
+constexpr uint32_t LARGE_IO_BYTES = 1024 * 1024;
+
+CapabilityProfile parse_capability_profile(std::string_view name) {
+  for (const auto &[profile, profile_name] : CAPABILITY_PROFILE_NAMES) {
+    if (profile_name == name) {
+      return profile;
+    }
+  }
+  throw std::invalid_argument("Unknown capability profile " + std::string{name});
+}
+
+std::string_view to_string(CapabilityProfile profile) {
+  for (const auto &[p, name] : CAPABILITY_PROFILE_NAMES) {
+    if (p == profile) {
+      return name;
+    }
+  }
+  return "unknown";
+}
+
+static void want(fuse_conn_info *conn, uint32_t caps) { conn->want |= caps & conn->capable; }
+static void unwant(fuse_conn_info *conn, uint32_t caps) { conn->want &= ~caps; }
+
+bool negotiate_capabilities(CapabilityProfile profile, fuse_conn_info *conn) {
+  switch (profile) {
+    case CapabilityProfile::standard:
+      break;
+    case CapabilityProfile::throughput:
+      want(conn, FUSE_CAP_ASYNC_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE | FUSE_CAP_SPLICE_READ |
+                     FUSE_CAP_ASYNC_DIO | FUSE_CAP_WRITEBACK_CACHE | FUSE_CAP_AUTO_INVAL_DATA);
+      conn->max_write = LARGE_IO_BYTES;
+      // `max_readahead` starts out as what the kernel offers, which is also the upper bound
+      conn->max_readahead = std::min(conn->max_readahead, LARGE_IO_BYTES);
+      conn->max_background = 64;
+      conn->congestion_threshold = 48;
+      break;
+    case CapabilityProfile::metadata:
+      want(conn, FUSE_CAP_ASYNC_READ | FUSE_CAP_PARALLEL_DIROPS | FUSE_CAP_READDIRPLUS | FUSE_CAP_CACHE_SYMLINKS |
+                     FUSE_CAP_AUTO_INVAL_DATA);
+      // Always send readdirplus, the entries are almost always stat'ed afterwards anyway
+      unwant(conn, FUSE_CAP_READDIRPLUS_AUTO);
+      conn->max_background = 128;
+      conn->congestion_threshold = 96;
+      break;
+    case CapabilityProfile::strict:
+      unwant(conn, FUSE_CAP_ASYNC_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE | FUSE_CAP_SPLICE_READ |
+                       FUSE_CAP_ASYNC_DIO | FUSE_CAP_WRITEBACK_CACHE | FUSE_CAP_PARALLEL_DIROPS |
+                       FUSE_CAP_READDIRPLUS_AUTO | FUSE_CAP_CACHE_SYMLINKS);
+      conn->max_readahead = 0;
+      break;
+  }
+  return (conn->want & FUSE_CAP_WRITEBACK_CACHE) != 0;
+}
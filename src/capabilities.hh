@@ -0,0 +1,74 @@
+#pragma once
+
+#include <fcntl.h>
+
+#define FUSE_USE_VERSION 36
+#include <fuse_common.h>
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+
+// Named sets of kernel capabilities and limits requested in `init`. Shared by both backends.
+//
+// - `standard` keeps whatever libfuse and the kernel default to, i.e. the behaviour before profiles existed.
+// - `throughput` is meant for large sequential I/O: 1 MiB requests, 1 MiB readahead, splice, async direct I/O and
+//   the writeback cache, which also lets the kernel merge small writes.
+// - `metadata` is meant for many small files: parallel lookups/readdirs in one directory, readdirplus and cached
+//   symlinks, plus a deeper background queue.
+// - `strict` turns off everything that makes the kernel issue requests on its own (readahead, async reads, writeback),
+//   so each application syscall maps to the measured ops as directly as possible. Slow, but easy to interpret.
+//
+// Only capabilities the kernel offers are requested, so every profile works on every kernel.
+enum class CapabilityProfile { standard, throughput, metadata, strict };
+
+constexpr std::array CAPABILITY_PROFILE_NAMES{
+    std::pair{CapabilityProfile::standard, std::string_view{"standard"}},
+    std::pair{CapabilityProfile::throughput, std::string_view{"throughput"}},
+    std::pair{CapabilityProfile::metadata, std::string_view{"metadata"}},
+    std::pair{CapabilityProfile::strict, std::string_view{"strict"}},
+};
+
+// Throws `std::invalid_argument` on unknown names
+CapabilityProfile parse_capability_profile(std::string_view name);
+std::string_view to_string(CapabilityProfile profile);
+
+// Capabilities exported as metrics, with the label used for them
+constexpr std::array CAPABILITY_NAMES{
+    std::pair{uint32_t{FUSE_CAP_ASYNC_READ}, std::string_view{"async_read"}},
+    std::pair{uint32_t{FUSE_CAP_POSIX_LOCKS}, std::string_view{"posix_locks"}},
+    std::pair{uint32_t{FUSE_CAP_ATOMIC_O_TRUNC}, std::string_view{"atomic_o_trunc"}},
+    std::pair{uint32_t{FUSE_CAP_EXPORT_SUPPORT}, std::string_view{"export_support"}},
+    std::pair{uint32_t{FUSE_CAP_DONT_MASK}, std::string_view{"dont_mask"}},
+    std::pair{uint32_t{FUSE_CAP_SPLICE_WRITE}, std::string_view{"splice_write"}},
+    std::pair{uint32_t{FUSE_CAP_SPLICE_MOVE}, std::string_view{"splice_move"}},
+    std::pair{uint32_t{FUSE_CAP_SPLICE_READ}, std::string_view{"splice_read"}},
+    std::pair{uint32_t{FUSE_CAP_FLOCK_LOCKS}, std::string_view{"flock_locks"}},
+    std::pair{uint32_t{FUSE_CAP_AUTO_INVAL_DATA}, std::string_view{"auto_inval_data"}},
+    std::pair{uint32_t{FUSE_CAP_READDIRPLUS}, std::string_view{"readdirplus"}},
+    std::pair{uint32_t{FUSE_CAP_READDIRPLUS_AUTO}, std::string_view{"readdirplus_auto"}},
+    std::pair{uint32_t{FUSE_CAP_ASYNC_DIO}, std::string_view{"async_dio"}},
+    std::pair{uint32_t{FUSE_CAP_WRITEBACK_CACHE}, std::string_view{"writeback_cache"}},
+    std::pair{uint32_t{FUSE_CAP_PARALLEL_DIROPS}, std::string_view{"parallel_dirops"}},
+    std::pair{uint32_t{FUSE_CAP_POSIX_ACL}, std::string_view{"posix_acl"}},
+    std::pair{uint32_t{FUSE_CAP_HANDLE_KILLPRIV}, std::string_view{"handle_killpriv"}},
+    std::pair{uint32_t{FUSE_CAP_CACHE_SYMLINKS}, std::string_view{"cache_symlinks"}},
+    std::pair{uint32_t{FUSE_CAP_EXPLICIT_INVAL_DATA}, std::string_view{"explicit_inval_data"}},
+#ifdef FUSE_CAP_PASSTHROUGH
+    std::pair{uint32_t{FUSE_CAP_PASSTHROUGH}, std::string_view{"passthrough"}},
+#endif
+};
+
+// Applies `profile` to `conn`. Returns whether the writeback cache ended up enabled, since `open`/`create` have to
+// adjust their flags for it.
+bool negotiate_capabilities(CapabilityProfile profile, fuse_conn_info *conn);
+
+// With the writeback cache, the kernel may read from files opened write-only (to fill partial pages) and handles
+// `O_APPEND` itself, sending explicit offsets.
+inline int writeback_open_flags(int flags) {
+  if ((flags & O_ACCMODE) == O_WRONLY) {
+    flags = (flags & ~O_ACCMODE) | O_RDWR;
+  }
+  return flags & ~O_APPEND;
+}
@@ -0,0 +1,151 @@
+#include "dispatcher.hh"
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+
+// Events handed to the plugins at once
+constexpr size_t DISPATCH_BATCH = 256;
+// How long the consumer sleeps when all rings were empty
+constexpr auto DISPATCH_IDLE_SLEEP = std::chrono::microseconds{500};
+
+// Returns the ring to the pool when its worker exits
+struct AsyncDispatcher::Lease {
+  AsyncDispatcher *owner{nullptr};
+  Ring *ring{nullptr};
+  ~Lease() {
+    if (ring) {
+      owner->release(*ring);
+    }
+  }
+};
+
+AsyncDispatcher::AsyncDispatcher(const DispatchOptions &options, Sink sink)
+    : m_options{options}, m_sink{std::move(sink)} {
+  // Report what `SpscRing` actually allocates
+  m_options.ring_size = std::bit_ceil(std::max<size_t>(m_options.ring_size, 2));
+  m_consumer = std::thread{[this] { run(); }};
+}
+
+AsyncDispatcher::~AsyncDispatcher() { stop(); }
+
+void AsyncDispatcher::stop() {
+  if (m_consumer.joinable()) {
+    m_stop.store(true, std::memory_order_release);
+    m_consumer.join();
+  }
+}
+
+AsyncDispatcher::Ring &AsyncDispatcher::current() {
+  thread_local Lease lease;
+  if (lease.owner != this) {
+    std::lock_guard lock{m_mutex};
+    Ring *ring{nullptr};
+    for (auto &r : m_rings) {
+      if (!r.in_use) {
+        ring = &r;
+        break;
+      }
+    }
+    if (!ring) {
+      ring = &m_rings.emplace_back(m_options.ring_size);
+      m_ring_count.store(m_rings.size(), std::memory_order_release);
+    }
+    ring->in_use = true;
+    lease.owner = this;
+    lease.ring = ring;
+  }
+  return *lease.ring;
+}
+
+void AsyncDispatcher::release(Ring &ring) {
+  std::lock_guard lock{m_mutex};
+  ring.in_use = false;
+}
+
+void AsyncDispatcher::push(const IoEvent &event) {
+  if (m_stop.load(std::memory_order_relaxed)) [[unlikely]] {
+    m_sink(std::span{&event, 1});
+    return;
+  }
+  Ring &ring{current()};
+  if (ring.events.try_push(event)) {
+    return;
+  }
+  switch (m_options.on_full) {
+    case RingFullPolicy::drop:
+      ring.dropped.fetch_add(1, std::memory_order_relaxed);
+      break;
+    case RingFullPolicy::block:
+      while (!ring.events.try_push(event)) {
+        std::this_thread::yield();
+      }
+      break;
+    case RingFullPolicy::inline_:
+      m_inlined.fetch_add(1, std::memory_order_relaxed);
+      m_sink(std::span{&event, 1});
+      break;
+  }
+}
+
+size_t AsyncDispatcher::drain_once(std::vector<Ring *> &rings, std::vector<IoEvent> &batch) {
+  // Pick up rings of new workers
+  if (rings.size() != m_ring_count.load(std::memory_order_acquire)) {
+    std::lock_guard lock{m_mutex};
+    rings.clear();
+    for (auto &r : m_rings) {
+      rings.push_back(&r);
+    }
+  }
+
+  size_t delivered{0};
+  for (Ring *ring : rings) {
+    size_t n{ring->events.pop(batch.data(), batch.size())};
+    if (n > 0) {
+      m_sink(std::span{batch.data(), n});
+      delivered += n;
+    }
+  }
+  m_delivered.fetch_add(delivered, std::memory_order_relaxed);
+  return delivered;
+}
+
+void AsyncDispatcher::run() {
+  std::vector<Ring *> rings;
+  std::vector<IoEvent> batch(DISPATCH_BATCH);
+  while (!m_stop.load(std::memory_order_acquire)) {
+    if (drain_once(rings, batch) == 0) {
+      std::this_thread::sleep_for(DISPATCH_IDLE_SLEEP);
+    }
+  }
+  // Whatever is left after the session ended
+  while (drain_once(rings, batch) > 0) {
+  }
+}
+
+void AsyncDispatcher::write_prometheus(std::ostream &os) const {
+  uint64_t dropped{0};
+  size_t rings{0};
+  {
+    std::lock_guard lock{m_mutex};
+    rings = m_rings.size();
+    for (const auto &r : m_rings) {
+      dropped += r.dropped.load(std::memory_order_relaxed);
+    }
+  }
+  os << "# HELP iofs_dispatch_ring_size Events each worker ring can hold.\n";
+  os << "# TYPE iofs_dispatch_ring_size gauge\n";
+  os << "iofs_dispatch_ring_size " << m_options.ring_size << '\n';
+  os << "# HELP iofs_dispatch_rings Worker rings allocated so far.\n";
+  os << "# TYPE iofs_dispatch_rings gauge\n";
+  os << "iofs_dispatch_rings " << rings << '\n';
+  os << "# HELP iofs_dispatch_events_total Events delivered to the plugins by the consumer thread.\n";
+  os << "# TYPE iofs_dispatch_events_total counter\n";
+  os << "iofs_dispatch_events_total " << m_delivered.load(std::memory_order_relaxed) << '\n';
+  os << "# HELP iofs_dispatch_dropped_total Events discarded because a worker ring was full.\n";
+  os << "# TYPE iofs_dispatch_dropped_total counter\n";
+  os << "iofs_dispatch_dropped_total " << dropped << '\n';
+  os << "# HELP iofs_dispatch_inlined_total Events delivered on the worker because its ring was full.\n";
+  os << "# TYPE iofs_dispatch_inlined_total counter\n";
+  os << "iofs_dispatch_inlined_total " << m_inlined.load(std::memory_order_relaxed) << '\n';
+}
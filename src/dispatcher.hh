@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include "../plugins/plugin.hh"
+#include "event_ring.hh"
+
+// One `TimerGuard` measurement, in the layout `record_batch` hands to the plugins
+using IoEvent = iofs_event;
+
+// What a worker does when its ring is full
+enum class RingFullPolicy {
+  drop,    // Discard the event and count it
+  block,   // Wait for the consumer; no loss, but a slow plugin stalls the I/O again
+  inline_, // Hand the event to the plugins directly, as in synchronous mode
+};
+
+struct DispatchOptions {
+  bool async{false};
+  size_t ring_size{4096};  // Events per worker, rounded up to a power of two
+  RingFullPolicy on_full{RingFullPolicy::drop};
+};
+
+// Asynchronous delivery of events to the plugins, enabled via `--dispatch async`.
+//
+// Every worker pushes into its own SPSC ring, so recording an event is a few stores and never calls into a plugin.
+// A single consumer thread drains all rings in batches and hands each batch to the plugins. Like `Workers`, rings are
+// acquired lazily on the first event of a thread and recycled when it exits; a recycled ring keeps the events its
+// previous owner left in it. Rings are only released back to their dispatcher, so it has to outlive the workers.
+class AsyncDispatcher {
+ public:
+  using Sink = std::function<void(std::span<const IoEvent>)>;
+
+  AsyncDispatcher(const DispatchOptions &options, Sink sink);
+  ~AsyncDispatcher();
+  AsyncDispatcher(const AsyncDispatcher &) = delete;
+  AsyncDispatcher &operator=(const AsyncDispatcher &) = delete;
+
+  void push(const IoEvent &event);
+  // Stops the consumer after draining all rings. Events pushed afterwards are delivered inline.
+  void stop();
+  void write_prometheus(std::ostream &os) const;
+
+ private:
+  struct alignas(64) Ring {
+    explicit Ring(size_t size) : events{size} {}
+    SpscRing<IoEvent> events;
+    std::atomic<uint64_t> dropped{0};
+    bool in_use{false};  // guarded by `m_mutex`
+  };
+  struct Lease;
+
+  Ring &current();
+  void release(Ring &ring);
+  // Returns the number of events delivered
+  size_t drain_once(std::vector<Ring *> &rings, std::vector<IoEvent> &batch);
+  void run();
+
+  DispatchOptions m_options;
+  Sink m_sink;
+
+  mutable std::mutex m_mutex;
+  std::deque<Ring> m_rings;  // guarded by `m_mutex`; a deque, so rings never move
+  std::atomic<size_t> m_ring_count{0};
+
+  std::atomic<uint64_t> m_delivered{0};
+  std::atomic<uint64_t> m_inlined{0};
+  std::atomic<bool> m_stop{false};
+  std::thread m_consumer;
+};
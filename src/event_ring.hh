@@ -0,0 +1,55 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <memory>
+
+// Bounded single-producer/single-consumer queue. The capacity is rounded up to a power of two.
+//
+// Producer and consumer indices live on separate cache lines, and the producer keeps a cached copy of the consumer
+// index, so a push only touches shared state when the ring looks full.
+template <typename T>
+class SpscRing {
+ public:
+  explicit SpscRing(size_t capacity)
+      : m_mask{std::bit_ceil(std::max<size_t>(capacity, 2)) - 1}, m_slots{std::make_unique<T[]>(m_mask + 1)} {}
+  SpscRing(const SpscRing &) = delete;
+  SpscRing &operator=(const SpscRing &) = delete;
+
+  size_t capacity() const { return m_mask + 1; }
+
+  // Producer side. Returns false if the ring is full.
+  bool try_push(const T &value) {
+    size_t head{m_head.load(std::memory_order_relaxed)};
+    if (head - m_cached_tail > m_mask) {
+      m_cached_tail = m_tail.load(std::memory_order_acquire);
+      if (head - m_cached_tail > m_mask) {
+        return false;
+      }
+    }
+    m_slots[head & m_mask] = value;
+    m_head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. Moves up to `max` elements into `out` and returns how many.
+  size_t pop(T *out, size_t max) {
+    size_t tail{m_tail.load(std::memory_order_relaxed)};
+    size_t n{std::min(m_head.load(std::memory_order_acquire) - tail, max)};
+    for (size_t i{0}; i < n; ++i) {
+      out[i] = m_slots[(tail + i) & m_mask];
+    }
+    m_tail.store(tail + n, std::memory_order_release);
+    return n;
+  }
+
+ private:
+  const size_t m_mask;
+  std::unique_ptr<T[]> m_slots;
+
+  alignas(64) std::atomic<size_t> m_head{0};
+  size_t m_cached_tail{0};  // Producer's last view of `m_tail`
+  alignas(64) std::atomic<size_t> m_tail{0};
+};
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <dirent.h>
+
+#define FUSE_USE_VERSION 36
+#include <fuse_common.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// The process an op is done for
+struct Caller {
+  uint32_t uid{0};
+  uint32_t gid{0};
+  uint32_t pid{0};
+};
+
+// Per-open state stored in `fi->fh` between `open`/`create` and `release`. Shared by both backends and allocated from
+// an `ObjectPool`.
+//
+// Several workers may use the same handle concurrently (e.g. parallel `pread`s on one fd), so everything that is
+// updated after `open` is a relaxed atomic; the values are statistics, not synchronization.
+struct FileHandle {
+  using clock_type = std::chrono::steady_clock;
+
+  int fd{-1};
+  uint64_t id{next_id()};  // Unique per open, unlike the pooled handle's address; `iofs_event::file_id`
+  clock_type::time_point opened_at{clock_type::now()};
+  // `release` carries no credentials, so ops at close (and passthrough summaries) are booked to whoever opened the file
+  Caller opener;
+
+  std::atomic<off_t> last_offset{0};  // End of the most recent read/write
+  std::atomic<uint64_t> bytes_read{0};
+  std::atomic<uint64_t> bytes_written{0};
+  std::atomic<uint64_t> reads{0};
+  std::atomic<uint64_t> writes{0};
+
+  // Size of the underlying file, -1 if unknown. Only used by `ZeroCopyReport::accurate`, which refreshes it via
+  // `fstat` when a read reaches past it. Our own writes, truncates and fallocates keep it current; changes through
+  // other fds are only noticed on that refresh, so a file shrunk elsewhere is over-reported until then.
+  std::atomic<off_t> cached_size{-1};
+
+  // Only set for files handed to the kernel for passthrough, see `Passthrough`
+  int backing_id{0};
+  off_t size_at_open{0};
+  bool writable{false};
+
+  FileHandle(int fd_, Caller opener_) : fd{fd_}, opener{opener_} {}
+
+  void account_read(off_t offset, size_t bytes) {
+    last_offset.store(offset + static_cast<off_t>(bytes), std::memory_order_relaxed);
+    bytes_read.fetch_add(bytes, std::memory_order_relaxed);
+    reads.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void account_write(off_t offset, size_t bytes) {
+    last_offset.store(offset + static_cast<off_t>(bytes), std::memory_order_relaxed);
+    bytes_written.fetch_add(bytes, std::memory_order_relaxed);
+    writes.fetch_add(1, std::memory_order_relaxed);
+    grow_size(offset + static_cast<off_t>(bytes));
+  }
+
+  // Raises a known `cached_size` to at least `end`; an unknown size stays unknown
+  void grow_size(off_t end) {
+    off_t cur{cached_size.load(std::memory_order_relaxed)};
+    while (cur >= 0 && cur < end && !cached_size.compare_exchange_weak(cur, end, std::memory_order_relaxed)) {
+    }
+  }
+
+  void set_size(off_t size) { cached_size.store(size, std::memory_order_relaxed); }
+
+ private:
+  static uint64_t next_id() {
+    static std::atomic<uint64_t> s_next{1};
+    return s_next.fetch_add(1, std::memory_order_relaxed);
+  }
+};
+
+inline FileHandle *get_file_handle(fuse_file_info *fi) { return reinterpret_cast<FileHandle *>(fi->fh); }
+inline int get_fd(fuse_file_info *fi) { return get_file_handle(fi)->fd; }
+
+// Directory stream stored in `fi->fh` between `opendir` and `releasedir`. Shared by both backends.
+struct DirHandle {
+  DIR *dp{nullptr};
+  struct dirent *entry{nullptr};
+  off_t offset{0};
+  ~DirHandle() {
+    if (dp) {
+      closedir(dp);
+    }
+  }
+};
+
+inline DirHandle *get_dir_handle(fuse_file_info *fi) { return reinterpret_cast<DirHandle *>(fi->fh); }
@@ -0,0 +1,59 @@
+#include "invalidator.hh"
+
+#include <algorithm>
+
+Invalidator::~Invalidator() { stop(); }
+
+void Invalidator::start(Sink sink) {
+  m_sink = std::move(sink);
+  m_thread = std::thread{[this] { run(); }};
+  m_enabled.store(true, std::memory_order_release);
+}
+
+void Invalidator::stop() {
+  if (!m_thread.joinable()) {
+    return;
+  }
+  m_enabled.store(false, std::memory_order_release);
+  {
+    std::lock_guard lock{m_mutex};
+    m_stop = true;
+  }
+  m_cv.notify_one();
+  m_thread.join();
+}
+
+void Invalidator::push(uint64_t ino, std::string_view name) {
+  if (!m_enabled.load(std::memory_order_acquire)) {
+    return;
+  }
+  {
+    std::lock_guard lock{m_mutex};
+    m_queue.push_back(Target{ino, std::string{name}});
+  }
+  m_cv.notify_one();
+}
+
+void Invalidator::run() {
+  std::vector<Target> batch;
+  std::unique_lock lock{m_mutex};
+  while (true) {
+    m_cv.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+    if (m_stop) {
+      return;
+    }
+    batch.swap(m_queue);
+    lock.unlock();
+
+    // Bursts (e.g. `rm -r`) hit the same directories over and over
+    std::ranges::sort(batch);
+    auto dups{std::ranges::unique(batch)};
+    batch.erase(dups.begin(), dups.end());
+    for (const auto &target : batch) {
+      m_sink(target);
+    }
+    batch.clear();
+
+    lock.lock();
+  }
+}
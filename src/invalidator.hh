@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Deferred kernel cache invalidation, which makes long attribute/entry timeouts safe to use. Shared by both backends.
+//
+// The notifications must not be sent from within the op that caused them, as the kernel may still hold locks on the
+// affected inodes until we replied. Thus, ops only queue their targets and a background thread sends them in batches.
+class Invalidator {
+ public:
+  // Low-level: an inode if `name` is empty, else the entry `name` in directory `ino`.
+  // High-level: `name` is a path and `ino` is unused.
+  struct Target {
+    uint64_t ino{0};
+    std::string name;
+    auto operator<=>(const Target &) const = default;
+  };
+  using Sink = std::function<void(const Target &)>;
+
+  Invalidator() = default;
+  ~Invalidator();
+  Invalidator(const Invalidator &) = delete;
+  Invalidator &operator=(const Invalidator &) = delete;
+
+  // Until `start` is called, `push` is a no-op
+  void start(Sink sink);
+  void stop();
+  void push(uint64_t ino, std::string_view name = {});
+
+ private:
+  void run();
+
+  Sink m_sink;
+  std::atomic<bool> m_enabled{false};
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::vector<Target> m_queue;  // guarded by `m_mutex`
+  bool m_stop{false};           // guarded by `m_mutex`
+  std::thread m_thread;
+};
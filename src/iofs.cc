@@ -1,15 +1,19 @@
 #include "iofs.hh"
+#include "handles.hh"
 #include "monitoring.hh"
+#include "workers.hh"
 
 #include <fcntl.h>
 #include <sys/statvfs.h>
 
 #include <chrono>
+#include <climits>
 #include <cstdio>
 #include <cstdlib>
 #define FUSE_USE_VERSION 36
 #include <dirent.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -18,28 +22,73 @@
 
 #include <filesystem>
 #include <print>
+#include <system_error>
 
 TimerGuard::~TimerGuard() {
+  if (!m_timed) {
+    // Nobody wants the duration, but a pinned worker still has to register
+    if (m_worker) {
+      Workers::instance().account(0);
+    }
+    return;
+  }
   auto end{clock_type::now()};
+  auto dur_ns{static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - m_start).count())};
   if (m_size > 0) {
-    auto dur_ns{std::chrono::duration_cast<std::chrono::nanoseconds>(end - m_start).count()};
-    Monitoring::instance().record(m_operation, static_cast<uint64_t>(dur_ns), m_size);
+    Monitoring::instance().record({
+        .op = static_cast<iofs_op_t>(m_operation),
+        .duration_ns = dur_ns,
+        .units = m_size,
+        .offset = m_offset,
+        .file_id = m_file_id,
+        .uid = m_caller.uid,
+        .gid = m_caller.gid,
+        .pid = m_caller.pid,
+    });
+  }
+  if (m_worker) {
+    Workers::instance().account(dur_ns);
   }
 }
 
 void TimerGuard::update_size(size_t s) { m_size = s; }
 
-int IOFS::getattr(const char *path, struct stat *stbuf, [[maybe_unused]] fuse_file_info *fi) {
+IOFS::IOFS(const std::filesystem::path &root, const MountOptions &options)
+    : m_root_fd{::open(root.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC)},
+      m_options{options},
+      m_passthrough{options.passthrough} {
+  if (m_root_fd == -1) {
+    throw std::system_error(errno, std::generic_category(), "Failed to open source directory " + root.string());
+  }
+}
+
+IOFS::~IOFS() { ::close(m_root_fd); }
+
+// The xattr syscalls have no `*at()` variant, so we go through the magic link of the root fd.
+// Stack-allocated to keep the hot path allocation-free.
+struct XattrPath {
+  char buf[PATH_MAX];
+  int len;
+  XattrPath(int root_fd, const char *rel_path)
+      : len{std::snprintf(buf, sizeof(buf), "/proc/self/fd/%i/%s", root_fd, rel_path)} {}
+  bool ok() const { return len >= 0 && static_cast<size_t>(len) < sizeof(buf); }
+  const char *c_str() const { return buf; }
+};
+
+int IOFS::getattr(const char *path, struct stat *stbuf, fuse_file_info *fi) {
+  if (fi) {
+    TimerGuard timer{IOOp::fgetattr};
+    int res{::fstat(get_fd(fi), stbuf)};
+    return (res == -1) ? -errno : 0;
+  }
   TimerGuard timer{IOOp::getattr};
-  auto full_path{resolve_path(path)};
-  int res{lstat(full_path.c_str(), stbuf)};
+  int res{::fstatat(m_root_fd, relative(path), stbuf, AT_SYMLINK_NOFOLLOW)};
   return (res == -1) ? -errno : 0;
 }
 
 int IOFS::readlink(const char *path, char *buf, size_t size) {
   TimerGuard timer{IOOp::readlink};
-  auto full_path{resolve_path(path)};
-  ssize_t res{::readlink(full_path.c_str(), buf, size - 1)};
+  ssize_t res{::readlinkat(m_root_fd, relative(path), buf, size - 1)};
   if (res == -1) {
     return -errno;
   }
@@ -47,106 +96,176 @@ int IOFS::readlink(const char *path, char *buf, size_t size) {
   return 0;
 }
 
+// Namespace ops invalidate the directories they touched. Attribute ops (chmod, truncate, ...) do not need to, as the
+// kernel takes the new attributes from their reply. Hard links are separate nodes in the high-level API though, so
+// the other names of a file modified through one of them are only refreshed once their `attr_timeout` expires.
+void IOFS::invalidate_parent(const char *path) {
+  std::string_view p{path};
+  size_t slash{p.rfind('/')};
+  m_invalidator.push(0, (slash == 0 || slash == std::string_view::npos) ? "/" : p.substr(0, slash));
+}
+
 int IOFS::mkdir(const char *path, mode_t mode) {
   TimerGuard timer{IOOp::mkdir};
-  auto full_path{resolve_path(path)};
-  int res{::mkdir(full_path.c_str(), mode)};
-  return (res == -1) ? -errno : 0;
+  int res{::mkdirat(m_root_fd, relative(path), mode)};
+  if (res == -1) {
+    return -errno;
+  }
+  invalidate_parent(path);
+  return 0;
 }
 
 int IOFS::unlink(const char *path) {
   TimerGuard timer{IOOp::unlink};
-  auto full_path{resolve_path(path)};
-  int res{::unlink(full_path.c_str())};
-  return (res == -1) ? -errno : 0;
+  int res{::unlinkat(m_root_fd, relative(path), 0)};
+  if (res == -1) {
+    return -errno;
+  }
+  invalidate_parent(path);
+  return 0;
 }
 
 int IOFS::rmdir(const char *path) {
   TimerGuard timer{IOOp::rmdir};
-  auto full_path{resolve_path(path)};
-  int res{::rmdir(full_path.c_str())};
-  return (res == -1) ? -errno : 0;
+  int res{::unlinkat(m_root_fd, relative(path), AT_REMOVEDIR)};
+  if (res == -1) {
+    return -errno;
+  }
+  invalidate_parent(path);
+  return 0;
 }
 
 int IOFS::symlink(const char *from, const char *to) {
   TimerGuard timer{IOOp::symlink};
-  auto full_path1{resolve_path(from)}, full_path2{resolve_path(to)};
-  int res{::symlink(full_path1.c_str(), full_path2.c_str())};
-  return (res == -1) ? -errno : 0;
+  // `from` is the link content and stored verbatim; it must not be resolved against the source root
+  int res{::symlinkat(from, m_root_fd, relative(to))};
+  if (res == -1) {
+    return -errno;
+  }
+  invalidate_parent(to);
+  return 0;
 }
 
 int IOFS::rename(const char *from, const char *to, unsigned int flags) {
   TimerGuard timer{IOOp::rename};
-  auto full_path1{resolve_path(from)}, full_path2{resolve_path(to)};
-  // AT_FDCWD works since the paths are absolute
-  int res{::renameat2(AT_FDCWD, full_path1.c_str(), AT_FDCWD, full_path2.c_str(), flags)};
-  return (res == -1) ? -errno : 0;
+  int res{::renameat2(m_root_fd, relative(from), m_root_fd, relative(to), flags)};
+  if (res == -1) {
+    return -errno;
+  }
+  // `to` may have replaced (or, with RENAME_EXCHANGE, swapped with) an existing file
+  m_invalidator.push(0, to);
+  invalidate_parent(from);
+  invalidate_parent(to);
+  return 0;
 }
 
 int IOFS::link(const char *from, const char *to) {
   TimerGuard timer{IOOp::link};
-  auto full_path1{resolve_path(from)}, full_path2{resolve_path(to)};
-  int res{::link(full_path1.c_str(), full_path2.c_str())};
-  return (res == -1) ? -errno : 0;
+  int res{::linkat(m_root_fd, relative(from), m_root_fd, relative(to), 0)};
+  if (res == -1) {
+    return -errno;
+  }
+  // The link count of `from` changed
+  m_invalidator.push(0, from);
+  invalidate_parent(to);
+  return 0;
 }
 
-int IOFS::chmod(const char *path, mode_t mode, [[maybe_unused]] fuse_file_info *fi) {
+int IOFS::chmod(const char *path, mode_t mode, fuse_file_info *fi) {
+  if (fi) {
+    TimerGuard timer{IOOp::fchmod};
+    int res{::fchmod(get_fd(fi), mode)};
+    return (res == -1) ? -errno : 0;
+  }
   TimerGuard timer{IOOp::chmod};
-  auto full_path{resolve_path(path)};
-  int res{::chmod(full_path.c_str(), mode)};
+  int res{::fchmodat(m_root_fd, relative(path), mode, 0)};
   return (res == -1) ? -errno : 0;
 }
 
-int IOFS::chown(const char *path, uid_t uid, gid_t gid, [[maybe_unused]] fuse_file_info *fi) {
+int IOFS::chown(const char *path, uid_t uid, gid_t gid, fuse_file_info *fi) {
+  if (fi) {
+    TimerGuard timer{IOOp::fchown};
+    int res{::fchown(get_fd(fi), uid, gid)};
+    return (res == -1) ? -errno : 0;
+  }
   TimerGuard timer{IOOp::chown};
-  auto full_path{resolve_path(path)};
-  int res{::lchown(full_path.c_str(), uid, gid)};
+  int res{::fchownat(m_root_fd, relative(path), uid, gid, AT_SYMLINK_NOFOLLOW)};
   return (res == -1) ? -errno : 0;
 }
 
-int IOFS::truncate(const char *path, off_t size, [[maybe_unused]] fuse_file_info *fi) {
+int IOFS::truncate(const char *path, off_t size, fuse_file_info *fi) {
+  if (fi) {
+    TimerGuard timer{IOOp::ftruncate};
+    FileHandle *fh{get_file_handle(fi)};
+    int res{::ftruncate(fh->fd, size)};
+    if (res == 0) {
+      fh->set_size(size);
+    }
+    return (res == -1) ? -errno : 0;
+  }
   TimerGuard timer{IOOp::truncate};
-  auto full_path{resolve_path(path)};
-  int res{::truncate(full_path.c_str(), size)};
-  return (res == -1) ? -errno : 0;
+  // There is no `truncateat`. `O_NONBLOCK` keeps us from hanging on a FIFO, which `truncate` would reject anyway
+  int fd{::openat(m_root_fd, relative(path), O_WRONLY | O_NONBLOCK | O_CLOEXEC)};
+  if (fd == -1) {
+    return -errno;
+  }
+  int res{::ftruncate(fd, size)};
+  int err{errno};
+  ::close(fd);
+  return (res == -1) ? -err : 0;
 }
 
 int IOFS::open(const char *path, fuse_file_info *fi) {
   TimerGuard timer{IOOp::open};
-  auto full_path{resolve_path(path)};
-  int fd{::open(full_path.c_str(), fi->flags)};
+  int fd{::openat(m_root_fd, relative(path), m_writeback ? writeback_open_flags(fi->flags) : fi->flags)};
   if (fd == -1) {
     return -errno;
   }
-  fi->fh = static_cast<uint64_t>(fd);
+  FileHandle *fh{m_file_handles.create(fd, TimerGuard::caller())};
+  if (m_passthrough.wants(path, fd)) {
+    m_passthrough.open(m_session_fd, fh, fi);
+  }
+  fi->fh = reinterpret_cast<uint64_t>(fh);
   return 0;
 }
 
 int IOFS::read([[maybe_unused]] const char *path, char *buf, size_t size, off_t offset, fuse_file_info *fi) {
   TimerGuard timer{IOOp::read, 0};
-  ssize_t res{::pread(static_cast<int>(fi->fh), buf, size, offset)};
+  FileHandle *fh{get_file_handle(fi)};
+  timer.set_file(fh->id, offset);
+  ssize_t res{::pread(fh->fd, buf, size, offset)};
   if (res == -1) {
     return -errno;
   }
+  fh->account_read(offset, static_cast<size_t>(res));
   timer.update_size(static_cast<size_t>(res));
   return static_cast<int>(res);
 }
 
 int IOFS::write([[maybe_unused]] const char *path, const char *buf, size_t size, off_t offset, fuse_file_info *fi) {
   TimerGuard timer{IOOp::write, 0};
-  ssize_t res{::pwrite(static_cast<int>(fi->fh), buf, size, offset)};
+  FileHandle *fh{get_file_handle(fi)};
+  timer.set_file(fh->id, offset);
+  ssize_t res{::pwrite(fh->fd, buf, size, offset)};
   if (res == -1) {
     return -errno;
   }
+  fh->account_write(offset, static_cast<size_t>(res));
   timer.update_size(static_cast<size_t>(res));
   return static_cast<int>(res);
 }
 
 int IOFS::statfs(const char *path, struct statvfs *stbuf) {
   TimerGuard timer{IOOp::statfs};
-  auto full_path{resolve_path(path)};
-  int res{::statvfs(full_path.c_str(), stbuf)};
-  return (res == -1) ? -errno : 0;
+  // There is no `statvfsat` either
+  int fd{::openat(m_root_fd, relative(path), O_PATH | O_CLOEXEC)};
+  if (fd == -1) {
+    return -errno;
+  }
+  int res{::fstatvfs(fd, stbuf)};
+  int err{errno};
+  ::close(fd);
+  return (res == -1) ? -err : 0;
 }
 
 int IOFS::flush([[maybe_unused]] const char *path, fuse_file_info *fi) {
@@ -156,13 +275,18 @@ int IOFS::flush([[maybe_unused]] const char *path, fuse_file_info *fi) {
      called multiple times for an open file, this must not really
      close the file.  This is important if used on a network
      filesystem like NFS which flush the data/metadata on close() */
-  int res{::close(::dup(static_cast<int>(fi->fh)))};
+  int res{::close(::dup(get_fd(fi)))};
   return (res == -1) ? -errno : 0;
 }
 
 int IOFS::release([[maybe_unused]] const char *path, fuse_file_info *fi) {
+  FileHandle *fh{get_file_handle(fi)};
+  TimerGuard::set_caller(fh->opener);
   TimerGuard timer{IOOp::release};
-  ::close(static_cast<int>(fi->fh));
+  timer.set_file(fh->id);
+  m_passthrough.release(m_session_fd, fh);
+  ::close(fh->fd);
+  m_file_handles.destroy(fh);
   return 0;
 }
 
@@ -170,60 +294,64 @@ int IOFS::fsync([[maybe_unused]] const char *path, int isdatasync, fuse_file_inf
   TimerGuard timer{IOOp::fsync};
   int res;
   if (isdatasync) {
-    res = ::fdatasync(static_cast<int>(fi->fh));
+    res = ::fdatasync(get_fd(fi));
   } else {
-    res = ::fsync(static_cast<int>(fi->fh));
+    res = ::fsync(get_fd(fi));
   }
   return (res == -1) ? -errno : 0;
 }
 
 int IOFS::setxattr(const char *path, const char *name, const char *value, size_t size, int flags) {
   TimerGuard timer{IOOp::setxattr};
-  auto full_path{resolve_path(path)};
-  int res{::lsetxattr(full_path.c_str(), name, value, size, flags)};
+  XattrPath xpath{m_root_fd, relative(path)};
+  if (!xpath.ok()) {
+    return -ENAMETOOLONG;
+  }
+  int res{::lsetxattr(xpath.c_str(), name, value, size, flags)};
   return (res == -1) ? -errno : 0;
 }
 
 int IOFS::getxattr(const char *path, const char *name, char *value, size_t size) {
   TimerGuard timer{IOOp::getxattr};
-  auto full_path{resolve_path(path)};
-  ssize_t res{::lgetxattr(full_path.c_str(), name, value, size)};
+  XattrPath xpath{m_root_fd, relative(path)};
+  if (!xpath.ok()) {
+    return -ENAMETOOLONG;
+  }
+  ssize_t res{::lgetxattr(xpath.c_str(), name, value, size)};
   return (res == -1) ? -errno : static_cast<int>(res);
 }
 
 int IOFS::listxattr(const char *path, char *list, size_t size) {
   TimerGuard timer{IOOp::listxattr};
-  auto full_path{resolve_path(path)};
-  ssize_t res{::listxattr(full_path.c_str(), list, size)};
+  XattrPath xpath{m_root_fd, relative(path)};
+  if (!xpath.ok()) {
+    return -ENAMETOOLONG;
+  }
+  ssize_t res{::llistxattr(xpath.c_str(), list, size)};
   return (res == -1) ? -errno : static_cast<int>(res);
 }
 
 int IOFS::removexattr(const char *path, const char *name) {
   TimerGuard timer{IOOp::removexattr};
-  auto full_path{resolve_path(path)};
-  int res{::lremovexattr(full_path.c_str(), name)};
+  XattrPath xpath{m_root_fd, relative(path)};
+  if (!xpath.ok()) {
+    return -ENAMETOOLONG;
+  }
+  int res{::lremovexattr(xpath.c_str(), name)};
   return (res == -1) ? -errno : 0;
 }
 
-struct DirHandle {
-  DIR *dp{nullptr};
-  struct dirent *entry{nullptr};
-  off_t offset{0};
-  ~DirHandle() {
-    if (dp) {
-      closedir(dp);
-    }
-  }
-};
-
-static DirHandle *get_dir_handle(fuse_file_info *fi) { return reinterpret_cast<DirHandle *>(fi->fh); }
-
 int IOFS::opendir(const char *path, fuse_file_info *fi) {
   std::unique_ptr<DirHandle> d{std::make_unique<DirHandle>()};
   {
     TimerGuard timer{IOOp::opendir};
-    auto full_path{resolve_path(path)};
-    d->dp = ::opendir(full_path.c_str());
+    int fd{::openat(m_root_fd, relative(path), O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+    if (fd != -1) {
+      d->dp = ::fdopendir(fd);
+      if (!d->dp) {
+        ::close(fd);
+      }
+    }
   }  // Make the timer guard commit early
   if (!d->dp) {
     return -errno;
@@ -326,8 +454,15 @@ int IOFS::releasedir([[maybe_unused]] const char *path, fuse_file_info *fi) {
   return 0;
 }
 
-void *IOFS::init([[maybe_unused]] fuse_conn_info *conn, fuse_config *cfg) {
+void *IOFS::init(fuse_conn_info *conn, fuse_config *cfg) {
+  m_writeback = negotiate_capabilities(m_options.profile, conn);
+  if (m_passthrough.negotiate(conn)) {
+    m_writeback = false;
+  }
+  m_session_fd = fuse_session_fd(fuse_get_session(fuse_get_context()->fuse));
+
   // Start the monitoring server
+  Monitoring::instance().set_connection(m_options.profile, *conn);
   Monitoring::instance().start_server(9090);
 
   // The initing of the IOFS object (i.e. the construction) already happens in
@@ -339,6 +474,15 @@ void *IOFS::init([[maybe_unused]] fuse_conn_info *conn, fuse_config *cfg) {
   // cfg->direct_io = 1;
   // cfg->kernel_cache = 1;
   cfg->auto_cache = 0;
+  cfg->attr_timeout = m_options.attr_timeout;
+  cfg->entry_timeout = m_options.entry_timeout;
+  cfg->negative_timeout = m_options.negative_timeout;
+  if (m_options.invalidate) {
+    fuse *f{fuse_get_context()->fuse};
+    m_invalidator.start([f](const Invalidator::Target &target) { fuse_invalidate_path(f, target.name.c_str()); });
+  }
+  // All ops that get a `fi` work on `fi->fh` only, so libfuse can skip reconstructing the path for them
+  cfg->nullpath_ok = 1;
 
   std::println("IOFS init");
   std::println("intr: {}", cfg->intr);
@@ -362,44 +506,74 @@ void *IOFS::init([[maybe_unused]] fuse_conn_info *conn, fuse_config *cfg) {
 
 void IOFS::destroy([[maybe_unused]] void *private_data) {
   // ~IOFS is called at end of `main`...
+  // ...but the invalidations need the `fuse` object, which is gone by then
+  m_invalidator.stop();
 }
 
 int IOFS::access(const char *path, int mask) {
   TimerGuard timer{IOOp::access};
-  auto full_path{resolve_path(path)};
-  int res{::access(full_path.c_str(), mask)};
+  int res{::faccessat(m_root_fd, relative(path), mask, 0)};
   return (res == -1) ? -errno : 0;
 }
 
 int IOFS::create(const char *path, mode_t mode, fuse_file_info *fi) {
   TimerGuard timer{IOOp::create};
-  auto full_path{resolve_path(path)};
-  int fd{::open(full_path.c_str(), fi->flags, mode)};
+  int fd{::openat(m_root_fd, relative(path), m_writeback ? writeback_open_flags(fi->flags) : fi->flags, mode)};
   if (fd == -1) {
     return -errno;
   }
-  fi->fh = static_cast<uint64_t>(fd);
+  FileHandle *fh{m_file_handles.create(fd, TimerGuard::caller())};
+  if (m_passthrough.wants(path, fd)) {
+    m_passthrough.open(m_session_fd, fh, fi);
+  }
+  fi->fh = reinterpret_cast<uint64_t>(fh);
+  invalidate_parent(path);
   return 0;
 }
 
-int IOFS::utimens(const char *path, const timespec ts[2], [[maybe_unused]] fuse_file_info *fi) {
+int IOFS::utimens(const char *path, const timespec ts[2], fuse_file_info *fi) {
+  if (fi) {
+    TimerGuard timer{IOOp::futimens};
+    int res{::futimens(get_fd(fi), ts)};
+    return (res == -1) ? -errno : 0;
+  }
   TimerGuard timer{IOOp::utimens};
-  auto full_path{resolve_path(path)};
   /* don't use utime/utimes since they follow symlinks */
-  int res{::utimensat(0, full_path.c_str(), ts, AT_SYMLINK_NOFOLLOW)};
+  int res{::utimensat(m_root_fd, relative(path), ts, AT_SYMLINK_NOFOLLOW)};
   return (res == -1) ? -errno : 0;
 }
 
-#ifdef USE_ZERO_COPY
+template <ZeroCopyReport Mode>
+size_t zero_copy_read_size(FileHandle *fh, size_t size, off_t offset) {
+  if constexpr (Mode == ZeroCopyReport::none) {
+    return 0;
+  } else if constexpr (Mode == ZeroCopyReport::under) {
+    return 1;
+  } else if constexpr (Mode == ZeroCopyReport::over) {
+    return size;
+  } else {
+    // min(requested_size, file_size - offset), based on the cached size of the handle.
+    // Only reads reaching past the cached EOF pay for an `fstat`, since the file might have grown through another fd
+    // in the meantime. For large sequential reads, that is once per file instead of once per read.
+    // If fstat fails we fall back to the requested size (OVER semantics).
+    off_t file_size{fh->cached_size.load(std::memory_order_relaxed)};
+    if (file_size < offset + static_cast<off_t>(size)) {
+      struct stat st{};
+      if (::fstat(fh->fd, &st) != 0) {
+        return size;
+      }
+      file_size = st.st_size;
+      fh->set_size(file_size);
+    }
+    off_t available{file_size - offset};
+    return (available <= 0) ? 0 : std::min(size, static_cast<size_t>(available));
+  }
+}
+
+template <ZeroCopyReport Mode>
 int IOFS::write_buf([[maybe_unused]] const char *path, fuse_bufvec *buf, off_t offset, fuse_file_info *fi) {
-  // `write_buf` is a pain in the ass. For `read_buf`, we can find out the accurate reporting via
-  //   `min(requested_size, file_size - offset)`
-  // Unfortunately, this is not possible for `write_buf`.
-  // - `fuse_buf_copy` might just do a partial write (which differs from the logical write, for example in case you
-  //   wrote your benchmarker to capture specific characteristics)
-  // - `fstat` after write only works with a single concurrent writer that only strictly appends
-  //
-  // Thus, best effort, we fall back to `ZERO_COPY_REPORT_OVER`, i.e. the full `fuse_buf_size(buf)`. Be aware.
+  // Unlike `read_buf`, the copy happens right here, so `ZeroCopyReport::accurate` reports what `fuse_buf_copy`
+  // returned. Note that this may be a partial write, which differs from the logical write the application issued.
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wold-style-cast"
@@ -408,51 +582,32 @@ int IOFS::write_buf([[maybe_unused]] const char *path, fuse_bufvec *buf, off_t o
   struct fuse_bufvec dst = FUSE_BUFVEC_INIT(requested_size);
 #pragma GCC diagnostic pop
 
+  FileHandle *fh{get_file_handle(fi)};
   dst.buf[0].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
-  dst.buf[0].fd = static_cast<int>(fi->fh);
+  dst.buf[0].fd = fh->fd;
   dst.buf[0].pos = offset;
 
-#if defined(ZERO_COPY_REPORT_NONE)
-  TimerGuard timer{IOOp::write_buf, 0};
-  ssize_t res{fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK)};
-#elif defined(ZERO_COPY_REPORT_UNDER)
-  TimerGuard timer{IOOp::write_buf, 1};
-  ssize_t res{fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK)};
-#elif defined(ZERO_COPY_REPORT_OVER) || defined(ZERO_COPY_REPORT_ACCURATE)
-  // ACCURATE falls back to OVER for write_buf — see the comment above.
-  TimerGuard timer{IOOp::write_buf, requested_size};
+  TimerGuard timer{IOOp::write_buf, zero_copy_write_size<Mode>(requested_size)};
+  timer.set_file(fh->id, offset);
   ssize_t res{fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK)};
-#endif
 
+  if constexpr (Mode == ZeroCopyReport::accurate) {
+    timer.update_size(res > 0 ? static_cast<size_t>(res) : 0);
+  }
+  if (res > 0) {
+    fh->account_write(offset, static_cast<size_t>(res));
+  }
   return static_cast<int>(res);
 }
 
+template <ZeroCopyReport Mode>
 int IOFS::read_buf([[maybe_unused]] const char *path, fuse_bufvec **bufp, size_t size, off_t offset,
                    fuse_file_info *fi) {
+  FileHandle *fh{get_file_handle(fi)};
   // Determine reported unit size according to the chosen mode.
-#if defined(ZERO_COPY_REPORT_NONE)
-  TimerGuard timer{IOOp::read_buf, 0};
-#elif defined(ZERO_COPY_REPORT_UNDER)
-  TimerGuard timer{IOOp::read_buf, 1};
-#elif defined(ZERO_COPY_REPORT_OVER)
-  TimerGuard timer{IOOp::read_buf, size};
-#elif defined(ZERO_COPY_REPORT_ACCURATE)
-  // Compute min(requested_size, file_size - offset) via fstat.
-  // This is one extra syscall per read_buf, but gives the true upper bound
-  // on bytes that can actually be transferred from this offset.
-  size_t accurate_size{size};
-  struct stat st{};
-  if (::fstat(static_cast<int>(fi->fh), &st) == 0) {
-    off_t available{st.st_size - offset};
-    if (available <= 0) {
-      accurate_size = 0;
-    } else {
-      accurate_size = std::min(size, static_cast<size_t>(available));
-    }
-  }
-  // If fstat fails we fall back to the requested size (OVER semantics).
-  TimerGuard timer{IOOp::read_buf, accurate_size};
-#endif
+  size_t reported{zero_copy_read_size<Mode>(fh, size, offset)};
+  TimerGuard timer{IOOp::read_buf, reported};
+  timer.set_file(fh->id, offset);
 
   // Use malloc: FUSE takes ownership and will free() this, not delete it.
   auto *src{static_cast<struct fuse_bufvec *>(std::malloc(sizeof(struct fuse_bufvec)))};
@@ -467,16 +622,29 @@ int IOFS::read_buf([[maybe_unused]] const char *path, fuse_bufvec **bufp, size_t
 #pragma GCC diagnostic pop
 
   src->buf[0].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
-  src->buf[0].fd = static_cast<int>(fi->fh);
+  src->buf[0].fd = fh->fd;
   src->buf[0].pos = offset;
   *bufp = src;
+  // The actual splice happens after we return and libfuse does not hand its result back. Thus, `accurate` reconciles
+  // against the cached file size beforehand, which is exact unless the file shrinks concurrently.
+  fh->account_read(offset, Mode == ZeroCopyReport::accurate ? reported : size);
   return 0;
 }
-#endif // USE_ZERO_COPY
+
+// Instantiate every mode; `main` picks one at startup
+#define IOFS_INSTANTIATE_ZERO_COPY(mode)                                                                          \
+  template size_t zero_copy_read_size<mode>(FileHandle *, size_t, off_t);                                         \
+  template int IOFS::write_buf<mode>(const char *, fuse_bufvec *, off_t, fuse_file_info *);                       \
+  template int IOFS::read_buf<mode>(const char *, fuse_bufvec **, size_t, off_t, fuse_file_info *);
+IOFS_INSTANTIATE_ZERO_COPY(ZeroCopyReport::none)
+IOFS_INSTANTIATE_ZERO_COPY(ZeroCopyReport::under)
+IOFS_INSTANTIATE_ZERO_COPY(ZeroCopyReport::over)
+IOFS_INSTANTIATE_ZERO_COPY(ZeroCopyReport::accurate)
+#undef IOFS_INSTANTIATE_ZERO_COPY
 
 int IOFS::flock([[maybe_unused]] const char *path, fuse_file_info *fi, int op) {
   TimerGuard timer{IOOp::flock};
-  int res{::flock(static_cast<int>(fi->fh), op)};
+  int res{::flock(get_fd(fi), op)};
   return (res == -1) ? -errno : 0;
 }
 int IOFS::fallocate([[maybe_unused]] const char *path, int mode, off_t offset, off_t length, fuse_file_info *fi) {
@@ -484,10 +652,18 @@ int IOFS::fallocate([[maybe_unused]] const char *path, int mode, off_t offset, o
     return -EOPNOTSUPP;
   }
   TimerGuard timer{IOOp::fallocate};
-  int err{::posix_fallocate(static_cast<int>(fi->fh), offset, length)};
+  FileHandle *fh{get_file_handle(fi)};
+  int err{::posix_fallocate(fh->fd, offset, length)};
+  if (err == 0) {
+    fh->grow_size(offset + length);
+  }
   return -err;
 }
 
-std::filesystem::path IOFS::resolve_path(const char *path) const {
-  return m_source_root / std::filesystem::path(path).relative_path();
+const char *IOFS::relative(const char *path) {
+  // FUSE paths are always absolute; the root itself becomes "."
+  while (*path == '/') {
+    ++path;
+  }
+  return (*path == '\0') ? "." : path;
 }
@@ -1,48 +1,9 @@
 #pragma once
 
-// Zero-copy (splice-based) I/O configuration
-// Uncomment USE_ZERO_COPY to enable splice-based `read_buf` / `write_buf`.
-// When enabled, you MUST also pick exactly one `ZERO_COPY_REPORT_*` mode below.
-//
-// Why: Unlike regular `read`/`write`, the splice path does not give us the actual number of bytes, instead we only know
-// what was *requested*, which sucks for small file IO. Depending on what you want to model, you have different chioces
-// below.
-//
-// #define USE_ZERO_COPY
-
-#ifdef USE_ZERO_COPY
-
-// `ZERO_COPY_REPORT_NONE:` `read_buf`/`write_buf` are used, but disregarded before sending to the loaded plugins.
-//
-// #define ZERO_COPY_REPORT_NONE
-
-// `ZERO_COPY_REPORT_UNDER` Always reports 1 byte.
-//
-// #define ZERO_COPY_REPORT_UNDER
-
-// `ZERO_COPY_REPORT_OVER`: Reports the requested buffer size. Can be a HUGE upper bound for small I/O.
-//   Imagine fetching 128KiB buffers when reading 16 byte files
-//
-// #define ZERO_COPY_REPORT_OVER
-
-// ZERO_COPY_REPORT_ACCURATE: Computes `min(requested_size, file_size - offset)`
-//   Very expensive, as it requires another `fstat` syscall per `read_buf` call.
-//   Note: `read_buf` only... see `write_buf` for why write is different...
-// #define ZERO_COPY_REPORT_ACCURATE
-
-#if !defined(ZERO_COPY_REPORT_NONE)    && \
-      !defined(ZERO_COPY_REPORT_UNDER)   && \
-      !defined(ZERO_COPY_REPORT_OVER)    && \
-      !defined(ZERO_COPY_REPORT_ACCURATE)
-#error "USE_ZERO_COPY is defined but no ZERO_COPY_REPORT_* mode was chosen. \
-  Pick one of: ZERO_COPY_REPORT_NONE, ZERO_COPY_REPORT_UNDER, ZERO_COPY_REPORT_OVER, ZERO_COPY_REPORT_ACCURATE"
-#endif
-
-#endif // USE_ZERO_COPY
-
 #include <fcntl.h>
 #include <sys/statvfs.h>
 
+#include <atomic>
 #include <chrono>
 #include <cstdio>
 #include <cstdlib>
@@ -57,6 +18,13 @@
 
 #include <filesystem>
 
+#include "capabilities.hh"
+#include "handles.hh"
+#include "invalidator.hh"
+#include "mount_options.hh"
+#include "object_pool.hh"
+#include "passthrough.hh"
+
 enum class IOOp {
   getattr,
   readlink,
@@ -90,30 +58,113 @@ enum class IOOp {
   read_buf,
   flock,
   fallocate,
+  // fd-based variants of the ops above, used when the kernel hands us an open file in `fi`
+  fgetattr,
+  fchmod,
+  fchown,
+  ftruncate,
+  futimens,
+  // Per-session summaries of passed-through files, recorded at `release`, see `Passthrough`
+  passthrough_read,
+  passthrough_write,
   last // Synthetic element to mark the end/count of ops
 };
 
+static_assert(static_cast<size_t>(IOOp::last) < 64, "TimerGuard::set_timed_ops has one bit per op");
+
 class TimerGuard {
  public:
   using clock_type = std::chrono::high_resolution_clock;
-  explicit TimerGuard(IOOp op, size_t init_s = 1) : m_operation{op}, m_size{init_s}, m_start{clock_type::now()} {}
+  explicit TimerGuard(IOOp op, size_t init_s = 1)
+      : m_operation{op},
+        m_size{init_s},
+        m_timed{((s_timed_ops.load(std::memory_order_relaxed) >> static_cast<unsigned>(op)) & 1) != 0},
+        m_start{m_timed ? clock_type::now() : clock_type::time_point{}} {}
   ~TimerGuard();
   TimerGuard(const TimerGuard &) = delete;
   TimerGuard &operator=(const TimerGuard &) = delete;
   TimerGuard(TimerGuard &&) = delete;
   TimerGuard &operator=(TimerGuard &&) = delete;
   void update_size(size_t s);
+  // For ops on an open file, see `iofs_event`
+  void set_file(uint64_t file_id, off_t offset = 0) {
+    m_file_id = file_id;
+    m_offset = static_cast<uint64_t>(offset);
+  }
+  // For ops that complete on another thread: their latency is not busy time of the worker, see `Workers`
+  void detach_worker() { m_worker = false; }
+
+  // Bitmask over `IOOp` of the ops whose duration is needed by anyone, see `Monitoring::refresh_subscriptions`.
+  // All other ops skip both clock reads.
+  static void set_timed_ops(uint64_t mask) { s_timed_ops.store(mask, std::memory_order_relaxed); }
+  static uint64_t timed_ops() { return s_timed_ops.load(std::memory_order_relaxed); }
+
+  // The caller of the request the current thread works on, from the FUSE context; the backends set it on every
+  // request. Guards take it on construction, so ops completing on another thread keep theirs.
+  static void set_caller(Caller caller) { s_caller = caller; }
+  static Caller caller() { return s_caller; }
 
  private:
+  static inline std::atomic<uint64_t> s_timed_ops{~uint64_t{0}};
+  static inline thread_local Caller s_caller{};
+
   IOOp m_operation;
   size_t m_size;
+  uint64_t m_file_id{0};
+  uint64_t m_offset{0};
+  Caller m_caller{s_caller};
+  bool m_timed;
   clock_type::time_point m_start;
+  bool m_worker{true};
 };
 
+// Zero-copy (splice-based) I/O, selected at startup via `--zero-copy`.
+//
+// Why the different modes: Unlike regular `read`/`write`, the splice path does not give us the actual number of bytes,
+// instead we only know what was *requested*, which sucks for small file IO. Depending on what you want to model, you
+// have different choices below.
+//
+// `read_buf`/`write_buf` are templated on the mode, so the unchosen modes cost nothing on the hot path.
+enum class ZeroCopyReport {
+  // `read_buf`/`write_buf` are used, but disregarded before sending to the loaded plugins.
+  none,
+  // Always reports 1 byte.
+  under,
+  // Reports the requested buffer size. Can be a HUGE upper bound for small I/O.
+  //   Imagine fetching 128KiB buffers when reading 16 byte files
+  over,
+  // Reads report `min(requested_size, file_size - offset)` from the handle's cached file size, writes the number of
+  // bytes actually copied.
+  //   Reads only pay for an `fstat` when they reach past the cached EOF (e.g. the last read of a file, or one grown
+  //   through another fd), so sequential reads of a file cost about one `fstat` in total. A file shrunk through
+  //   another fd is over-reported until then, see `FileHandle::cached_size`.
+  accurate,
+};
+
+// Size reported to the plugins for a zero-copy read of `size` bytes at `offset`. Shared by both backends.
+template <ZeroCopyReport Mode>
+size_t zero_copy_read_size(FileHandle *fh, size_t size, off_t offset);
+
+// Size reported to the plugins for a zero-copy write of `requested` bytes before the copy.
+// `accurate` starts out as `over` and is corrected to the copied size afterwards.
+template <ZeroCopyReport Mode>
+constexpr size_t zero_copy_write_size(size_t requested) {
+  if constexpr (Mode == ZeroCopyReport::none) {
+    return 0;
+  } else if constexpr (Mode == ZeroCopyReport::under) {
+    return 1;
+  } else {
+    return requested;
+  }
+}
+
 // See `fuse_operations` struct definition for description on the operations
 class IOFS {
  public:
-  explicit IOFS(std::filesystem::path root) : m_source_root{std::move(root)} {}
+  explicit IOFS(const std::filesystem::path &root, const MountOptions &options = {});
+  ~IOFS();
+  IOFS(const IOFS &) = delete;
+  IOFS &operator=(const IOFS &) = delete;
   int getattr(const char *path, struct stat *stbuf, fuse_file_info *fi);
   int readlink(const char *path, char *buf, size_t size);
   int mkdir(const char *path, mode_t mode);
@@ -145,14 +196,22 @@ class IOFS {
   int access(const char *path, int mask);
   int create(const char *path, mode_t mode, fuse_file_info *fi);
   int utimens(const char *path, const timespec ts[2], fuse_file_info *fi);
-#ifdef USE_ZERO_COPY
+  template <ZeroCopyReport Mode>
   int write_buf(const char *path, fuse_bufvec *buf, off_t offset, fuse_file_info *fi);
+  template <ZeroCopyReport Mode>
   int read_buf(const char *path, fuse_bufvec **bufp, size_t size, off_t offset, fuse_file_info *fi);
-#endif
   int flock(const char *path, fuse_file_info *fi, int op);
   int fallocate(const char *path, int mode, off_t offset, off_t length, fuse_file_info *fi);
 
  private:
-  std::filesystem::path m_source_root;
-  std::filesystem::path resolve_path(const char *path) const;
+  // `O_PATH` fd of the source root; all paths are resolved relative to it, so the root may even be renamed
+  int m_root_fd;
+  MountOptions m_options;
+  bool m_writeback{false};  // Set in `init`, see `writeback_open_flags`
+  ObjectPool<FileHandle> m_file_handles;
+  Invalidator m_invalidator;
+  Passthrough m_passthrough;
+  int m_session_fd{-1};  // Set in `init`, for `Passthrough`
+  static const char *relative(const char *path);
+  void invalidate_parent(const char *path);
 };
@@ -0,0 +1,949 @@
+#include "iofs_ll.hh"
+#include "handles.hh"
+#include "iofs.hh"
+#include "monitoring.hh"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <print>
+#include <system_error>
+#include <vector>
+
+// Magic link to an fd, for the few syscalls that have no `*at()`/`AT_EMPTY_PATH` variant usable with `O_PATH` fds.
+// Large enough for any int.
+struct ProcPath {
+  char buf[32];
+  explicit ProcPath(int fd) { std::snprintf(buf, sizeof(buf), "/proc/self/fd/%i", fd); }
+  const char *c_str() const { return buf; }
+};
+
+IOFSLowLevel::Inode::~Inode() {
+  if (fd != -1) {
+    ::close(fd);
+  }
+}
+
+IOFSLowLevel::IOFSLowLevel(const std::filesystem::path &root, const MountOptions &options)
+    : m_options{options}, m_passthrough{options.passthrough} {
+  auto inode{std::make_unique<Inode>()};
+  inode->fd = ::open(root.c_str(), O_PATH);
+  if (inode->fd == -1) {
+    throw std::system_error(errno, std::generic_category(), "Failed to open source directory " + root.string());
+  }
+  struct stat st{};
+  if (::fstatat(inode->fd, "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1) {
+    throw std::system_error(errno, std::generic_category(), "Failed to stat source directory " + root.string());
+  }
+  inode->src_dev = st.st_dev;
+  inode->src_ino = st.st_ino;
+  // The root is never forgotten by the kernel
+  inode->nlookup = 2;
+  m_root = inode.get();
+  m_inodes.emplace(SourceId{st.st_dev, st.st_ino}, std::move(inode));
+}
+
+IOFSLowLevel::~IOFSLowLevel() = default;
+
+IOFSLowLevel::Inode &IOFSLowLevel::get_inode(fuse_ino_t ino) {
+  if (ino == FUSE_ROOT_ID) {
+    return *m_root;
+  }
+  return *reinterpret_cast<Inode *>(ino);
+}
+
+fuse_ino_t IOFSLowLevel::ino_of(const Inode &inode) const {
+  if (&inode == m_root) {
+    return FUSE_ROOT_ID;
+  }
+  return reinterpret_cast<fuse_ino_t>(&inode);
+}
+
+// Returns 0 or an errno. On success, the inode's lookup count was incremented and must be balanced by a `forget`.
+int IOFSLowLevel::do_lookup(fuse_ino_t parent, const char *name, fuse_entry_param *e) {
+  *e = fuse_entry_param{};
+  e->attr_timeout = m_options.attr_timeout;
+  e->entry_timeout = m_options.entry_timeout;
+
+  int fd{::openat(get_inode(parent).fd, name, O_PATH | O_NOFOLLOW)};
+  if (fd == -1) {
+    return errno;
+  }
+  if (::fstatat(fd, "", &e->attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1) {
+    int err{errno};
+    ::close(fd);
+    return err;
+  }
+
+  std::lock_guard lock{m_mutex};
+  auto [it, inserted] = m_inodes.try_emplace(SourceId{e->attr.st_dev, e->attr.st_ino});
+  if (inserted) {
+    it->second = std::make_unique<Inode>();
+    it->second->fd = fd;
+    it->second->src_dev = e->attr.st_dev;
+    it->second->src_ino = e->attr.st_ino;
+    it->second->is_symlink = S_ISLNK(e->attr.st_mode);
+  } else {
+    // Already known (hardlink or repeated lookup), keep the existing fd
+    ::close(fd);
+  }
+  ++it->second->nlookup;
+  set_parent(*it->second, get_inode(parent), name);
+  e->ino = ino_of(*it->second);
+  return 0;
+}
+
+void IOFSLowLevel::forget_one(fuse_ino_t ino, uint64_t nlookup) {
+  Inode &inode{get_inode(ino)};
+  std::lock_guard lock{m_mutex};
+  unref(&inode, nlookup);
+}
+
+// Drops `nlookup` lookups of `inode`, and with it every ancestor no longer looked up. Call with `m_mutex` held.
+void IOFSLowLevel::unref(Inode *inode, uint64_t nlookup) {
+  while (inode && inode != m_root) {
+    if (nlookup < inode->nlookup) {
+      inode->nlookup -= nlookup;
+      return;
+    }
+    Inode *parent{inode->parent};
+    m_inodes.erase(SourceId{inode->src_dev, inode->src_ino});
+    inode = parent;
+    nlookup = 1;
+  }
+}
+
+// Call with `m_mutex` held
+void IOFSLowLevel::set_parent(Inode &inode, Inode &parent, std::string_view name) {
+  if (inode.parent != &parent) {
+    ++parent.nlookup;
+    unref(inode.parent, 1);
+    inode.parent = &parent;
+  }
+  if (inode.name != name) {
+    inode.name = name;
+  }
+}
+
+// Points the inode now at `name` in `parent`, if we know it, to its new place after a rename
+void IOFSLowLevel::renamed(fuse_ino_t parent, const char *name) {
+  Inode &dir{get_inode(parent)};
+  struct stat st{};
+  if (::fstatat(dir.fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+    return;
+  }
+  std::lock_guard lock{m_mutex};
+  if (auto it{m_inodes.find(SourceId{st.st_dev, st.st_ino})}; it != m_inodes.end()) {
+    set_parent(*it->second, dir, name);
+  }
+}
+
+// Path below the mount root, from the names of the inode and its ancestors
+std::string IOFSLowLevel::path_of(fuse_ino_t ino) {
+  std::lock_guard lock{m_mutex};
+  std::vector<const std::string *> names;
+  for (const Inode *inode{&get_inode(ino)}; inode && inode != m_root; inode = inode->parent) {
+    names.push_back(&inode->name);
+  }
+  std::string path;
+  for (auto it{names.rbegin()}; it != names.rend(); ++it) {
+    path += '/';
+    path += **it;
+  }
+  return path.empty() ? "/" : path;
+}
+
+void IOFSLowLevel::set_session(fuse_session *se) { m_session = se; }
+
+void IOFSLowLevel::init(fuse_conn_info *conn) {
+  m_writeback = negotiate_capabilities(m_options.profile, conn);
+  if (m_passthrough.negotiate(conn)) {
+    m_writeback = false;
+  }
+  if (m_options.invalidate) {
+    m_invalidator.start([se = m_session](const Invalidator::Target &target) {
+      if (target.name.empty()) {
+        fuse_lowlevel_notify_inval_inode(se, target.ino, 0, 0);
+      } else {
+        fuse_lowlevel_notify_inval_entry(se, target.ino, target.name.c_str(), target.name.size());
+      }
+    });
+  }
+#ifdef IOFS_WITH_IO_URING
+  // Not in the constructor: its completion thread would not survive `fuse_daemonize`. No request can come in before
+  // `init` is answered, so the workers see it without further synchronization.
+  if (m_options.uring_depth > 0) {
+    try {
+      m_uring = std::make_unique<UringEngine>(m_options.uring_depth);
+    } catch (const std::system_error &e) {
+      std::println(stderr, "Fatal error: {}", e.what());
+      fuse_session_exit(m_session);
+    }
+  }
+#endif
+
+  // Start the monitoring server
+  Monitoring::instance().set_connection(m_options.profile, *conn);
+  Monitoring::instance().start_server(9090);
+  std::println("IOFS init (lowlevel)");
+}
+
+void IOFSLowLevel::destroy() {
+  // ~IOFSLowLevel is called at end of `main`...
+  // ...but the invalidations and the io_uring replies need a mounted session
+  m_invalidator.stop();
+#ifdef IOFS_WITH_IO_URING
+  if (m_uring) {
+    m_uring->stop();
+  }
+#endif
+}
+
+void IOFSLowLevel::lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  fuse_entry_param e;
+  int err;
+  {
+    TimerGuard timer{IOOp::getattr};
+    err = do_lookup(parent, name, &e);
+  }
+  if (err == ENOENT && m_options.negative_timeout > 0) {
+    // A zero inode tells the kernel to cache the negative lookup for `entry_timeout`
+    e = fuse_entry_param{};
+    e.entry_timeout = m_options.negative_timeout;
+    fuse_reply_entry(req, &e);
+    return;
+  }
+  if (err) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  fuse_reply_entry(req, &e);
+}
+
+void IOFSLowLevel::forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+  forget_one(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+void IOFSLowLevel::forget_multi(fuse_req_t req, size_t count, fuse_forget_data *forgets) {
+  for (size_t i = 0; i < count; ++i) {
+    forget_one(forgets[i].ino, forgets[i].nlookup);
+  }
+  fuse_reply_none(req);
+}
+
+// Like `IOFS::getattr`, a `getattr` on an open file (the kernel only passes `fi` for regular files) is an `fgetattr`
+void IOFSLowLevel::getattr(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi) {
+  struct stat st{};
+  int err{0};
+  {
+    TimerGuard timer{fi ? IOOp::fgetattr : IOOp::getattr};
+    int res{fi ? ::fstat(get_fd(fi), &st) : ::fstatat(get_inode(ino).fd, "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW)};
+    if (res == -1) {
+      err = errno;
+    }
+  }
+  if (err) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  fuse_reply_attr(req, &st, m_options.attr_timeout);
+}
+
+// One `setattr` can carry several changes; each is recorded as the op the high-level API would have called for it.
+void IOFSLowLevel::setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, fuse_file_info *fi) {
+  Inode &inode{get_inode(ino)};
+  ProcPath proc{inode.fd};
+  int err{0};
+
+  if (to_set & FUSE_SET_ATTR_MODE) {
+    TimerGuard timer{fi ? IOOp::fchmod : IOOp::chmod};
+    int res{fi ? ::fchmod(get_fd(fi), attr->st_mode) : ::chmod(proc.c_str(), attr->st_mode)};
+    if (res == -1) {
+      err = errno;
+    }
+  }
+  if (!err && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+    TimerGuard timer{fi ? IOOp::fchown : IOOp::chown};
+    uid_t uid{(to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : static_cast<uid_t>(-1)};
+    gid_t gid{(to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : static_cast<gid_t>(-1)};
+    int res{fi ? ::fchown(get_fd(fi), uid, gid)
+               : ::fchownat(inode.fd, "", uid, gid, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW)};
+    if (res == -1) {
+      err = errno;
+    }
+  }
+  if (!err && (to_set & FUSE_SET_ATTR_SIZE)) {
+    TimerGuard timer{fi ? IOOp::ftruncate : IOOp::truncate};
+    int res{fi ? ::ftruncate(get_fd(fi), attr->st_size) : ::truncate(proc.c_str(), attr->st_size)};
+    if (res == -1) {
+      err = errno;
+    } else if (fi) {
+      get_file_handle(fi)->set_size(attr->st_size);
+    }
+  }
+  if (!err && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+    TimerGuard timer{fi ? IOOp::futimens : IOOp::utimens};
+    timespec tv[2]{{0, UTIME_OMIT}, {0, UTIME_OMIT}};
+    if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+      tv[0].tv_nsec = UTIME_NOW;
+    } else if (to_set & FUSE_SET_ATTR_ATIME) {
+      tv[0] = attr->st_atim;
+    }
+    if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+      tv[1].tv_nsec = UTIME_NOW;
+    } else if (to_set & FUSE_SET_ATTR_MTIME) {
+      tv[1] = attr->st_mtim;
+    }
+    int res{fi ? ::futimens(get_fd(fi), tv) : ::utimensat(AT_FDCWD, proc.c_str(), tv, 0)};
+    if (res == -1) {
+      err = errno;
+    }
+  }
+  if (err) {
+    fuse_reply_err(req, err);
+    return;
+  }
+
+  // Reply with the updated attributes, as `setattr` expects
+  getattr(req, ino, fi);
+}
+
+void IOFSLowLevel::readlink(fuse_req_t req, fuse_ino_t ino) {
+  char buf[PATH_MAX + 1];
+  ssize_t res;
+  int err{0};
+  {
+    TimerGuard timer{IOOp::readlink};
+    res = ::readlinkat(get_inode(ino).fd, "", buf, sizeof(buf));
+    if (res == -1) {
+      err = errno;
+    }
+  }
+  if (err) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  if (static_cast<size_t>(res) == sizeof(buf)) {
+    fuse_reply_err(req, ENAMETOOLONG);
+    return;
+  }
+  buf[res] = '\0';
+  fuse_reply_readlink(req, buf);
+}
+
+void IOFSLowLevel::mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+  fuse_entry_param e;
+  int err{0};
+  {
+    TimerGuard timer{IOOp::mkdir};
+    if (::mkdirat(get_inode(parent).fd, name, mode) == -1) {
+      err = errno;
+    } else {
+      err = do_lookup(parent, name, &e);
+      m_invalidator.push(parent);
+    }
+  }
+  if (err) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  fuse_reply_entry(req, &e);
+}
+
+void IOFSLowLevel::unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  int err{0};
+  {
+    TimerGuard timer{IOOp::unlink};
+    if (::unlinkat(get_inode(parent).fd, name, 0) == -1) {
+      err = errno;
+    } else {
+      m_invalidator.push(parent);
+    }
+  }
+  fuse_reply_err(req, err);
+}
+
+void IOFSLowLevel::rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  int err{0};
+  {
+    TimerGuard timer{IOOp::rmdir};
+    if (::unlinkat(get_inode(parent).fd, name, AT_REMOVEDIR) == -1) {
+      err = errno;
+    } else {
+      m_invalidator.push(parent);
+    }
+  }
+  fuse_reply_err(req, err);
+}
+
+void IOFSLowLevel::symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name) {
+  fuse_entry_param e;
+  int err{0};
+  {
+    TimerGuard timer{IOOp::symlink};
+    if (::symlinkat(link, get_inode(parent).fd, name) == -1) {
+      err = errno;
+    } else {
+      err = do_lookup(parent, name, &e);
+      m_invalidator.push(parent);
+    }
+  }
+  if (err) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  fuse_reply_entry(req, &e);
+}
+
+void IOFSLowLevel::rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent,
+                          const char *newname, unsigned int flags) {
+  int err{0};
+  {
+    TimerGuard timer{IOOp::rename};
+    if (::renameat2(get_inode(parent).fd, name, get_inode(newparent).fd, newname, flags) == -1) {
+      err = errno;
+    } else {
+      // `newname` may have replaced (or, with RENAME_EXCHANGE, swapped with) an existing file
+      m_invalidator.push(newparent, newname);
+      m_invalidator.push(parent);
+      m_invalidator.push(newparent);
+      // The kernel keeps its inodes, so we move ours along; only paths matched against need it
+      if (m_passthrough.matches_paths()) {
+        renamed(newparent, newname);
+        if (flags & RENAME_EXCHANGE) {
+          renamed(parent, name);
+        }
+      }
+    }
+  }
+  fuse_reply_err(req, err);
+}
+
+void IOFSLowLevel::link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname) {
+  Inode &inode{get_inode(ino)};
+  fuse_entry_param e{};
+  int err{0};
+  {
+    TimerGuard timer{IOOp::link};
+    // `linkat` with `AT_EMPTY_PATH` would need CAP_DAC_READ_SEARCH, the magic link does not
+    ProcPath proc{inode.fd};
+    if (::linkat(AT_FDCWD, proc.c_str(), get_inode(newparent).fd, newname, AT_SYMLINK_FOLLOW) == -1 ||
+        ::fstatat(inode.fd, "", &e.attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1) {
+      err = errno;
+    }
+  }
+  if (err) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  {
+    std::lock_guard lock{m_mutex};
+    ++inode.nlookup;
+  }
+  m_invalidator.push(newparent);
+  e.ino = ino;
+  e.attr_timeout = m_options.attr_timeout;
+  e.entry_timeout = m_options.entry_timeout;
+  fuse_reply_entry(req, &e);
+}
+
+void IOFSLowLevel::open(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi) {
+  int fd;
+  int err{0};
+  {
+    TimerGuard timer{IOOp::open};
+    // Reopen through the magic link; `O_NOFOLLOW` would make it fail on it
+    ProcPath proc{get_inode(ino).fd};
+    int flags{m_writeback ? writeback_open_flags(fi->flags) : fi->flags};
+    fd = ::open(proc.c_str(), flags & ~O_NOFOLLOW);
+    if (fd == -1) {
+      err = errno;
+    }
+  }
+  if (err) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  FileHandle *fh{m_file_handles.create(fd, TimerGuard::caller())};
+  maybe_passthrough(ino, fh, fi);
+  fi->fh = reinterpret_cast<uint64_t>(fh);
+  fuse_reply_open(req, fi);
+}
+
+void IOFSLowLevel::create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, fuse_file_info *fi) {
+  fuse_entry_param e;
+  int fd;
+  int err{0};
+  {
+    TimerGuard timer{IOOp::create};
+    int flags{m_writeback ? writeback_open_flags(fi->flags) : fi->flags};
+    fd = ::openat(get_inode(parent).fd, name, (flags | O_CREAT) & ~O_NOFOLLOW, mode);
+    if (fd == -1) {
+      err = errno;
+    } else {
+      err = do_lookup(parent, name, &e);
+      if (err) {
+        ::close(fd);
+      }
+      m_invalidator.push(parent);
+    }
+  }
+  if (err) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  FileHandle *fh{m_file_handles.create(fd, TimerGuard::caller())};
+  maybe_passthrough(e.ino, fh, fi);
+  fi->fh = reinterpret_cast<uint64_t>(fh);
+  fuse_reply_create(req, &e, fi);
+}
+
+// We have no path here; it is only rebuilt from the inode's names if there are patterns to match it against
+void IOFSLowLevel::maybe_passthrough(fuse_ino_t ino, FileHandle *fh, fuse_file_info *fi) {
+  if (!m_passthrough.active()) {
+    return;
+  }
+  std::string path{m_passthrough.matches_paths() ? path_of(ino) : std::string{}};
+  if (m_passthrough.wants(path.c_str(), fh->fd)) {
+    m_passthrough.open(fuse_session_fd(m_session), fh, fi);
+  }
+}
+
+void IOFSLowLevel::read(fuse_req_t req, [[maybe_unused]] fuse_ino_t ino, size_t size, off_t offset,
+                        fuse_file_info *fi) {
+#ifdef IOFS_WITH_IO_URING
+  if (m_uring && m_uring->read(req, get_file_handle(fi), size, offset)) {
+    return;
+  }
+#endif
+  // Reused per worker thread, as libfuse does for its own request buffers
+  thread_local std::vector<char> buf;
+  if (buf.size() < size) {
+    buf.resize(size);
+  }
+  ssize_t res;
+  int err{0};
+  {
+    TimerGuard timer{IOOp::read, 0};
+    FileHandle *fh{get_file_handle(fi)};
+    timer.set_file(fh->id, offset);
+    res = ::pread(fh->fd, buf.data(), size, offset);
+    if (res == -1) {
+      err = errno;
+    } else {
+      fh->account_read(offset, static_cast<size_t>(res));
+      timer.update_size(static_cast<size_t>(res));
+    }
+  }
+  if (err) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  fuse_reply_buf(req, buf.data(), static_cast<size_t>(res));
+}
+
+void IOFSLowLevel::write(fuse_req_t req, [[maybe_unused]] fuse_ino_t ino, const char *buf, size_t size,
+                         off_t offset, fuse_file_info *fi) {
+#ifdef IOFS_WITH_IO_URING
+  if (m_uring && m_uring->write(req, get_file_handle(fi), buf, size, offset)) {
+    return;
+  }
+#endif
+  ssize_t res;
+  int err{0};
+  {
+    TimerGuard timer{IOOp::write, 0};
+    FileHandle *fh{get_file_handle(fi)};
+    timer.set_file(fh->id, offset);
+    res = ::pwrite(fh->fd, buf, size, offset);
+    if (res == -1) {
+      err = errno;
+    } else {
+      fh->account_write(offset, static_cast<size_t>(res));
+      timer.update_size(static_cast<size_t>(res));
+    }
+  }
+  if (err) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  fuse_reply_write(req, static_cast<size_t>(res));
+}
+
+void IOFSLowLevel::flush(fuse_req_t req, [[maybe_unused]] fuse_ino_t ino, fuse_file_info *fi) {
+  int err{0};
+  {
+    TimerGuard timer{IOOp::flush};
+    // See `IOFS::flush`
+    if (::close(::dup(get_fd(fi))) == -1) {
+      err = errno;
+    }
+  }
+  fuse_reply_err(req, err);
+}
+
+void IOFSLowLevel::release(fuse_req_t req, [[maybe_unused]] fuse_ino_t ino, fuse_file_info *fi) {
+  {
+    FileHandle *fh{get_file_handle(fi)};
+    TimerGuard::set_caller(fh->opener);
+    TimerGuard timer{IOOp::release};
+    timer.set_file(fh->id);
+    m_passthrough.release(fuse_session_fd(m_session), fh);
+    ::close(fh->fd);
+    m_file_handles.destroy(fh);
+  }
+  fuse_reply_err(req, 0);
+}
+
+void IOFSLowLevel::fsync(fuse_req_t req, [[maybe_unused]] fuse_ino_t ino, int datasync, fuse_file_info *fi) {
+#ifdef IOFS_WITH_IO_URING
+  if (m_uring && m_uring->fsync(req, get_file_handle(fi), datasync != 0)) {
+    return;
+  }
+#endif
+  int err{0};
+  {
+    TimerGuard timer{IOOp::fsync};
+    int fd{get_fd(fi)};
+    if ((datasync ? ::fdatasync(fd) : ::fsync(fd)) == -1) {
+      err = errno;
+    }
+  }
+  fuse_reply_err(req, err);
+}
+
+void IOFSLowLevel::opendir(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi) {
+  std::unique_ptr<DirHandle> d{std::make_unique<DirHandle>()};
+  int err{0};
+  {
+    TimerGuard timer{IOOp::opendir};
+    int fd{::openat(get_inode(ino).fd, ".", O_RDONLY | O_DIRECTORY)};
+    if (fd != -1) {
+      d->dp = ::fdopendir(fd);
+      if (!d->dp) {
+        err = errno;
+        ::close(fd);
+      }
+    } else {
+      err = errno;
+    }
+  }
+  if (err) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  // Give ownership to FUSE (taking it back at releasedir)
+  fi->fh = reinterpret_cast<uint64_t>(d.release());
+  fuse_reply_open(req, fi);
+}
+
+static bool is_dot_or_dotdot(const char *name) {
+  return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+// Same offset bookkeeping as `IOFS::readdir`, but filling the reply buffer ourselves
+void IOFSLowLevel::do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, fuse_file_info *fi,
+                              bool plus) {
+  DirHandle *d{get_dir_handle(fi)};
+  std::vector<char> buf(size);
+  size_t used{0};
+  int err{0};
+
+  {
+    TimerGuard timer{IOOp::readdir};
+    if (offset != d->offset) {
+      ::seekdir(d->dp, offset);
+      d->entry = nullptr;
+      d->offset = offset;
+    }
+
+    while (true) {
+      if (!d->entry) {
+        errno = 0;
+        d->entry = ::readdir(d->dp);
+        if (!d->entry) {
+          err = errno;  // 0 at end of directory
+          break;
+        }
+      }
+
+      off_t nextoff{::telldir(d->dp)};
+      const char *name{d->entry->d_name};
+      size_t entsize;
+      if (plus) {
+        fuse_entry_param e{};
+        if (is_dot_or_dotdot(name)) {
+          // Not looked up, the kernel does not take a reference on these
+          e.attr.st_ino = d->entry->d_ino;
+          e.attr.st_mode = static_cast<mode_t>(d->entry->d_type << 12);
+        } else {
+          err = do_lookup(ino, name, &e);
+          if (err) {
+            break;
+          }
+        }
+        entsize = fuse_add_direntry_plus(req, buf.data() + used, size - used, name, &e, nextoff);
+        if (entsize > size - used) {
+          // Did not fit, so the kernel never sees this lookup
+          if (e.ino) {
+            forget_one(e.ino, 1);
+          }
+          break;
+        }
+      } else {
+        struct stat st{};
+        st.st_ino = d->entry->d_ino;
+        st.st_mode = static_cast<mode_t>(d->entry->d_type << 12);
+        entsize = fuse_add_direntry(req, buf.data() + used, size - used, name, &st, nextoff);
+        if (entsize > size - used) {
+          break;
+        }
+      }
+      used += entsize;
+
+      // prepare for next entry
+      d->entry = nullptr;
+      d->offset = nextoff;
+    }
+  }
+
+  // Errors are only reported if nothing was filled yet, otherwise the kernel would lose the entries
+  if (err && used == 0) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  fuse_reply_buf(req, buf.data(), used);
+}
+
+void IOFSLowLevel::readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, fuse_file_info *fi) {
+  do_readdir(req, ino, size, offset, fi, false);
+}
+
+void IOFSLowLevel::readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, fuse_file_info *fi) {
+  do_readdir(req, ino, size, offset, fi, true);
+}
+
+void IOFSLowLevel::releasedir(fuse_req_t req, [[maybe_unused]] fuse_ino_t ino, fuse_file_info *fi) {
+  {
+    TimerGuard timer{IOOp::releasedir};
+    // re-take ownership (released in opendir) to get RAII cleanup
+    std::unique_ptr<DirHandle> d{get_dir_handle(fi)};
+  }
+  fuse_reply_err(req, 0);
+}
+
+void IOFSLowLevel::statfs(fuse_req_t req, fuse_ino_t ino) {
+  struct statvfs st{};
+  int err{0};
+  {
+    TimerGuard timer{IOOp::statfs};
+    if (::fstatvfs(get_inode(ino).fd, &st) == -1) {
+      err = errno;
+    }
+  }
+  if (err) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  fuse_reply_statfs(req, &st);
+}
+
+// There is no race-free way to reach the xattrs of a symlink through an `O_PATH` fd (the magic link would be
+// followed), so they are reported as unsupported.
+void IOFSLowLevel::setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size,
+                            int flags) {
+  Inode &inode{get_inode(ino)};
+  int err{0};
+  {
+    TimerGuard timer{IOOp::setxattr};
+    if (inode.is_symlink) {
+      err = ENOTSUP;
+    } else if (::setxattr(ProcPath{inode.fd}.c_str(), name, value, size, flags) == -1) {
+      err = errno;
+    }
+  }
+  fuse_reply_err(req, err);
+}
+
+void IOFSLowLevel::getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
+  Inode &inode{get_inode(ino)};
+  std::vector<char> value(size);
+  ssize_t res{-1};
+  int err{0};
+  {
+    TimerGuard timer{IOOp::getxattr};
+    if (inode.is_symlink) {
+      err = ENOTSUP;
+    } else {
+      res = ::getxattr(ProcPath{inode.fd}.c_str(), name, value.data(), size);
+      if (res == -1) {
+        err = errno;
+      }
+    }
+  }
+  if (err) {
+    fuse_reply_err(req, err);
+  } else if (size == 0) {
+    fuse_reply_xattr(req, static_cast<size_t>(res));
+  } else {
+    fuse_reply_buf(req, value.data(), static_cast<size_t>(res));
+  }
+}
+
+void IOFSLowLevel::listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+  Inode &inode{get_inode(ino)};
+  std::vector<char> list(size);
+  ssize_t res{-1};
+  int err{0};
+  {
+    TimerGuard timer{IOOp::listxattr};
+    if (inode.is_symlink) {
+      err = ENOTSUP;
+    } else {
+      res = ::listxattr(ProcPath{inode.fd}.c_str(), list.data(), size);
+      if (res == -1) {
+        err = errno;
+      }
+    }
+  }
+  if (err) {
+    fuse_reply_err(req, err);
+  } else if (size == 0) {
+    fuse_reply_xattr(req, static_cast<size_t>(res));
+  } else {
+    fuse_reply_buf(req, list.data(), static_cast<size_t>(res));
+  }
+}
+
+void IOFSLowLevel::removexattr(fuse_req_t req, fuse_ino_t ino, const char *name) {
+  Inode &inode{get_inode(ino)};
+  int err{0};
+  {
+    TimerGuard timer{IOOp::removexattr};
+    if (inode.is_symlink) {
+      err = ENOTSUP;
+    } else if (::removexattr(ProcPath{inode.fd}.c_str(), name) == -1) {
+      err = errno;
+    }
+  }
+  fuse_reply_err(req, err);
+}
+
+void IOFSLowLevel::access(fuse_req_t req, fuse_ino_t ino, int mask) {
+  int err{0};
+  {
+    TimerGuard timer{IOOp::access};
+    if (::access(ProcPath{get_inode(ino).fd}.c_str(), mask) == -1) {
+      err = errno;
+    }
+  }
+  fuse_reply_err(req, err);
+}
+
+void IOFSLowLevel::flock(fuse_req_t req, [[maybe_unused]] fuse_ino_t ino, fuse_file_info *fi, int op) {
+  int err{0};
+  {
+    TimerGuard timer{IOOp::flock};
+    if (::flock(get_fd(fi), op) == -1) {
+      err = errno;
+    }
+  }
+  fuse_reply_err(req, err);
+}
+
+void IOFSLowLevel::fallocate(fuse_req_t req, [[maybe_unused]] fuse_ino_t ino, int mode, off_t offset, off_t length,
+                             fuse_file_info *fi) {
+  if (mode) {
+    fuse_reply_err(req, EOPNOTSUPP);
+    return;
+  }
+  int err;
+  {
+    TimerGuard timer{IOOp::fallocate};
+    FileHandle *fh{get_file_handle(fi)};
+    err = ::posix_fallocate(fh->fd, offset, length);
+    if (err == 0) {
+      fh->grow_size(offset + length);
+    }
+  }
+  fuse_reply_err(req, err);
+}
+
+// Unlike `IOFS::read_buf`, the splice happens within the reply here, so it is part of the measured duration
+template <ZeroCopyReport Mode>
+void IOFSLowLevel::read_buf(fuse_req_t req, [[maybe_unused]] fuse_ino_t ino, size_t size, off_t offset,
+                            fuse_file_info *fi) {
+  FileHandle *fh{get_file_handle(fi)};
+  size_t reported{zero_copy_read_size<Mode>(fh, size, offset)};
+  TimerGuard timer{IOOp::read_buf, reported};
+  timer.set_file(fh->id, offset);
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#pragma GCC diagnostic ignored "-Wpedantic"
+  struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+#pragma GCC diagnostic pop
+
+  src.buf[0].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+  src.buf[0].fd = fh->fd;
+  src.buf[0].pos = offset;
+  int res{fuse_reply_data(req, &src, FUSE_BUF_SPLICE_MOVE)};
+  // `fuse_reply_data` only tells us whether the reply went out; if it did not, nothing was transferred
+  if constexpr (Mode == ZeroCopyReport::accurate) {
+    if (res != 0) {
+      reported = 0;
+      timer.update_size(0);
+    }
+  }
+  fh->account_read(offset, Mode == ZeroCopyReport::accurate ? reported : size);
+}
+
+template <ZeroCopyReport Mode>
+void IOFSLowLevel::write_buf(fuse_req_t req, [[maybe_unused]] fuse_ino_t ino, fuse_bufvec *bufv, off_t offset,
+                             fuse_file_info *fi) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#pragma GCC diagnostic ignored "-Wpedantic"
+  size_t requested_size{fuse_buf_size(bufv)};
+  struct fuse_bufvec dst = FUSE_BUFVEC_INIT(requested_size);
+#pragma GCC diagnostic pop
+
+  FileHandle *fh{get_file_handle(fi)};
+  dst.buf[0].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+  dst.buf[0].fd = fh->fd;
+  dst.buf[0].pos = offset;
+
+  ssize_t res;
+  {
+    TimerGuard timer{IOOp::write_buf, zero_copy_write_size<Mode>(requested_size)};
+    timer.set_file(fh->id, offset);
+    res = fuse_buf_copy(&dst, bufv, FUSE_BUF_SPLICE_NONBLOCK);
+    if constexpr (Mode == ZeroCopyReport::accurate) {
+      timer.update_size(res > 0 ? static_cast<size_t>(res) : 0);
+    }
+  }
+  if (res < 0) {
+    fuse_reply_err(req, static_cast<int>(-res));
+    return;
+  }
+  fh->account_write(offset, static_cast<size_t>(res));
+  fuse_reply_write(req, static_cast<size_t>(res));
+}
+
+// Instantiate every mode; `main` picks one at startup
+#define IOFS_LL_INSTANTIATE_ZERO_COPY(mode)                                                                       \
+  template void IOFSLowLevel::read_buf<mode>(fuse_req_t, fuse_ino_t, size_t, off_t, fuse_file_info *);            \
+  template void IOFSLowLevel::write_buf<mode>(fuse_req_t, fuse_ino_t, fuse_bufvec *, off_t, fuse_file_info *);
+IOFS_LL_INSTANTIATE_ZERO_COPY(ZeroCopyReport::none)
+IOFS_LL_INSTANTIATE_ZERO_COPY(ZeroCopyReport::under)
+IOFS_LL_INSTANTIATE_ZERO_COPY(ZeroCopyReport::over)
+IOFS_LL_INSTANTIATE_ZERO_COPY(ZeroCopyReport::accurate)
+#undef IOFS_LL_INSTANTIATE_ZERO_COPY
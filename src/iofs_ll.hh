@@ -0,0 +1,133 @@
+#pragma once
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define FUSE_USE_VERSION 36
+#include <fuse_lowlevel.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "handles.hh"
+#include "invalidator.hh"
+#include "iofs.hh"
+#include "mount_options.hh"
+#include "object_pool.hh"
+#include "passthrough.hh"
+#include "uring_engine.hh"
+
+// Inode-based backend on top of the libfuse low-level API.
+//
+// The high-level API hands every op a full path which libfuse rebuilt from its node tree, and which `IOFS` then has to
+// concatenate and resolve again. Here, every inode the kernel knows about keeps an `O_PATH` fd to its source file, so
+// each op is a single `*at()` syscall relative to that fd.
+//
+// Instrumentation is the same as in `IOFS`; `lookup` is recorded as `getattr`, since that is what the high-level API
+// calls for it. See `fuse_lowlevel_ops` for a description of the operations.
+class IOFSLowLevel {
+ public:
+  explicit IOFSLowLevel(const std::filesystem::path &root, const MountOptions &options = {});
+  ~IOFSLowLevel();
+  IOFSLowLevel(const IOFSLowLevel &) = delete;
+  IOFSLowLevel &operator=(const IOFSLowLevel &) = delete;
+
+  // The session is needed to send invalidations, set it before the loop starts
+  void set_session(fuse_session *se);
+
+  void init(fuse_conn_info *conn);
+  void destroy();
+  void lookup(fuse_req_t req, fuse_ino_t parent, const char *name);
+  void forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup);
+  void forget_multi(fuse_req_t req, size_t count, fuse_forget_data *forgets);
+  void getattr(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi);
+  void setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, fuse_file_info *fi);
+  void readlink(fuse_req_t req, fuse_ino_t ino);
+  void mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode);
+  void unlink(fuse_req_t req, fuse_ino_t parent, const char *name);
+  void rmdir(fuse_req_t req, fuse_ino_t parent, const char *name);
+  void symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name);
+  void rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname,
+              unsigned int flags);
+  void link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname);
+  void open(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi);
+  void read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, fuse_file_info *fi);
+  void write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset, fuse_file_info *fi);
+  void flush(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi);
+  void release(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi);
+  void fsync(fuse_req_t req, fuse_ino_t ino, int datasync, fuse_file_info *fi);
+  void opendir(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi);
+  void readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, fuse_file_info *fi);
+  void readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, fuse_file_info *fi);
+  void releasedir(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi);
+  void statfs(fuse_req_t req, fuse_ino_t ino);
+  void setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags);
+  void getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size);
+  void listxattr(fuse_req_t req, fuse_ino_t ino, size_t size);
+  void removexattr(fuse_req_t req, fuse_ino_t ino, const char *name);
+  void access(fuse_req_t req, fuse_ino_t ino, int mask);
+  void create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, fuse_file_info *fi);
+  void flock(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi, int op);
+  void fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, fuse_file_info *fi);
+  // Zero-copy replacements for `read`/`write`, see `ZeroCopyReport`
+  template <ZeroCopyReport Mode>
+  void read_buf(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, fuse_file_info *fi);
+  template <ZeroCopyReport Mode>
+  void write_buf(fuse_req_t req, fuse_ino_t ino, fuse_bufvec *bufv, off_t offset, fuse_file_info *fi);
+
+ private:
+  struct Inode {
+    int fd{-1};  // O_PATH, never used for I/O directly
+    dev_t src_dev{0};
+    ino_t src_ino{0};
+    bool is_symlink{false};
+    // All guarded by `m_mutex`. The directory and name it was last looked up or renamed as, only needed to give
+    // `Passthrough` a path; a hard link goes by whichever name came last. Holds a lookup of `parent`.
+    uint64_t nlookup{0};
+    Inode *parent{nullptr};
+    std::string name;
+    ~Inode();
+  };
+
+  struct SourceId {
+    dev_t dev;
+    ino_t ino;
+    bool operator==(const SourceId &) const = default;
+  };
+  struct SourceIdHash {
+    size_t operator()(const SourceId &id) const noexcept { return std::hash<ino_t>{}(id.ino) ^ (id.dev << 1); }
+  };
+
+  Inode &get_inode(fuse_ino_t ino);
+  fuse_ino_t ino_of(const Inode &inode) const;
+  int do_lookup(fuse_ino_t parent, const char *name, fuse_entry_param *e);
+  void forget_one(fuse_ino_t ino, uint64_t nlookup);
+  void unref(Inode *inode, uint64_t nlookup);
+  void set_parent(Inode &inode, Inode &parent, std::string_view name);
+  void renamed(fuse_ino_t parent, const char *name);
+  std::string path_of(fuse_ino_t ino);
+  void do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, fuse_file_info *fi, bool plus);
+
+  MountOptions m_options;
+  bool m_writeback{false};  // Set in `init`, see `writeback_open_flags`
+  fuse_session *m_session{nullptr};
+  // Namespace ops invalidate the directories they touched. Hard links share one inode here, so attribute changes
+  // need no invalidation at all.
+  Invalidator m_invalidator;
+  Passthrough m_passthrough;
+  void maybe_passthrough(fuse_ino_t ino, FileHandle *fh, fuse_file_info *fi);
+#ifdef IOFS_WITH_IO_URING
+  std::unique_ptr<UringEngine> m_uring;
+#endif
+
+  ObjectPool<FileHandle> m_file_handles;
+
+  Inode *m_root{nullptr};
+  std::mutex m_mutex;
+  std::unordered_map<SourceId, std::unique_ptr<Inode>, SourceIdHash> m_inodes;
+};
@@ -9,8 +9,12 @@
 
 #define FUSE_USE_VERSION 36
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 
 #include "iofs.hh"
+#include "iofs_ll.hh"
+#include "session_loop.hh"
+#include "workers.hh"
 
 namespace fs = std::filesystem;
 
@@ -18,7 +22,17 @@ struct CliArgs {
   bool use_allow_other{false};
   bool use_foreground{false};
   bool use_debug{false};
+  std::string backend{"highlevel"};
+  std::string zero_copy{"off"};
+  std::string io_engine{"sync"};
+  std::string profile{"standard"};
+  std::string dispatch{"sync"};
+  std::string ring_full{"drop"};
+  MountOptions mount;
+  LoopOptions loop;
+  DispatchOptions dispatch_options;
   std::vector<std::string> plugins;
+  int control_port{0};
 
   // positional args
   fs::path mountpoint;
@@ -35,7 +49,80 @@ CliArgs parse_args(int argc, char **argv) {
   app.add_flag("-f,--foreground", args.use_foreground, "Stay in foreground");
   app.add_flag("-d,--debug", args.use_debug, "Show FUSE debug logs");
 
-  app.add_option("-p,--plugin", args.plugins, "Path to a plugin .so file. Can be specified multiple times.");
+  app.add_option("-b,--backend", args.backend,
+                 "FUSE API to mount with: path-based `highlevel` or inode-based `lowlevel`")
+      ->check(CLI::IsMember({"highlevel", "lowlevel"}))
+      ->capture_default_str();
+
+  app.add_option("-z,--zero-copy", args.zero_copy,
+                 "Use splice-based read_buf/write_buf and report their sizes as `none`, `under`, `over` or "
+                 "`accurate` (see `ZeroCopyReport`)")
+      ->check(CLI::IsMember({"off", "none", "under", "over", "accurate"}))
+      ->capture_default_str();
+
+  app.add_option("--io-engine", args.io_engine,
+                 "How the low-level backend does read/write/fsync: blocking `sync` syscalls, or asynchronously "
+                 "through `uring`")
+      ->check(CLI::IsMember({"sync", "uring"}))
+      ->capture_default_str();
+  app.add_option("--uring-depth", args.mount.uring_depth, "Submission queue depth of the io_uring engine")
+      ->default_val(256)
+      ->check(CLI::Range(1u, 32768u));
+
+  app.add_option("--passthrough", args.mount.passthrough.patterns,
+                 "Let the kernel do the I/O of files matching this glob (e.g. '/ckpt/*') directly on the source "
+                 "file; only open/release and a per-session summary are recorded. Can be specified multiple times.");
+  app.add_option("--passthrough-min-size", args.mount.passthrough.min_size,
+                 "Also pass through files at least this many bytes large when opened");
+
+  app.add_option("-P,--profile", args.profile,
+                 "Kernel capabilities to negotiate: `standard` (libfuse defaults), `throughput` (1 MiB requests, "
+                 "splice, writeback cache), `metadata` (parallel dirops, readdirplus) or `strict` (no readahead or "
+                 "writeback, ops map directly to syscalls)")
+      ->check(CLI::IsMember({"standard", "throughput", "metadata", "strict"}))
+      ->capture_default_str();
+
+  app.add_option("--attr-timeout", args.mount.attr_timeout, "Seconds the kernel may cache file attributes")
+      ->check(CLI::NonNegativeNumber)
+      ->capture_default_str();
+  app.add_option("--entry-timeout", args.mount.entry_timeout, "Seconds the kernel may cache name lookups")
+      ->check(CLI::NonNegativeNumber)
+      ->capture_default_str();
+  app.add_option("--negative-timeout", args.mount.negative_timeout,
+                 "Seconds the kernel may cache failed name lookups")
+      ->check(CLI::NonNegativeNumber)
+      ->capture_default_str();
+  app.add_flag("--invalidate", args.mount.invalidate,
+               "Invalidate kernel caches after our own namespace ops, so long timeouts stay consistent");
+
+  app.add_option("-w,--workers", args.loop.workers, "Number of FUSE worker threads, kept alive while idle")
+      ->check(CLI::Range(1u, 4096u))
+      ->capture_default_str();
+  app.add_flag("--clone-fd", args.loop.clone_fd, "Give each worker its own /dev/fuse fd");
+  app.add_flag("--pin-cpus", args.loop.pin_cpus, "Pin each worker to a single CPU");
+  app.add_flag("--worker-stats", args.loop.worker_stats, "Export busy time and op counts per worker");
+
+  app.add_option("-p,--plugin", args.plugins,
+                 "Path to a plugin .so file, optionally followed by `:` and its configuration, e.g. "
+                 "'stats.so:ops=read,write;buckets=log2/4'. Can be specified multiple times.");
+  app.add_option("--control", args.control_port,
+                 "Port on 127.0.0.1 for loading (POST /plugins?path=...) and unloading (DELETE) plugins while "
+                 "mounted, and for plugin commands (POST /plugins/command?path=...&command=...); off by default")
+      ->check(CLI::Range(1, 65535));
+  app.add_option("--dispatch", args.dispatch,
+                 "Call the plugins directly from each op (`sync`), or queue the measurements in per-worker rings "
+                 "drained by a background thread (`async`)")
+      ->check(CLI::IsMember({"sync", "async"}))
+      ->capture_default_str();
+  app.add_option("--ring-size", args.dispatch_options.ring_size,
+                 "Measurements each worker can queue in async mode, rounded up to a power of two")
+      ->check(CLI::Range(size_t{2}, size_t{1} << 24))
+      ->capture_default_str();
+  app.add_option("--ring-full", args.ring_full,
+                 "What to do when a worker's ring is full: `drop` the measurement (counted), `block` until there is "
+                 "room, or record it `inline` like in sync mode")
+      ->check(CLI::IsMember({"drop", "block", "inline"}))
+      ->capture_default_str();
 
   app.add_option("mountpoint", args.mountpoint, "FUSE mountpoint")->required()->check(CLI::ExistingDirectory);
   app.add_option("source", args.source_dir, "Source directory")->required()->check(CLI::ExistingDirectory);
@@ -45,11 +132,38 @@ CliArgs parse_args(int argc, char **argv) {
   } catch (const CLI::ParseError &e) {
     std::exit(app.exit(e));
   }
+  args.mount.profile = parse_capability_profile(args.profile);
+  args.dispatch_options.async = args.dispatch == "async";
+  if (args.ring_full == "block") {
+    args.dispatch_options.on_full = RingFullPolicy::block;
+  } else if (args.ring_full == "inline") {
+    args.dispatch_options.on_full = RingFullPolicy::inline_;
+  }
+
+  if (args.io_engine == "uring") {
+#ifndef IOFS_WITH_IO_URING
+    std::println(stderr, "--io-engine uring: iofs-ng was built without liburing");
+    std::exit(1);
+#endif
+    // The high-level API has to return the result from the op itself, and zero-copy replaces `read`/`write`
+    if (args.backend != "lowlevel" || args.zero_copy != "off") {
+      std::println(stderr, "--io-engine uring requires --backend lowlevel and no --zero-copy");
+      std::exit(1);
+    }
+  } else {
+    args.mount.uring_depth = 0;
+  }
 
   return args;
 }
 
-static IOFS *get_fs() { return static_cast<IOFS *>(fuse_get_context()->private_data); }
+// Every request goes through here, so this is where `TimerGuard` learns its caller
+static IOFS *get_fs() {
+  fuse_context *ctx{fuse_get_context()};
+  TimerGuard::set_caller({static_cast<uint32_t>(ctx->uid), static_cast<uint32_t>(ctx->gid),
+                          static_cast<uint32_t>(ctx->pid)});
+  return static_cast<IOFS *>(ctx->private_data);
+}
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wmissing-field-initializers"
@@ -90,15 +204,128 @@ struct fuse_operations iofs_oper = {
 // .bmap    = nullptr,
 // .ioctl   = nullptr,
 // .poll    = nullptr,
-#ifdef USE_ZERO_COPY
-    .write_buf = [](auto... args) { return get_fs()->write_buf(args...); },
-    .read_buf = [](auto... args) { return get_fs()->read_buf(args...); },
-#endif
+// .write_buf/.read_buf are set at startup, see `enable_zero_copy`
     .flock = [](auto... args) { return get_fs()->flock(args...); },
     .fallocate = [](auto... args) { return get_fs()->fallocate(args...); },
 };
+
+// See `get_fs`
+static IOFSLowLevel *get_ll(fuse_req_t req) {
+  const fuse_ctx *ctx{fuse_req_ctx(req)};
+  TimerGuard::set_caller({static_cast<uint32_t>(ctx->uid), static_cast<uint32_t>(ctx->gid),
+                          static_cast<uint32_t>(ctx->pid)});
+  return static_cast<IOFSLowLevel *>(fuse_req_userdata(req));
+}
+
+struct fuse_lowlevel_ops iofs_ll_oper = {
+    .init = [](void *userdata, fuse_conn_info *conn) { static_cast<IOFSLowLevel *>(userdata)->init(conn); },
+    .destroy = [](void *userdata) { static_cast<IOFSLowLevel *>(userdata)->destroy(); },
+    .lookup = [](fuse_req_t req, auto... args) { get_ll(req)->lookup(req, args...); },
+    .forget = [](fuse_req_t req, auto... args) { get_ll(req)->forget(req, args...); },
+    .getattr = [](fuse_req_t req, auto... args) { get_ll(req)->getattr(req, args...); },
+    .setattr = [](fuse_req_t req, auto... args) { get_ll(req)->setattr(req, args...); },
+    .readlink = [](fuse_req_t req, auto... args) { get_ll(req)->readlink(req, args...); },
+    // .mknod   = nullptr,
+    .mkdir = [](fuse_req_t req, auto... args) { get_ll(req)->mkdir(req, args...); },
+    .unlink = [](fuse_req_t req, auto... args) { get_ll(req)->unlink(req, args...); },
+    .rmdir = [](fuse_req_t req, auto... args) { get_ll(req)->rmdir(req, args...); },
+    .symlink = [](fuse_req_t req, auto... args) { get_ll(req)->symlink(req, args...); },
+    .rename = [](fuse_req_t req, auto... args) { get_ll(req)->rename(req, args...); },
+    .link = [](fuse_req_t req, auto... args) { get_ll(req)->link(req, args...); },
+    .open = [](fuse_req_t req, auto... args) { get_ll(req)->open(req, args...); },
+    .read = [](fuse_req_t req, auto... args) { get_ll(req)->read(req, args...); },
+    .write = [](fuse_req_t req, auto... args) { get_ll(req)->write(req, args...); },
+    .flush = [](fuse_req_t req, auto... args) { get_ll(req)->flush(req, args...); },
+    .release = [](fuse_req_t req, auto... args) { get_ll(req)->release(req, args...); },
+    .fsync = [](fuse_req_t req, auto... args) { get_ll(req)->fsync(req, args...); },
+    .opendir = [](fuse_req_t req, auto... args) { get_ll(req)->opendir(req, args...); },
+    .readdir = [](fuse_req_t req, auto... args) { get_ll(req)->readdir(req, args...); },
+    .releasedir = [](fuse_req_t req, auto... args) { get_ll(req)->releasedir(req, args...); },
+    // .fsyncdir = nullptr,
+    .statfs = [](fuse_req_t req, auto... args) { get_ll(req)->statfs(req, args...); },
+    .setxattr = [](fuse_req_t req, auto... args) { get_ll(req)->setxattr(req, args...); },
+    .getxattr = [](fuse_req_t req, auto... args) { get_ll(req)->getxattr(req, args...); },
+    .listxattr = [](fuse_req_t req, auto... args) { get_ll(req)->listxattr(req, args...); },
+    .removexattr = [](fuse_req_t req, auto... args) { get_ll(req)->removexattr(req, args...); },
+    .access = [](fuse_req_t req, auto... args) { get_ll(req)->access(req, args...); },
+    .create = [](fuse_req_t req, auto... args) { get_ll(req)->create(req, args...); },
+    .forget_multi = [](fuse_req_t req, auto... args) { get_ll(req)->forget_multi(req, args...); },
+    .flock = [](fuse_req_t req, auto... args) { get_ll(req)->flock(req, args...); },
+    .fallocate = [](fuse_req_t req, auto... args) { get_ll(req)->fallocate(req, args...); },
+    .readdirplus = [](fuse_req_t req, auto... args) { get_ll(req)->readdirplus(req, args...); },
+};
 #pragma GCC diagnostic pop
 
+// Registers the splice-based ops in both operation tables, specialized for the chosen reporting mode
+template <ZeroCopyReport Mode>
+static void enable_zero_copy() {
+  iofs_oper.write_buf = [](auto... args) { return get_fs()->write_buf<Mode>(args...); };
+  iofs_oper.read_buf = [](auto... args) { return get_fs()->read_buf<Mode>(args...); };
+  iofs_ll_oper.write_buf = [](fuse_req_t req, auto... args) { get_ll(req)->write_buf<Mode>(req, args...); };
+  iofs_ll_oper.read = [](fuse_req_t req, auto... args) { get_ll(req)->read_buf<Mode>(req, args...); };
+}
+
+// Runs the session loop of either backend, with plugin dispatch and control around it
+static int run_session(fuse_session *se, const CliArgs &arguments) {
+  // Threads do not survive `fuse_daemonize`, so the dispatch consumer and control server are only started now
+  Monitoring::instance().start_dispatch(arguments.dispatch_options);
+  if (arguments.control_port != 0) {
+    Monitoring::instance().start_control_server(arguments.control_port);
+  }
+  int ret{run_session_loop(se, arguments.loop)};
+  Monitoring::instance().flush();
+  return ret;
+}
+
+// What `fuse_main` would do, but with our own session loop
+static int run_highlevel(const CliArgs &arguments, std::vector<char *> &fuse_argv, const std::string &mountpoint) {
+  IOFS fs_instance{fs::canonical(arguments.source_dir), arguments.mount};
+
+  fuse_args args = FUSE_ARGS_INIT(static_cast<int>(fuse_argv.size()), fuse_argv.data());
+
+  fuse *f{fuse_new(&args, &iofs_oper, sizeof(iofs_oper), &fs_instance)};
+  if (!f) {
+    return 1;
+  }
+  int ret{1};
+  if (fuse_mount(f, mountpoint.c_str()) == 0) {
+    fuse_session *se{fuse_get_session(f)};
+    if (fuse_set_signal_handlers(se) == 0) {
+      // Like `fuse_main`, debug output implies staying in the foreground
+      fuse_daemonize(arguments.use_foreground || arguments.use_debug ? 1 : 0);
+      // `fuse_loop_mt` only adds the cache cleanup thread for `remember`, which we do not use
+      ret = run_session(se, arguments);
+      fuse_remove_signal_handlers(se);
+    }
+    fuse_unmount(f);
+  }
+  fuse_destroy(f);
+  return ret;
+}
+
+static int run_lowlevel(const CliArgs &arguments, std::vector<char *> &fuse_argv, const std::string &mountpoint) {
+  IOFSLowLevel ll_instance{fs::canonical(arguments.source_dir), arguments.mount};
+
+  fuse_args args = FUSE_ARGS_INIT(static_cast<int>(fuse_argv.size()), fuse_argv.data());
+
+  fuse_session *se{fuse_session_new(&args, &iofs_ll_oper, sizeof(iofs_ll_oper), &ll_instance)};
+  if (!se) {
+    return 1;
+  }
+  ll_instance.set_session(se);
+  int ret{1};
+  if (fuse_set_signal_handlers(se) == 0) {
+    if (fuse_session_mount(se, mountpoint.c_str()) == 0) {
+      fuse_daemonize(arguments.use_foreground || arguments.use_debug ? 1 : 0);
+      ret = run_session(se, arguments);
+      fuse_session_unmount(se);
+    }
+    fuse_remove_signal_handlers(se);
+  }
+  fuse_session_destroy(se);
+  return ret;
+}
+
 int main(int argc, char **argv) {
   CliArgs arguments{parse_args(argc, argv)};
 
@@ -110,24 +337,31 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  IOFS fs_instance{fs::canonical(arguments.source_dir)};
+  if (arguments.zero_copy == "none") {
+    enable_zero_copy<ZeroCopyReport::none>();
+  } else if (arguments.zero_copy == "under") {
+    enable_zero_copy<ZeroCopyReport::under>();
+  } else if (arguments.zero_copy == "over") {
+    enable_zero_copy<ZeroCopyReport::over>();
+  } else if (arguments.zero_copy == "accurate") {
+    enable_zero_copy<ZeroCopyReport::accurate>();
+  }
+
+  Workers::instance().configure(arguments.loop);
+  Monitoring::instance().refresh_subscriptions();
 
   umask(0);
 
   std::string mountpoint_str = fs::canonical(arguments.mountpoint).string();
 
+  // Prepare FUSE arguments
   // They are stack-allocated as FUSE doesn't accept const char*
-  char arg_fg[] = "-f";
   char arg_dbg[] = "-d";
   char arg_opt_kern[] = "-o";
   char arg_opt_allow[] = "allow_other";
 
   std::vector<char *> fuse_args;
-  fuse_args.push_back(argv[0]);                // Program name
-  fuse_args.push_back(mountpoint_str.data());  // Mountpoint
-  if (arguments.use_foreground) {
-    fuse_args.push_back(arg_fg);
-  }
+  fuse_args.push_back(argv[0]);  // Program name
   if (arguments.use_debug) {
     fuse_args.push_back(arg_dbg);
   }
@@ -135,6 +369,13 @@ int main(int argc, char **argv) {
     fuse_args.push_back(arg_opt_kern);
     fuse_args.push_back(arg_opt_allow);
   }
-  int ret = fuse_main(static_cast<int>(fuse_args.size()), fuse_args.data(), &iofs_oper, &fs_instance);
-  return ret;
+  try {
+    if (arguments.backend == "lowlevel") {
+      return run_lowlevel(arguments, fuse_args, mountpoint_str);
+    }
+    return run_highlevel(arguments, fuse_args, mountpoint_str);
+  } catch (const std::exception &e) {
+    std::println(stderr, "Fatal error: {}", e.what());
+    return 1;
+  }
 }
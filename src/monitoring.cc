@@ -1,13 +1,23 @@
 #include "monitoring.hh"
 
+#include <algorithm>
+#include <bit>
+#include <iterator>
 #include <sstream>
+#include <stdexcept>
 #include <thread>
 #include <print>
 #include <unistd.h>
 
 #include "config.hh"
+#include "static_plugins.hh"
+#include "workers.hh"
 #include "../include/httplib.hh"
 
+// Plugins compiled in, empty unless selected at build time. Constructed before and thus destroyed after the
+// `Monitoring` singleton, whose dispatcher may still drain into them.
+static StaticPlugins g_static_plugins;
+
 Monitoring::Monitoring() {
   char buf[HOST_NAME_MAX + 1];
   if (gethostname(buf, sizeof(buf)) == 0) {
@@ -15,30 +25,188 @@ Monitoring::Monitoring() {
   } else {
     m_hostname = "COULD NOT BE FETCHED";
   }
+  m_plugins_owner = std::make_unique<const PluginSet>();
+  m_plugins.store(m_plugins_owner.get());
 }
 
-void Monitoring::load_plugins(const std::vector<std::string> &plugin_paths) {
-  m_plugins.reserve(plugin_paths.size());
-  for (const auto &path: plugin_paths) {
+void Monitoring::load_plugins(const std::vector<std::string> &plugin_specs) {
+  if (plugin_specs.size() > MAX_PLUGINS) {
+    throw std::runtime_error("At most " + std::to_string(MAX_PLUGINS) + " plugins can be loaded");
+  }
+  std::vector<std::shared_ptr<PluginInstance>> plugins;
+  for (const auto &spec: plugin_specs) {
+    auto [path, config]{split_plugin_spec(spec)};
     // throws
-    m_plugins.emplace_back(path);
+    plugins.push_back(std::make_shared<PluginInstance>(path, config));
+  }
+  std::lock_guard lock{m_update_mutex};
+  publish(std::move(plugins));
+}
+
+void Monitoring::load_plugin(const std::string &spec) {
+  // Loading may take a while, keep it out of the lock
+  auto [path, config]{split_plugin_spec(spec)};
+  auto plugin{std::make_shared<PluginInstance>(path, config)};
+  std::lock_guard lock{m_update_mutex};
+  auto plugins{m_plugins_owner->plugins};
+  if (plugins.size() == MAX_PLUGINS) {
+    throw std::runtime_error("At most " + std::to_string(MAX_PLUGINS) + " plugins can be loaded");
+  }
+  plugins.push_back(std::move(plugin));
+  publish(std::move(plugins));
+}
+
+void Monitoring::unload_plugin(const std::string &spec) {
+  const std::string path{split_plugin_spec(spec).first};
+  std::shared_ptr<PluginInstance> unloaded;
+  {
+    std::lock_guard lock{m_update_mutex};
+    auto plugins{m_plugins_owner->plugins};
+    auto it{std::ranges::find(plugins, path, [](const auto &plugin) { return plugin->path(); })};
+    if (it == plugins.end()) {
+      throw std::invalid_argument("No plugin loaded from " + path);
+    }
+    unloaded = std::move(*it);
+    plugins.erase(it);
+    publish(std::move(plugins));
+  }
+  // Queued events carry no plugin references, so once no reader holds the old set, this is the last one
+  std::println("Unloading plugin: {} from {}", unloaded->name(), path);
+}
+
+std::string Monitoring::plugin_command(const std::string &path, const std::string &command) {
+  std::shared_ptr<PluginInstance> plugin;
+  {
+    std::lock_guard lock{m_update_mutex};
+    const auto &plugins{m_plugins_owner->plugins};
+    auto it{std::ranges::find(plugins, path, [](const auto &p) { return p->path(); })};
+    if (it == plugins.end()) {
+      throw std::invalid_argument("No plugin loaded from " + path);
+    }
+    plugin = *it;
+  }
+  // Our reference keeps it loaded, even if it is unloaded meanwhile
+  return plugin->command(command);
+}
+
+void Monitoring::refresh_subscriptions() {
+  std::lock_guard lock{m_update_mutex};
+  const PluginSet &current{*m_plugins_owner};
+  bool changed{false};
+  for (size_t i{0}; i < current.plugins.size(); ++i) {
+    changed |= current.plugins[i]->subscriptions() != current.plugin_ops[i];
+  }
+  if (changed) {
+    publish(current.plugins);
+  } else {
+    // Worker stats may have changed, see `Workers::needs_timing`
+    iofs_op_mask_t timed{StaticPlugins::OPS | (Workers::instance().needs_timing() ? IOFS_OPS_ALL : 0)};
+    for (auto ops : current.plugin_ops) {
+      timed |= ops;
+    }
+    TimerGuard::set_timed_ops(timed);
+  }
+}
+
+void Monitoring::publish(std::vector<std::shared_ptr<PluginInstance>> plugins) {
+  auto set{std::make_unique<PluginSet>()};
+  iofs_op_mask_t timed{StaticPlugins::OPS | (Workers::instance().needs_timing() ? IOFS_OPS_ALL : 0)};
+  for (size_t i{0}; i < plugins.size(); ++i) {
+    iofs_op_mask_t ops{plugins[i]->subscriptions()};
+    set->plugin_ops.push_back(ops);
+    timed |= ops;
+    for (size_t op{0}; op < IO_OP_COUNT; ++op) {
+      if (ops & IOFS_OP_BIT(op)) {
+        set->subscribers[op] |= uint64_t{1} << i;
+      }
+    }
+  }
+  set->plugins = std::move(plugins);
+
+  // Ops newly subscribed to have to be timed before anyone can look for them, the others may stop afterwards
+  TimerGuard::set_timed_ops(timed | TimerGuard::timed_ops());
+  m_plugins.store(set.get(), std::memory_order_seq_cst);
+  m_rcu.synchronize();
+  m_plugins_owner = std::move(set);
+  TimerGuard::set_timed_ops(timed);
+}
+
+void Monitoring::record(const IoEvent &event) {
+  {
+    auto guard{m_rcu.read()};
+    const PluginSet &set{*m_plugins.load(std::memory_order_acquire)};
+    uint64_t subscribers{set.subscribers[static_cast<size_t>(event.op)]};
+    if (subscribers == 0 && (StaticPlugins::OPS & IOFS_OP_BIT(static_cast<size_t>(event.op))) == 0) {
+      return;
+    }
+    if (!m_dispatcher) {
+      g_static_plugins.record(event);
+      for (; subscribers != 0; subscribers &= subscribers - 1) {
+        set.plugins[static_cast<size_t>(std::countr_zero(subscribers))]->record(event);
+      }
+      return;
+    }
+  }
+  // Outside of the guard: `push` may wait for the consumer to drain a full ring, which would hold up `publish` in
+  // `synchronize`, and deadlock it with a consumer taking its first guard. `deliver` takes its own.
+  m_dispatcher->push(event);
+}
+
+void Monitoring::start_dispatch(const DispatchOptions &options) {
+  if (!options.async) {
+    return;
   }
+  m_dispatcher = std::make_unique<AsyncDispatcher>(options, [this](std::span<const IoEvent> events) {
+    deliver(events);
+  });
 }
 
-void Monitoring::record(IOOp op, uint64_t duration_ns, uint64_t units) {
-  // Cast C++ enum to C-ABI enum
-  iofs_op_t c_op{static_cast<iofs_op_t>(op)};
-  for (auto& plugin : m_plugins) {
-    plugin->record(c_op, duration_ns, units);
+void Monitoring::flush() {
+  if (m_dispatcher) {
+    m_dispatcher->stop();
   }
 }
 
+void Monitoring::deliver(std::span<const IoEvent> events) {
+  iofs_op_mask_t batch_ops{0};
+  for (const auto &event : events) {
+    batch_ops |= IOFS_OP_BIT(event.op);
+  }
+  // Plugins that only want part of the batch get a filtered copy
+  auto filter{[batch_ops](iofs_op_mask_t ops, std::span<const IoEvent> batch, auto &&deliver_to) {
+    if ((batch_ops & ~ops) == 0) {
+      deliver_to(batch);
+    } else if ((batch_ops & ops) != 0) {
+      thread_local std::vector<IoEvent> filtered;
+      filtered.clear();
+      std::ranges::copy_if(batch, std::back_inserter(filtered),
+                           [ops](const IoEvent &event) { return (ops & IOFS_OP_BIT(event.op)) != 0; });
+      deliver_to(std::span<const IoEvent>{filtered});
+    }
+  }};
+  g_static_plugins.record_batch(events, filter);
+  auto guard{m_rcu.read()};
+  const PluginSet &set{*m_plugins.load(std::memory_order_acquire)};
+  for (size_t i{0}; i < set.plugins.size(); ++i) {
+    filter(set.plugin_ops[i], events,
+           [&plugin = *set.plugins[i]](std::span<const IoEvent> subset) { plugin.record_batch(subset); });
+  }
+}
+
+void Monitoring::set_connection(CapabilityProfile profile, const fuse_conn_info &conn) {
+  m_profile = profile;
+  m_conn = conn;
+  m_has_connection = true;
+}
+
 void Monitoring::start_server(int port) {
   std::thread([port]() {
     httplib::Server svr;
 
     svr.Get("/metrics", [](const httplib::Request &, httplib::Response &res) {
-      res.set_content(Monitoring::instance().generate_prometheus_output(), "text/plain");
+      Monitoring &monitoring{Monitoring::instance()};
+      res.set_content(monitoring.generate_prometheus_output(), "text/plain");
+      monitoring.refresh_subscriptions();
     });
 
     std::println("Starting Prometheus metrics server on port {}", port);
@@ -48,8 +216,70 @@ void Monitoring::start_server(int port) {
   }).detach();
 }
 
+void Monitoring::start_control_server(int port) {
+  std::thread([port]() {
+    httplib::Server svr;
+
+    // The plugin to (un)load is given as `?path=`, exactly as it would be passed to `--plugin` (including its
+    // configuration, which unloading ignores)
+    svr.Get("/plugins", [](const httplib::Request &, httplib::Response &res) {
+      res.set_content(Monitoring::instance().list_plugins(), "text/plain");
+    });
+    svr.Post("/plugins", [](const httplib::Request &req, httplib::Response &res) {
+      try {
+        Monitoring::instance().load_plugin(req.get_param_value("path"));
+        res.status = 201;
+      } catch (const std::exception &e) {
+        res.status = 400;
+        res.set_content(std::string{e.what()} + '\n', "text/plain");
+      }
+    });
+    // Commands for a single plugin, e.g. `?path=/path/to/lastn.so&command=dump`
+    svr.Post("/plugins/command", [](const httplib::Request &req, httplib::Response &res) {
+      try {
+        std::string reply{
+            Monitoring::instance().plugin_command(req.get_param_value("path"), req.get_param_value("command"))};
+        res.set_content(reply + '\n', "text/plain");
+      } catch (const std::invalid_argument &e) {
+        res.status = 404;
+        res.set_content(std::string{e.what()} + '\n', "text/plain");
+      } catch (const std::exception &e) {
+        res.status = 400;
+        res.set_content(std::string{e.what()} + '\n', "text/plain");
+      }
+    });
+    svr.Delete("/plugins", [](const httplib::Request &req, httplib::Response &res) {
+      try {
+        Monitoring::instance().unload_plugin(req.get_param_value("path"));
+        res.status = 204;
+      } catch (const std::exception &e) {
+        res.status = 404;
+        res.set_content(std::string{e.what()} + '\n', "text/plain");
+      }
+    });
+
+    // Loading a plugin runs arbitrary code, so never listen on anything but loopback
+    std::println("Starting plugin control server on 127.0.0.1:{}", port);
+    if (!svr.listen("127.0.0.1", port)) {
+      std::println(stderr, "Failed to start plugin control server on port {}", port);
+    }
+  }).detach();
+}
+
+std::string Monitoring::list_plugins() const {
+  std::lock_guard lock{m_update_mutex};
+  std::string out;
+  for (const auto &plugin : m_plugins_owner->plugins) {
+    out += plugin->path() + '\t' + plugin->name() + '\t' + plugin->version() + '\t' + plugin->config() + '\n';
+  }
+  return out;
+}
+
 std::string Monitoring::generate_prometheus_output() const {
   std::stringstream ss;
+  // Delays unloading until the scrape is done
+  auto guard{m_rcu.read()};
+  const PluginSet &set{*m_plugins.load(std::memory_order_acquire)};
 
   // meta informations
   ss << "# HELP application_info Static information about the running binary.\n";
@@ -61,15 +291,52 @@ std::string Monitoring::generate_prometheus_output() const {
   // plugin info
   ss << "# HELP exporter_plugin_info Information about loaded plugins.\n";
   ss << "# TYPE exporter_plugin_info gauge\n";
-  for (const auto& plugin : m_plugins) {
-    ss << "exporter_plugin_info{name=\"" << plugin->get_name()
-       << "\",version=\"" << plugin->get_version() << "\"} 1\n";
+  for (const auto& plugin : set.plugins) {
+    ss << "exporter_plugin_info{name=\"" << plugin->name()
+       << "\",version=\"" << plugin->version() << "\",linkage=\"dynamic\"} 1\n";
+  }
+  g_static_plugins.write_info(ss);
+
+  // negotiated FUSE connection
+  if (m_has_connection) {
+    ss << "# HELP iofs_fuse_connection_info Capability profile and FUSE protocol version of the mount.\n";
+    ss << "# TYPE iofs_fuse_connection_info gauge\n";
+    ss << "iofs_fuse_connection_info{profile=\"" << to_string(m_profile) << "\",proto=\"" << m_conn.proto_major
+       << "." << m_conn.proto_minor << "\"} 1\n";
+
+    auto gauge{[&ss](std::string_view name, std::string_view help, uint32_t value) {
+      ss << "# HELP " << name << ' ' << help << '\n';
+      ss << "# TYPE " << name << " gauge\n";
+      ss << name << ' ' << value << '\n';
+    }};
+    gauge("iofs_fuse_max_write_bytes", "Negotiated maximum size of a single write request.", m_conn.max_write);
+    gauge("iofs_fuse_max_read_bytes", "Negotiated maximum size of a single read request, 0 if unlimited.",
+          m_conn.max_read);
+    gauge("iofs_fuse_max_readahead_bytes", "Negotiated maximum readahead.", m_conn.max_readahead);
+    gauge("iofs_fuse_max_background", "Maximum number of pending background requests.", m_conn.max_background);
+    gauge("iofs_fuse_congestion_threshold", "Pending background requests at which the kernel reports congestion.",
+          m_conn.congestion_threshold);
+
+    ss << "# HELP iofs_fuse_capability Kernel capabilities, offered (capable) and enabled (wanted).\n";
+    ss << "# TYPE iofs_fuse_capability gauge\n";
+    for (const auto &[flag, name] : CAPABILITY_NAMES) {
+      ss << "iofs_fuse_capability{name=\"" << name << "\",state=\"capable\"} " << ((m_conn.capable & flag) ? 1 : 0)
+         << '\n';
+      ss << "iofs_fuse_capability{name=\"" << name << "\",state=\"wanted\"} " << ((m_conn.want & flag) ? 1 : 0)
+         << '\n';
+    }
+  }
+
+  Workers::instance().write_prometheus(ss);
+  if (m_dispatcher) {
+    m_dispatcher->write_prometheus(ss);
   }
 
   thread_local auto buffer{std::make_unique<char []>(PLUGIN_BUFFER_BYTES)};
-  for (auto& plugin : m_plugins) {
-    if (plugin.api()->poll_prometheus_metrics) {
-      size_t written{plugin->poll_prometheus_metrics(buffer.get(), PLUGIN_BUFFER_BYTES)};
+  g_static_plugins.write_prometheus(ss, buffer.get(), PLUGIN_BUFFER_BYTES);
+  for (const auto& plugin : set.plugins) {
+    if (plugin->has_metrics()) {
+      size_t written{plugin->poll_metrics(buffer.get(), PLUGIN_BUFFER_BYTES)};
       if (written > 0 && written < PLUGIN_BUFFER_BYTES) {
         ss << '\n' << std::string_view(buffer.get(), written);
       }
@@ -1,11 +1,22 @@
 #pragma once
 
+#include "capabilities.hh"
+#include "dispatcher.hh"
 #include "iofs.hh"
 #include "plugin_wrapper.hh"
+#include "rcu.hh"
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <span>
 #include <string>
+#include <vector>
 
 // Automatically determine size based on the synthetic 'last' enum
 constexpr size_t IO_OP_COUNT = static_cast<size_t>(IOOp::last);
+// Subscribers of an op are kept as a bitmask over the plugin indices
+constexpr size_t MAX_PLUGINS = 64;
 
 class Monitoring {
 public:
@@ -15,15 +26,57 @@ public:
     return inst;
   }
 
-  void load_plugins(const std::vector<std::string> &plugin_paths);
-  void record(IOOp op, uint64_t duration_ns, uint64_t units);
+  // Plugins are given as `path[:config]`, see `split_plugin_spec`
+  void load_plugins(const std::vector<std::string> &plugin_specs);
+  // Loads/unloads a plugin while mounted. `unload_plugin` only returns once no op is inside the plugin anymore, and
+  // then destroys it; it only looks at the path. Both throw on failure.
+  void load_plugin(const std::string &spec);
+  void unload_plugin(const std::string &spec);
+  // Passes `command` to the plugin loaded from `path`, see `PluginInstance::command`. Throws `std::invalid_argument`
+  // if there is none.
+  std::string plugin_command(const std::string &path, const std::string &command);
+  void record(const IoEvent &event);
+  // Switches `record` to asynchronous delivery if `options.async`, see `AsyncDispatcher`. Starts a thread, so call it
+  // after daemonizing and before the session loop.
+  void start_dispatch(const DispatchOptions &options);
+  // Delivers all queued events; call once the session loop has returned
+  void flush();
+  // Re-reads the op subscriptions of all plugins, see `IofsPluginV2::subscriptions`. Called after loading and after
+  // every scrape; main calls it once more after `Workers::configure`, since worker stats need every op timed.
+  void refresh_subscriptions();
   void start_server(int port);
+  // Plugin management over HTTP, only reachable from this host. Starts a thread, so call it after daemonizing.
+  void start_control_server(int port);
+  // Exports what `init` negotiated with the kernel. Must be called before `start_server`.
+  void set_connection(CapabilityProfile profile, const fuse_conn_info &conn);
 
 private:
   Monitoring();
 
+  // The loaded plugins together with their subscriptions. Never modified once published; any change, including
+  // changed subscriptions, publishes a new one.
+  struct PluginSet {
+    std::vector<std::shared_ptr<PluginInstance>> plugins;
+    std::vector<iofs_op_mask_t> plugin_ops;           // Per plugin, which ops it wants
+    std::array<uint64_t, IO_OP_COUNT> subscribers{};  // Per op, which plugins want it
+  };
+
   std::string generate_prometheus_output() const;
+  void deliver(std::span<const IoEvent> events);
+  std::string list_plugins() const;
+  // Swaps in a new set for `plugins`, waits for readers of the old one and frees it. Requires `m_update_mutex`.
+  void publish(std::vector<std::shared_ptr<PluginInstance>> plugins);
 
   std::string m_hostname;
-  std::vector<PluginInstance> m_plugins;
+  // Read under `m_rcu`, replaced under `m_update_mutex`
+  mutable Rcu m_rcu;
+  std::atomic<const PluginSet *> m_plugins{nullptr};
+  std::unique_ptr<const PluginSet> m_plugins_owner;
+  mutable std::mutex m_update_mutex;
+  // Declared after `m_plugins`, so it is drained before they are destroyed
+  std::unique_ptr<AsyncDispatcher> m_dispatcher;
+
+  bool m_has_connection{false};
+  CapabilityProfile m_profile{CapabilityProfile::standard};
+  fuse_conn_info m_conn{};
 };
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "capabilities.hh"
+#include "passthrough.hh"
+
+// Per-mount settings from the command line that the backends need. Shared by both backends.
+struct MountOptions {
+  CapabilityProfile profile{CapabilityProfile::standard};
+
+  // How long the kernel may cache attributes, positive and negative lookups, in seconds. The first two default to
+  // what libfuse uses, negative lookups are not cached by default.
+  double attr_timeout{1.0};
+  double entry_timeout{1.0};
+  double negative_timeout{0.0};
+  // Invalidate the kernel caches after our own namespace ops, see `Invalidator`
+  bool invalidate{false};
+
+  // Low-level only: submit read/write/fsync to an io_uring of this depth, see `UringEngine`. 0 keeps them synchronous.
+  unsigned int uring_depth{0};
+
+  PassthroughOptions passthrough;
+};
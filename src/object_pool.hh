@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Pool for fixed-size objects with a short, frequent lifetime (e.g. one per `open`/`release`).
+//
+// Slots are carved out of chunks which are only returned to the OS when the pool is destroyed. Freed slots go onto an
+// intrusive free list, so in steady state `create`/`destroy` is a short critical section plus a pointer swap instead
+// of a trip through malloc.
+template <typename T, size_t ChunkSize = 256>
+class ObjectPool {
+ public:
+  ObjectPool() = default;
+  ObjectPool(const ObjectPool &) = delete;
+  ObjectPool &operator=(const ObjectPool &) = delete;
+
+  template <typename... Args>
+  T *create(Args &&...args) {
+    Slot *slot;
+    {
+      std::lock_guard lock{m_mutex};
+      if (!m_free) {
+        grow();
+      }
+      slot = m_free;
+      m_free = slot->next;
+    }
+    return ::new (slot->storage) T(std::forward<Args>(args)...);
+  }
+
+  void destroy(T *obj) {
+    obj->~T();
+    Slot *slot{reinterpret_cast<Slot *>(obj)};
+    std::lock_guard lock{m_mutex};
+    slot->next = m_free;
+    m_free = slot;
+  }
+
+ private:
+  union Slot {
+    Slot *next;
+    alignas(T) std::byte storage[sizeof(T)];
+  };
+
+  // Must be called with `m_mutex` held
+  void grow() {
+    auto chunk{std::make_unique<Slot[]>(ChunkSize)};
+    for (size_t i = 0; i < ChunkSize; ++i) {
+      chunk[i].next = (i + 1 < ChunkSize) ? &chunk[i + 1] : m_free;
+    }
+    m_free = &chunk[0];
+    m_chunks.push_back(std::move(chunk));
+  }
+
+  std::mutex m_mutex;
+  Slot *m_free{nullptr};
+  std::vector<std::unique_ptr<Slot[]>> m_chunks;
+};
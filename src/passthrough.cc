@@ -0,0 +1,106 @@
+#include "passthrough.hh"
+
+#include <fnmatch.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include <chrono>
+#include <print>
+
+#include "monitoring.hh"
+
+bool Passthrough::negotiate([[maybe_unused]] fuse_conn_info *conn) {
+#ifdef IOFS_HAVE_PASSTHROUGH
+  if (!m_options.enabled()) {
+    return false;
+  }
+  if (!(conn->capable & FUSE_CAP_PASSTHROUGH)) {
+    std::println(stderr, "Kernel does not support FUSE passthrough, all I/O goes through the daemon");
+    return false;
+  }
+  conn->want |= FUSE_CAP_PASSTHROUGH;
+  conn->want &= ~uint32_t{FUSE_CAP_WRITEBACK_CACHE};
+  // Our backing files live on a regular filesystem, not on another FUSE mount
+  conn->max_backing_stack_depth = 1;
+  m_active = true;
+#else
+  if (m_options.enabled()) {
+    std::println(stderr, "iofs-ng was built without FUSE passthrough support, all I/O goes through the daemon");
+  }
+#endif
+  return m_active;
+}
+
+bool Passthrough::wants(const char *path, int fd) const {
+  if (!m_active) {
+    return false;
+  }
+  for (const auto &pattern : m_options.patterns) {
+    if (::fnmatch(pattern.c_str(), path, 0) == 0) {
+      return true;
+    }
+  }
+  if (m_options.min_size > 0) {
+    struct stat st{};
+    return ::fstat(fd, &st) == 0 && static_cast<uint64_t>(st.st_size) >= m_options.min_size;
+  }
+  return false;
+}
+
+void Passthrough::open([[maybe_unused]] int session_fd, [[maybe_unused]] FileHandle *fh,
+                       [[maybe_unused]] fuse_file_info *fi) {
+#ifdef IOFS_HAVE_PASSTHROUGH
+  fuse_backing_map map{};
+  map.fd = fh->fd;
+  int backing_id{::ioctl(session_fd, FUSE_DEV_IOC_BACKING_OPEN, &map)};
+  if (backing_id <= 0) {
+    return;
+  }
+  struct stat st{};
+  fh->size_at_open = (::fstat(fh->fd, &st) == 0) ? st.st_size : 0;
+  fh->backing_id = backing_id;
+  fh->writable = (fi->flags & O_ACCMODE) != O_RDONLY;
+  fi->backing_id = backing_id;
+  // libfuse only sets `FOPEN_PASSTHROUGH` with direct_io off
+  fi->direct_io = 0;
+#endif
+}
+
+void Passthrough::release([[maybe_unused]] int session_fd, FileHandle *fh) {
+  if (fh->backing_id <= 0) {
+    return;
+  }
+  auto duration{FileHandle::clock_type::now() - fh->opened_at};
+  auto dur_ns{static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count())};
+
+  struct stat st{};
+  off_t size{(::fstat(fh->fd, &st) == 0) ? st.st_size : fh->size_at_open};
+  // `release` has no caller of its own, see `FileHandle::opener`
+  const Caller &caller{fh->opener};
+  auto record{[&](iofs_op_t op, off_t bytes) {
+    Monitoring::instance().record({
+        .op = op,
+        .duration_ns = dur_ns,
+        .units = static_cast<uint64_t>(bytes),
+        .offset = 0,
+        .file_id = fh->id,
+        .uid = caller.uid,
+        .gid = caller.gid,
+        .pid = caller.pid,
+    });
+  }};
+  if (fh->writable) {
+    off_t growth{size - fh->size_at_open};
+    if (growth > 0) {
+      record(IOFS_OP_PASSTHROUGH_WRITE, growth);
+    }
+  } else if (size > 0) {
+    record(IOFS_OP_PASSTHROUGH_READ, size);
+  }
+
+#ifdef IOFS_HAVE_PASSTHROUGH
+  auto backing_id{static_cast<uint32_t>(fh->backing_id)};
+  ::ioctl(session_fd, FUSE_DEV_IOC_BACKING_CLOSE, &backing_id);
+#endif
+  fh->backing_id = 0;
+}
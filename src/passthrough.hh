@@ -0,0 +1,58 @@
+#pragma once
+
+#define FUSE_USE_VERSION 36
+#include <fuse_common.h>
+#include <linux/fuse.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "handles.hh"
+
+// FUSE passthrough needs libfuse >= 3.16 and kernel >= 6.9 headers; without them, `--passthrough*` is a no-op
+#if defined(FUSE_CAP_PASSTHROUGH) && defined(FUSE_DEV_IOC_BACKING_OPEN)
+#define IOFS_HAVE_PASSTHROUGH
+#endif
+
+struct PassthroughOptions {
+  // `fnmatch` patterns, matched against the path below the mount root (e.g. "/ckpt/*" or "*.h5")
+  std::vector<std::string> patterns;
+  // Files at least this large at `open` are passed through as well; 0 disables the threshold
+  uint64_t min_size{0};
+
+  bool enabled() const { return !patterns.empty() || min_size > 0; }
+};
+
+// Passthrough lets the kernel do reads and writes directly on our backing fd, so they never reach the daemon. Shared
+// by both backends.
+//
+// Since we do not see the individual requests anymore, `release` records a single summary instead:
+// `passthrough_read`/`passthrough_write` with the duration of the whole open-release session and a byte estimate.
+// - Writers report how much the file grew, i.e. exact for the typical append-only checkpoint, but overwrites of
+//   existing data are not counted.
+// - Readers report the file size, i.e. an upper bound that assumes the file was read once in full.
+class Passthrough {
+ public:
+  explicit Passthrough(PassthroughOptions options) : m_options{std::move(options)} {}
+
+  // Requests the capability in `init`. Passthrough excludes the writeback cache, which is dropped if needed.
+  // Returns whether passthrough is usable on this connection.
+  bool negotiate(fuse_conn_info *conn);
+  bool active() const { return m_active; }
+
+  // Whether `wants` looks at the path at all, i.e. there are patterns
+  bool matches_paths() const { return !m_options.patterns.empty(); }
+  // Whether a freshly opened file should be passed through. `path` is relative to the mount root; any string if
+  // `matches_paths()` is false.
+  bool wants(const char *path, int fd) const;
+
+  // Registers `fh->fd` as backing file of the open in `fi`. On failure, the file just goes through the daemon.
+  void open(int session_fd, FileHandle *fh, fuse_file_info *fi);
+  // Records the summary (see above) and unregisters the backing file
+  void release(int session_fd, FileHandle *fh);
+
+ private:
+  PassthroughOptions m_options;
+  bool m_active{false};
+};
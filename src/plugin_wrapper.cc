@@ -1,35 +1,120 @@
 #include "plugin_wrapper.hh"
 #include <print>
 
-PluginInstance::PluginInstance(const std::string &path) {
+std::pair<std::string, std::string> split_plugin_spec(std::string_view spec) {
+  size_t colon{spec.find(':')};
+  if (colon == std::string_view::npos) {
+    return {std::string{spec}, {}};
+  }
+  return {std::string{spec.substr(0, colon)}, std::string{spec.substr(colon + 1)}};
+}
+
+PluginInstance::PluginInstance(const std::string &path, const std::string &config) : m_path{path}, m_config{config} {
   void *handle{dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL)};
   if (!handle) {
     throw std::runtime_error("Failed to load plugin " + path + ": " + dlerror());
   }
   m_lib.reset(handle);
 
-  auto get_plugin_fn{reinterpret_cast<struct IofsPlugin *(*)()>(dlsym(handle, "get_iofs_plugin"))};
-  if (!get_plugin_fn) {
-    throw std::runtime_error("Missing symbol 'get_iofs_plugin' in " + path);
-  }
+  // Prefer v2, fall back to v1
+  auto get_plugin_v2_fn{reinterpret_cast<struct IofsPluginV2 *(*)()>(dlsym(handle, "get_iofs_plugin_v2"))};
+  if (get_plugin_v2_fn) {
+    m_api_v2 = get_plugin_v2_fn();
+    if (!validate_iofs_plugin_v2(m_api_v2)) {
+      throw std::runtime_error("Plugin API validation failed (or version mismatch) for " + path);
+    }
+    if (m_api_v2->abi_version >= 5) {
+      m_record_event = m_api_v2->record_event;
+    }
+    m_ctx = m_api_v2->init(config.empty() ? nullptr : config.c_str());
+    if (!m_ctx) {
+      throw std::runtime_error("Plugin " + path + " rejected its configuration '" + config + "'");
+    }
+  } else {
+    auto get_plugin_fn{reinterpret_cast<struct IofsPlugin *(*)()>(dlsym(handle, "get_iofs_plugin"))};
+    if (!get_plugin_fn) {
+      throw std::runtime_error("Missing symbol 'get_iofs_plugin_v2' or 'get_iofs_plugin' in " + path);
+    }
 
-  m_api = get_plugin_fn();
-  if (!validate_iofs_plugin(m_api)) {
-    throw std::runtime_error("Plugin API validation failed (or version mismatch) for " + path);
+    m_api = get_plugin_fn();
+    if (!validate_iofs_plugin(m_api)) {
+      throw std::runtime_error("Plugin API validation failed (or version mismatch) for " + path);
+    }
+    if (!config.empty()) {
+      throw std::runtime_error("Plugin " + path + " uses ABI v1, which takes no configuration");
+    }
+    m_ctx = m_api->init();
   }
 
-  // Initialize the plugin and store its context
-  m_ctx = m_api->init();
-
-  std::println("Loaded plugin: {} (v{}) from {}", m_api->get_name(), m_api->get_version(), path);
+  std::println("Loaded plugin: {} (v{}, ABI v{}) from {}", name(), version(), m_api_v2 ? m_api_v2->abi_version : 1, path);
 }
 
 PluginInstance::~PluginInstance() {
-  if (m_api && m_api->destroy) {
+  if (m_api_v2) {
+    m_api_v2->destroy(m_ctx);
+  } else if (m_api && m_api->destroy) {
     m_api->destroy(m_ctx);
   }
 }
 
+const char *PluginInstance::name() const {
+  return m_api_v2 ? m_api_v2->get_name() : m_api->get_name();
+}
+
+const char *PluginInstance::version() const {
+  return m_api_v2 ? m_api_v2->get_version() : m_api->get_version();
+}
+
+void PluginInstance::record_batch(std::span<const iofs_event> events) const {
+  if (m_api_v2) {
+    // Plugins built against an older `iofs_event` cannot walk our array
+    if (m_api_v2->record_batch && m_api_v2->event_size == sizeof(iofs_event)) {
+      m_api_v2->record_batch(m_ctx, events.data(), events.size());
+    } else {
+      for (const auto &event : events) {
+        record(event);
+      }
+    }
+    return;
+  }
+  // Bind once for the whole batch
+  auto bound{operator->()};
+  for (const auto &event : events) {
+    bound->record(event.op, event.duration_ns, event.units);
+  }
+}
+
+iofs_op_mask_t PluginInstance::subscriptions() const {
+  if (m_api_v2 && m_api_v2->subscriptions) {
+    return m_api_v2->subscriptions(m_ctx) & IOFS_OPS_ALL;
+  }
+  return m_api_v2 ? IOFS_OPS_ALL : IOFS_OPS_V1;
+}
+
+std::string PluginInstance::command(const std::string &command) const {
+  if (!m_api_v2 || m_api_v2->abi_version < 4 || !m_api_v2->command) {
+    throw std::runtime_error(std::string{name()} + " takes no commands");
+  }
+  char reply[1024]{};
+  int ret{m_api_v2->command(m_ctx, command.c_str(), reply, sizeof(reply))};
+  reply[sizeof(reply) - 1] = '\0';
+  if (ret != 0) {
+    throw std::runtime_error(std::string{name()} + ": " + reply);
+  }
+  return reply;
+}
+
+bool PluginInstance::has_metrics() const {
+  return m_api_v2 ? m_api_v2->poll_prometheus_metrics != nullptr : m_api->poll_prometheus_metrics != nullptr;
+}
+
+size_t PluginInstance::poll_metrics(char *buf, size_t buf_size) const {
+  if (m_api_v2) {
+    return m_api_v2->poll_prometheus_metrics(m_ctx, buf, buf_size);
+  }
+  return (*this)->poll_prometheus_metrics(buf, buf_size);
+}
+
 PluginInstance::ArrowChainProxy::ArrowChainProxy(struct IofsPlugin *a, void *ctx) : api{a} {
   api->bind(ctx);
 }
@@ -45,7 +130,3 @@ struct IofsPlugin *PluginInstance::ArrowChainProxy::operator->() {
 PluginInstance::ArrowChainProxy PluginInstance::operator->() const {
   return ArrowChainProxy(m_api, m_ctx);
 }
-
-struct IofsPlugin *PluginInstance::api() const {
-  return m_api;
-}
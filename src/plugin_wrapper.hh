@@ -3,7 +3,10 @@
 #include "../plugins/plugin.hh"
 #include <dlfcn.h>
 #include <memory>
+#include <span>
 #include <string>
+#include <string_view>
+#include <utility>
 
 // Compiler cries about ODR with lambda instanciations, but I really like it, and may need it for future projects
 // template <typename T, auto fn>
@@ -20,9 +23,15 @@ struct DlCloseDeleter {
 
 using LibHandle = std::unique_ptr<void, DlCloseDeleter>;
 
+// `--plugin` and the control server take `path[:config]`; the config is everything after the first `:`
+std::pair<std::string, std::string> split_plugin_spec(std::string_view spec);
+
+// A loaded plugin of either ABI version. v2 plugins are called directly with their context; v1 plugins get it bound
+// around every call through the proxy below.
 class PluginInstance {
 public:
-  explicit PluginInstance(const std::string &path);
+  // `config` is handed to the plugin's `init`, see `IofsPluginV2`. v1 plugins take none.
+  explicit PluginInstance(const std::string &path, const std::string &config = {});
 
   ~PluginInstance();
 
@@ -32,7 +41,35 @@ public:
   PluginInstance(const PluginInstance &) = delete;
   PluginInstance &operator=(const PluginInstance &) = delete;
 
-  // The Execute-Around Proxy
+  const std::string &path() const { return m_path; }
+  const std::string &config() const { return m_config; }
+  const char *name() const;
+  const char *version() const;
+
+  // Through `record_event` if the plugin wants whole events, see `IofsPluginV2`
+  void record(const iofs_event &event) const {
+    if (m_record_event) {
+      m_record_event(m_ctx, &event);
+    } else if (m_api_v2) [[likely]] {
+      m_api_v2->record(m_ctx, event.op, event.duration_ns, event.units);
+    } else {
+      (*this)->record(event.op, event.duration_ns, event.units);
+    }
+  }
+  void record_batch(std::span<const iofs_event> events) const;
+
+  // Ops the plugin wants to see, re-queried by `Monitoring::refresh_subscriptions`. v1 plugins get everything.
+  iofs_op_mask_t subscriptions() const;
+
+  // Runs a control command, see `IofsPluginV2::command`, and returns its reply. Throws `std::runtime_error` if the
+  // plugin does not take commands or the command failed.
+  std::string command(const std::string &command) const;
+
+  bool has_metrics() const;
+  size_t poll_metrics(char *buf, size_t buf_size) const;
+
+private:
+  // The Execute-Around Proxy, v1 only
   class ArrowChainProxy {
     struct IofsPlugin *api;
   public:
@@ -44,11 +81,11 @@ public:
   // Overload -> to return the Proxy temporary
   ArrowChainProxy operator->() const;
 
-  // Direct access for metadata (no context binding needed)
-  struct IofsPlugin *api() const;
-
-private:
+  std::string m_path;
+  std::string m_config;
   LibHandle m_lib;
   struct IofsPlugin *m_api{nullptr};
+  struct IofsPluginV2 *m_api_v2{nullptr};
+  void (*m_record_event)(void *, const struct iofs_event *){nullptr};  // v5+, resolved once
   void *m_ctx{nullptr};
 };
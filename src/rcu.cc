@@ -0,0 +1,67 @@
+#include "rcu.hh"
+
+#include <thread>
+
+struct Rcu::Lease {
+  Reader *reader{nullptr};
+  ~Lease() {
+    if (reader) {
+      reader->owner->release(*reader);
+    }
+  }
+};
+
+Rcu::ReadGuard::ReadGuard(Reader &reader) : m_reader{reader} {
+  if (m_reader.depth++ == 0) {
+    m_reader.epoch.store(m_reader.owner->m_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    // Pairs with the fence in `synchronize`: either the writer sees our epoch, or we see its new pointer
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+}
+
+Rcu::ReadGuard::~ReadGuard() {
+  if (--m_reader.depth == 0) {
+    m_reader.epoch.store(0, std::memory_order_release);
+  }
+}
+
+Rcu::Reader &Rcu::current() {
+  thread_local Lease lease;
+  if (!lease.reader || lease.reader->owner != this) {
+    std::lock_guard lock{m_mutex};
+    Reader *reader{nullptr};
+    for (auto &r : m_readers) {
+      if (!r.in_use) {
+        reader = &r;
+        break;
+      }
+    }
+    if (!reader) {
+      reader = &m_readers.emplace_back();
+    }
+    reader->owner = this;
+    reader->in_use = true;
+    lease.reader = reader;
+  }
+  return *lease.reader;
+}
+
+void Rcu::release(Reader &reader) {
+  std::lock_guard lock{m_mutex};
+  reader.in_use = false;
+}
+
+void Rcu::synchronize() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  uint64_t target{m_epoch.fetch_add(1, std::memory_order_seq_cst) + 1};
+  std::lock_guard lock{m_mutex};
+  for (const auto &reader : m_readers) {
+    for (;;) {
+      uint64_t epoch{reader.epoch.load(std::memory_order_acquire)};
+      if (epoch == 0 || epoch >= target) {
+        break;
+      }
+      std::this_thread::yield();
+    }
+  }
+}
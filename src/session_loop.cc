@@ -0,0 +1,17 @@
+#include "session_loop.hh"
+
+#define FUSE_USE_VERSION 312
+#include <fuse_lowlevel.h>
+
+int run_session_loop(fuse_session *se, const LoopOptions &options) {
+  fuse_loop_config *config{fuse_loop_cfg_create()};
+  if (!config) {
+    return 1;
+  }
+  fuse_loop_cfg_set_clone_fd(config, options.clone_fd ? 1 : 0);
+  fuse_loop_cfg_set_max_threads(config, options.workers);
+  fuse_loop_cfg_set_idle_threads(config, options.workers);
+  int ret{fuse_session_loop_mt(se, config)};
+  fuse_loop_cfg_destroy(config);
+  return ret;
+}
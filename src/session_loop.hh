@@ -0,0 +1,22 @@
+#pragma once
+
+struct fuse_session;
+
+// How `run_session_loop` drives the libfuse workers. Shared by both backends.
+struct LoopOptions {
+  // Worker threads handling requests. libfuse spawns them on demand up to this limit; they are all kept alive when
+  // idle, so bursts do not pay for thread creation.
+  unsigned int workers{10};
+  // Give every worker its own `/dev/fuse` fd instead of all of them contending for the session fd
+  bool clone_fd{false};
+  // Pin each worker to one CPU of our affinity mask, see `Workers`
+  bool pin_cpus{false};
+  // Export per-worker busy time and op counts, see `Workers`
+  bool worker_stats{false};
+};
+
+// Runs the multithreaded loop of a mounted session until it exits.
+//
+// This is the only translation unit that uses the libfuse 3.12 API, as the older `fuse_loop_config` can not limit
+// the number of workers. Everything else stays at `FUSE_USE_VERSION 36`.
+int run_session_loop(fuse_session *se, const LoopOptions &options);
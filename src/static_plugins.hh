@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <span>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+
+#include "../plugins/plugin.hh"
+#include "../plugins/plugin_helpers.hh"
+
+// Plugins compiled into the binary, selected at build time via `IOFS_STATIC_PLUGINS="stats lastn" ./build.sh`.
+//
+// The plugin classes in `plugins/<name>.hh` are used directly, without the C ABI glue of their `.so` builds, so
+// recording is a fold over the plugin types which the compiler can inline completely. Each plugin class provides
+// `NAME`, `VERSION`, `OPS` (everything it may subscribe to, see `IofsPluginV2`), `record` and `poll_metrics`,
+// optionally `record_event` and `record_batch` (see `plugin_helpers.hh`). Static plugins run with their default
+// configuration; load the `.so` to configure one. Dynamically loaded plugins can be used alongside.
+#ifdef IOFS_STATIC_PLUGIN_SAMPLE
+#include "../plugins/sample.hh"
+#endif
+#ifdef IOFS_STATIC_PLUGIN_LASTN
+#include "../plugins/lastn.hh"
+#endif
+#ifdef IOFS_STATIC_PLUGIN_STATS
+#include "../plugins/stats.hh"
+#endif
+#ifdef IOFS_STATIC_PLUGIN_SKETCH
+#include "../plugins/sketch.hh"
+#endif
+#ifdef IOFS_STATIC_PLUGIN_ACCESS
+#include "../plugins/access.hh"
+#endif
+#ifdef IOFS_STATIC_PLUGIN_ATTRIBUTION
+#include "../plugins/attribution.hh"
+#endif
+
+template <typename... Plugins>
+struct PluginList {};
+
+template <typename... A, typename... B>
+PluginList<A..., B...> operator+(PluginList<A...>, PluginList<B...>);
+
+template <typename List>
+class StaticPluginSet;
+
+template <typename... Plugins>
+class StaticPluginSet<PluginList<Plugins...>> {
+ public:
+  static constexpr size_t COUNT = sizeof...(Plugins);
+  // Union of all subscriptions
+  static constexpr iofs_op_mask_t OPS = (iofs_op_mask_t{0} | ... | Plugins::OPS);
+
+  void record(const iofs_event &event) {
+    std::apply(
+        [&](auto &...plugin) {
+          ((subscribed<decltype(plugin)>(event.op) ? plugin_record(plugin, event) : void()), ...);
+        },
+        m_plugins);
+  }
+
+  // `filter(ops, events, fn)` calls `fn` with the events out of `events` whose op is in `ops`, see `Monitoring`
+  template <typename Filter>
+  void record_batch(std::span<const iofs_event> events, Filter &&filter) {
+    std::apply(
+        [&](auto &...plugin) {
+          (filter(std::remove_cvref_t<decltype(plugin)>::OPS, events,
+                  [&plugin](std::span<const iofs_event> subset) {
+                    plugin_record_batch(plugin, subset.data(), subset.size());
+                  }),
+           ...);
+        },
+        m_plugins);
+  }
+
+  void write_info(std::ostream &os) const {
+    ((os << "exporter_plugin_info{name=\"" << Plugins::NAME << "\",version=\"" << Plugins::VERSION
+         << "\",linkage=\"static\"} 1\n"),
+     ...);
+  }
+
+  void write_prometheus(std::ostream &os, char *buf, size_t buf_size) {
+    std::apply(
+        [&](auto &...plugin) {
+          (write_one(os, plugin.poll_metrics(buf, buf_size), buf, buf_size), ...);
+        },
+        m_plugins);
+  }
+
+ private:
+  template <typename Plugin>
+  static bool subscribed(iofs_op_t op) {
+    return (std::remove_cvref_t<Plugin>::OPS & IOFS_OP_BIT(op)) != 0;
+  }
+
+  static void write_one(std::ostream &os, size_t written, const char *buf, size_t buf_size) {
+    if (written > 0 && written < buf_size) {
+      os << '\n' << std::string_view(buf, written);
+    }
+  }
+
+  std::tuple<Plugins...> m_plugins;
+};
+
+using StaticPlugins = StaticPluginSet<decltype(PluginList<>{}
+#ifdef IOFS_STATIC_PLUGIN_SAMPLE
+                                               + PluginList<SamplePlugin>{}
+#endif
+#ifdef IOFS_STATIC_PLUGIN_LASTN
+                                               + PluginList<LastNPlugin>{}
+#endif
+#ifdef IOFS_STATIC_PLUGIN_STATS
+                                               + PluginList<StatsPlugin>{}
+#endif
+#ifdef IOFS_STATIC_PLUGIN_SKETCH
+                                               + PluginList<SketchPlugin>{}
+#endif
+#ifdef IOFS_STATIC_PLUGIN_ACCESS
+                                               + PluginList<AccessPatternPlugin>{}
+#endif
+#ifdef IOFS_STATIC_PLUGIN_ATTRIBUTION
+                                               + PluginList<AttributionPlugin>{}
+#endif
+                                               )>;
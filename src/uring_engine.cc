@@ -0,0 +1,169 @@
+#ifdef IOFS_WITH_IO_URING
+
+#include "uring_engine.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <system_error>
+
+enum class UringKind { read, write, fsync };
+
+struct UringEngine::Request {
+  fuse_req_t req;
+  FileHandle *fh;
+  off_t offset;
+  UringKind kind;
+  std::unique_ptr<char[]> buf;
+  TimerGuard timer;
+
+  Request(fuse_req_t req_, FileHandle *fh_, off_t offset_, UringKind kind_, IOOp op, size_t buf_size)
+      : req{req_}, fh{fh_}, offset{offset_}, kind{kind_}, buf{buf_size ? new char[buf_size] : nullptr}, timer{op, 0} {
+    // The worker is free as soon as the request is queued
+    timer.detach_worker();
+    timer.set_file(fh->id, offset);
+  }
+};
+
+UringEngine::UringEngine(unsigned int depth) {
+  int ret{io_uring_queue_init(depth, &m_ring, 0)};
+  if (ret < 0) {
+    throw std::system_error(-ret, std::generic_category(), "Failed to set up io_uring");
+  }
+  m_completer = std::thread{[this] { run(); }};
+}
+
+UringEngine::~UringEngine() {
+  stop();
+  io_uring_queue_exit(&m_ring);
+}
+
+void UringEngine::stop() {
+  if (!m_completer.joinable()) {
+    return;
+  }
+  {
+    // A NOP without a request tells the completion thread to finish once nothing is in flight anymore
+    std::lock_guard lock{m_submit_mutex};
+    io_uring_sqe *sqe{get_sqe()};
+    while (!sqe) {
+      std::this_thread::yield();
+      sqe = get_sqe();
+    }
+    io_uring_prep_nop(sqe);
+    io_uring_sqe_set_data(sqe, nullptr);
+    io_uring_submit(&m_ring);
+  }
+  m_completer.join();
+}
+
+// Expects `m_submit_mutex` to be held
+io_uring_sqe *UringEngine::get_sqe() {
+  io_uring_sqe *sqe{io_uring_get_sqe(&m_ring)};
+  if (!sqe) {
+    // Flush what is queued and try again
+    io_uring_submit(&m_ring);
+    sqe = io_uring_get_sqe(&m_ring);
+  }
+  return sqe;
+}
+
+// Expects `m_submit_mutex` to be held
+void UringEngine::submit(io_uring_sqe *sqe, Request *request) {
+  io_uring_sqe_set_data(sqe, request);
+  m_in_flight.fetch_add(1, std::memory_order_relaxed);
+  io_uring_submit(&m_ring);
+}
+
+bool UringEngine::read(fuse_req_t req, FileHandle *fh, size_t size, off_t offset) {
+  std::lock_guard lock{m_submit_mutex};
+  io_uring_sqe *sqe{get_sqe()};
+  if (!sqe) {
+    return false;
+  }
+  Request *request{m_requests.create(req, fh, offset, UringKind::read, IOOp::read, size)};
+  io_uring_prep_read(sqe, fh->fd, request->buf.get(), static_cast<unsigned int>(size), static_cast<uint64_t>(offset));
+  submit(sqe, request);
+  return true;
+}
+
+bool UringEngine::write(fuse_req_t req, FileHandle *fh, const char *buf, size_t size, off_t offset) {
+  std::lock_guard lock{m_submit_mutex};
+  io_uring_sqe *sqe{get_sqe()};
+  if (!sqe) {
+    return false;
+  }
+  // `buf` belongs to libfuse and is only valid until we return
+  Request *request{m_requests.create(req, fh, offset, UringKind::write, IOOp::write, size)};
+  std::copy_n(buf, size, request->buf.get());
+  io_uring_prep_write(sqe, fh->fd, request->buf.get(), static_cast<unsigned int>(size),
+                      static_cast<uint64_t>(offset));
+  submit(sqe, request);
+  return true;
+}
+
+bool UringEngine::fsync(fuse_req_t req, FileHandle *fh, bool datasync) {
+  std::lock_guard lock{m_submit_mutex};
+  io_uring_sqe *sqe{get_sqe()};
+  if (!sqe) {
+    return false;
+  }
+  Request *request{m_requests.create(req, fh, 0, UringKind::fsync, IOOp::fsync, size_t{0})};
+  // `fsync` is recorded with a size of 1, as in the synchronous path
+  request->timer.update_size(1);
+  io_uring_prep_fsync(sqe, fh->fd, datasync ? IORING_FSYNC_DATASYNC : 0);
+  submit(sqe, request);
+  return true;
+}
+
+void UringEngine::complete(Request &request, int res) {
+  if (res < 0) {
+    request.timer.update_size(0);
+    fuse_reply_err(request.req, -res);
+    return;
+  }
+  auto bytes{static_cast<size_t>(res)};
+  switch (request.kind) {
+    case UringKind::read:
+      request.fh->account_read(request.offset, bytes);
+      request.timer.update_size(bytes);
+      fuse_reply_buf(request.req, request.buf.get(), bytes);
+      break;
+    case UringKind::write:
+      request.fh->account_write(request.offset, bytes);
+      request.timer.update_size(bytes);
+      fuse_reply_write(request.req, bytes);
+      break;
+    case UringKind::fsync:
+      fuse_reply_err(request.req, 0);
+      break;
+  }
+}
+
+void UringEngine::run() {
+  bool stopping{false};
+  while (!stopping || m_in_flight.load(std::memory_order_relaxed) > 0) {
+    io_uring_cqe *cqe;
+    int ret{io_uring_wait_cqe(&m_ring, &cqe)};
+    if (ret == -EINTR) {
+      continue;
+    }
+    if (ret < 0) {
+      // Nothing we can recover from; the kernel will abort the outstanding requests on unmount
+      return;
+    }
+    auto *request{static_cast<Request *>(io_uring_cqe_get_data(cqe))};
+    int res{cqe->res};
+    io_uring_cqe_seen(&m_ring, cqe);
+
+    if (!request) {
+      stopping = true;
+      continue;
+    }
+    complete(*request, res);
+    // Destroying the request stops its timer
+    m_requests.destroy(request);
+    m_in_flight.fetch_sub(1, std::memory_order_relaxed);
+  }
+}
+
+#endif
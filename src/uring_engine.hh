@@ -0,0 +1,59 @@
+#pragma once
+
+#ifdef IOFS_WITH_IO_URING
+
+#define FUSE_USE_VERSION 36
+#include <fuse_lowlevel.h>
+#include <liburing.h>
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "handles.hh"
+#include "iofs.hh"
+#include "object_pool.hh"
+
+// Asynchronous data path for the low-level backend, selected via `--io-engine uring`.
+//
+// `read`, `write` and `fsync` are only submitted to the ring by the FUSE worker, which then returns to take the next
+// request. A completion thread replies once the backend is done. Thus, a handful of workers can keep a deep queue
+// against a slow (e.g. network) source filesystem instead of each blocking on one syscall.
+//
+// Every request carries its own `TimerGuard`, constructed at submission and destroyed after the reply, so the
+// recorded duration is the submission-to-completion latency.
+class UringEngine {
+ public:
+  // Throws `std::system_error` if the ring can not be set up. Starts the completion thread, so only construct it
+  // after daemonizing.
+  explicit UringEngine(unsigned int depth);
+  ~UringEngine();
+  UringEngine(const UringEngine &) = delete;
+  UringEngine &operator=(const UringEngine &) = delete;
+
+  // Each returns false without replying if the ring is full; the caller then falls back to the synchronous path
+  bool read(fuse_req_t req, FileHandle *fh, size_t size, off_t offset);
+  bool write(fuse_req_t req, FileHandle *fh, const char *buf, size_t size, off_t offset);
+  bool fsync(fuse_req_t req, FileHandle *fh, bool datasync);
+
+  // Waits for all requests in flight and stops the completion thread. Must happen before the session goes away.
+  void stop();
+
+ private:
+  struct Request;
+
+  io_uring_sqe *get_sqe();
+  void submit(io_uring_sqe *sqe, Request *request);
+  void complete(Request &request, int res);
+  void run();
+
+  io_uring m_ring;
+  std::mutex m_submit_mutex;  // The submission queue is single-producer
+  std::atomic<size_t> m_in_flight{0};
+  ObjectPool<Request> m_requests;
+  std::thread m_completer;
+};
+
+#endif
@@ -0,0 +1,100 @@
+#include "workers.hh"
+
+#include <sched.h>
+
+#include <print>
+
+// Returns the slot to the pool when its worker exits
+struct Workers::Lease {
+  Slot *slot{nullptr};
+  ~Lease() {
+    if (slot) {
+      Workers::instance().release(*slot);
+    }
+  }
+};
+
+void Workers::configure(const LoopOptions &options) {
+  m_options = options;
+  m_active = options.pin_cpus || options.worker_stats;
+
+  if (options.pin_cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (::sched_getaffinity(0, sizeof(set), &set) == 0) {
+      for (size_t cpu{0}; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) {
+          m_cpus.push_back(static_cast<int>(cpu));
+        }
+      }
+    }
+  }
+}
+
+Workers::Slot &Workers::current() {
+  thread_local Lease lease;
+  if (!lease.slot) {
+    lease.slot = &acquire();
+  }
+  return *lease.slot;
+}
+
+Workers::Slot &Workers::acquire() {
+  Slot *slot{nullptr};
+  size_t index{0};
+  {
+    std::lock_guard lock{m_mutex};
+    for (; index < m_slots.size(); ++index) {
+      if (!m_slots[index].in_use) {
+        slot = &m_slots[index];
+        break;
+      }
+    }
+    if (!slot) {
+      slot = &m_slots.emplace_back();
+    }
+    slot->in_use = true;
+    // A recycled slot keeps its CPU
+    if (m_options.pin_cpus && !m_cpus.empty() && slot->cpu == -1) {
+      slot->cpu = m_cpus[index % m_cpus.size()];
+    }
+  }
+
+  if (slot->cpu != -1) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(static_cast<size_t>(slot->cpu), &set);
+    if (::sched_setaffinity(0, sizeof(set), &set) != 0) {
+      std::println(stderr, "Failed to pin worker {} to CPU {}", index, slot->cpu);
+    }
+  }
+  return *slot;
+}
+
+void Workers::release(Slot &slot) {
+  std::lock_guard lock{m_mutex};
+  slot.in_use = false;
+}
+
+void Workers::write_prometheus(std::ostream &os) const {
+  os << "# HELP iofs_workers_max Maximum number of FUSE worker threads.\n";
+  os << "# TYPE iofs_workers_max gauge\n";
+  os << "iofs_workers_max{clone_fd=\"" << (m_options.clone_fd ? 1 : 0) << "\"} " << m_options.workers << '\n';
+
+  if (!m_options.worker_stats) {
+    return;
+  }
+  std::lock_guard lock{m_mutex};
+  os << "# HELP iofs_worker_ops_total Ops handled by each FUSE worker slot.\n";
+  os << "# TYPE iofs_worker_ops_total counter\n";
+  for (size_t i{0}; i < m_slots.size(); ++i) {
+    os << "iofs_worker_ops_total{worker=\"" << i << "\",cpu=\"" << m_slots[i].cpu << "\"} "
+       << m_slots[i].ops.load(std::memory_order_relaxed) << '\n';
+  }
+  os << "# HELP iofs_worker_busy_ns_total Nanoseconds each FUSE worker slot spent inside ops.\n";
+  os << "# TYPE iofs_worker_busy_ns_total counter\n";
+  for (size_t i{0}; i < m_slots.size(); ++i) {
+    os << "iofs_worker_busy_ns_total{worker=\"" << i << "\",cpu=\"" << m_slots[i].cpu << "\"} "
+       << m_slots[i].busy_ns.load(std::memory_order_relaxed) << '\n';
+  }
+}
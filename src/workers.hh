@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#include "session_loop.hh"
+
+// Per-worker utilization and CPU pinning.
+//
+// libfuse creates and retires its workers on its own and has no hook for thread start, so a worker registers lazily
+// on its first op. Slots of exited workers are recycled: the exported `worker` label is a slot index rather than a
+// thread id, and its counters keep growing across all threads that used the slot. That keeps the series bounded by
+// `LoopOptions::workers` and monotonic, as Prometheus counters must be.
+class Workers {
+ public:
+  static Workers &instance() {
+    static Workers inst{};
+    return inst;
+  }
+
+  // Must be called before the session loop starts
+  void configure(const LoopOptions &options);
+
+  // Called by `TimerGuard` at the end of every op; a no-op unless pinning or stats are enabled
+  void account(uint64_t busy_ns) {
+    if (!m_active) {
+      return;
+    }
+    Slot &slot{current()};
+    if (m_options.worker_stats) {
+      slot.ops.fetch_add(1, std::memory_order_relaxed);
+      slot.busy_ns.fetch_add(busy_ns, std::memory_order_relaxed);
+    }
+  }
+
+  // Whether `account` needs the duration of every op
+  bool needs_timing() const { return m_options.worker_stats; }
+
+  void write_prometheus(std::ostream &os) const;
+
+ private:
+  Workers() = default;
+
+  // Each slot is only written by the worker holding it, keep them on separate cache lines
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> ops{0};
+    std::atomic<uint64_t> busy_ns{0};
+    int cpu{-1};         // Set once on first use
+    bool in_use{false};  // guarded by `m_mutex`
+  };
+  struct Lease;
+
+  Slot &current();
+  Slot &acquire();
+  void release(Slot &slot);
+
+  bool m_active{false};
+  LoopOptions m_options;
+  std::vector<int> m_cpus;  // From our affinity mask, for `pin_cpus`
+
+  mutable std::mutex m_mutex;
+  std::deque<Slot> m_slots;  // guarded by `m_mutex`; a deque, so slots never move
+};